@@ -0,0 +1,1002 @@
+/*
+ * Load Generator and Mock Origin for the Proxy Server
+ *
+ * A native replacement for timing a handful of requests from Python:
+ * - Mock origin on a fixed port that answers every GET with a cacheable
+ *   body of a fixed size after an optional fixed delay, and counts what
+ *   it serves so the hit ratio is exact
+ * - Closed-loop load (each connection sends its next request as soon as
+ *   the last response ends) or open-loop load at a fixed request rate,
+ *   timed from the intended send time so a stalled proxy cannot hide
+ *   its own queueing delay
+ * - Keys drawn from a Zipf distribution with a fixed seed, so every run
+ *   asks for the same sequence
+ * - Log-linear latency histograms (HdrHistogram layout, about 0.1%
+ *   precision) reporting p50/p90/p99/p99.9 and the maximum
+ * - Thresholds that fail the run, for gating regressions
+ *
+ * Build: gcc -O2 -o load_test load_test.c -pthread -lm
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#define MAX_EVENTS 256        // Events taken per epoll_wait
+#define REQUEST_BYTES 512     // Largest request line plus headers we send
+#define HIST_SUB_BITS 11      // 2048 sub-buckets: three significant digits
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_HALF_COUNT (HIST_SUB_COUNT / 2)
+#define HIST_MAX_SHIFT 26     // Values up to 2^37 us (about 38 hours)
+#define HIST_BUCKETS (HIST_SUB_COUNT + HIST_MAX_SHIFT * HIST_HALF_COUNT)
+
+// Latency histogram in microseconds. Values below HIST_SUB_COUNT are kept
+// exactly; above that each power of two is split into HIST_HALF_COUNT
+// linear buckets, so the relative error stays under 1/1024
+typedef struct latency_histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    int64_t max;
+} latency_histogram;
+
+// One client connection to the proxy
+typedef struct client_conn {
+    int fd;
+    int busy;                    // A request is outstanding
+    char request[REQUEST_BYTES];
+    int request_len;
+    int request_sent;
+    char* response;
+    int response_len;
+    int response_cap;
+    long expect;                 // Head plus body bytes, once the head is read
+    int64_t start_us;            // Intended (open loop) or actual send time
+    int64_t next_us;             // Open loop: when the next request is due
+    int peer_closed;             // The proxy closed after the last response
+} client_conn;
+
+// One load thread: its own epoll set, connections, RNG and histogram
+typedef struct load_thread {
+    pthread_t thread;
+    int index;
+    int conn_count;
+    client_conn* conns;
+    uint64_t rng;
+    latency_histogram hist;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t status_errors;      // Responses other than 200
+} load_thread;
+
+// One connection accepted by the mock origin
+typedef struct origin_conn {
+    int fd;
+    char in[8192];
+    int in_len;
+    char* out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    int pending;                 // Responses waiting for ready_us
+    int64_t ready_us;
+} origin_conn;
+
+// Options
+char proxy_host[64] = "127.0.0.1";
+int proxy_port = 8080;
+char origin_host[64] = "127.0.0.1";
+int origin_port = 18080;
+int run_origin = 1;              // Serve the mock origin in this process
+int origin_only = 0;             // Serve the mock origin and nothing else
+int thread_count = 1;
+int connections = 16;
+double duration = 10;
+double warmup = 2;
+double rate = 0;                 // Requests per second; 0 = closed loop
+long key_count = 10000;
+double zipf_s = 0.99;
+long body_size = 1024;
+long origin_delay_us = 0;
+uint64_t seed = 1;
+double max_p99_ms = 0;
+double min_rps = 0;
+double min_hit_ratio = -1;
+
+// Shared run state
+double* zipf_cdf = NULL;
+atomic_long origin_requests = 0;
+atomic_int measuring = 0;        // Warm-up finished; record results
+atomic_int stopping = 0;
+char* origin_head = NULL;        // Response head, the same for every request
+size_t origin_head_len = 0;
+char* origin_body = NULL;
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Histogram
+
+static int hist_index(int64_t v) {
+    if (v < 0) {
+        v = 0;
+    }
+    if (v < HIST_SUB_COUNT) {
+        return (int)v;
+    }
+    int shift = 63 - __builtin_clzll((uint64_t)v) - (HIST_SUB_BITS - 1);
+    if (shift > HIST_MAX_SHIFT) {
+        return HIST_BUCKETS - 1;
+    }
+    return HIST_SUB_COUNT + (shift - 1) * HIST_HALF_COUNT +
+           (int)((v >> shift) - HIST_HALF_COUNT);
+}
+
+// Largest value that lands in bucket i
+static int64_t hist_value(int i) {
+    if (i < HIST_SUB_COUNT) {
+        return i;
+    }
+    int shift = (i - HIST_SUB_COUNT) / HIST_HALF_COUNT + 1;
+    int64_t sub = (i - HIST_SUB_COUNT) % HIST_HALF_COUNT + HIST_HALF_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(latency_histogram* h, int64_t us) {
+    h->counts[hist_index(us)]++;
+    h->total++;
+    if (us > h->max) {
+        h->max = us;
+    }
+}
+
+static void hist_merge(latency_histogram* into, const latency_histogram* from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+static int64_t hist_percentile(const latency_histogram* h, double p) {
+    if (h->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)ceil(p / 100.0 * h->total);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            int64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+// Keys
+
+// xorshift64*: fast, and the same seed gives the same run
+static uint64_t rng_next(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// Cumulative Zipf weights 1/k^s; key 0 is the most popular
+static void zipf_init(void) {
+    zipf_cdf = malloc(key_count * sizeof(double));
+    if (zipf_cdf == NULL) {
+        perror("Key table allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    double sum = 0;
+    for (long k = 0; k < key_count; k++) {
+        sum += 1.0 / pow((double)(k + 1), zipf_s);
+        zipf_cdf[k] = sum;
+    }
+    for (long k = 0; k < key_count; k++) {
+        zipf_cdf[k] /= sum;
+    }
+}
+
+static long zipf_next(uint64_t* rng) {
+    double u = (rng_next(rng) >> 11) * (1.0 / 9007199254740992.0);
+    long lo = 0;
+    long hi = key_count - 1;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (zipf_cdf[mid] < u) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Mock origin
+
+static void origin_close(int epoll_fd, origin_conn* c) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->out);
+    free(c);
+}
+
+static void origin_queue(origin_conn* c, int count) {
+    size_t need = c->out_len + count * (origin_head_len + body_size);
+    if (need > c->out_cap) {
+        char* grown = realloc(c->out, need);
+        if (grown == NULL) {
+            perror("Origin buffer allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        c->out = grown;
+        c->out_cap = need;
+    }
+    for (int i = 0; i < count; i++) {
+        memcpy(c->out + c->out_len, origin_head, origin_head_len);
+        memcpy(c->out + c->out_len + origin_head_len, origin_body, body_size);
+        c->out_len += origin_head_len + body_size;
+    }
+}
+
+// Returns -1 when the connection should be closed
+static int origin_flush(origin_conn* c) {
+    while (c->out_sent < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->out_sent += n;
+    }
+    c->out_len = c->out_sent = 0;
+    return 0;
+}
+
+// Count every complete request head in the input and queue its response
+static int origin_read(origin_conn* c) {
+    while (1) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n == 0) {
+            return -1;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        c->in_len += n;
+
+        int requests = 0;
+        char* start = c->in;
+        char* end;
+        while ((end = memmem(start, c->in + c->in_len - start, "\r\n\r\n", 4)) != NULL) {
+            requests++;
+            start = end + 4;
+        }
+        c->in_len -= start - c->in;
+        memmove(c->in, start, c->in_len);
+        if (c->in_len == (int)sizeof(c->in)) {
+            return -1;
+        }
+        if (requests > 0) {
+            atomic_fetch_add(&origin_requests, requests);
+            if (origin_delay_us > 0) {
+                if (c->pending == 0) {
+                    c->ready_us = now_us() + origin_delay_us;
+                }
+                c->pending += requests;
+            } else {
+                origin_queue(c, requests);
+            }
+        }
+    }
+    return origin_flush(c);
+}
+
+static int origin_listen(void) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Origin socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(origin_port);
+    if (inet_pton(AF_INET, origin_host, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Origin host must be an IPv4 address: %s\n", origin_host);
+        exit(EXIT_FAILURE);
+    }
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Origin bind failed");
+        exit(EXIT_FAILURE);
+    }
+    if (listen(fd, 4096) < 0) {
+        perror("Origin listen failed");
+        exit(EXIT_FAILURE);
+    }
+    set_nonblocking(fd);
+    return fd;
+}
+
+// One epoll thread is plenty: responses are prebuilt and the point of a
+// mock origin is to be cheaper than the proxy in front of it
+static void* origin_thread(void* arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    // Connections with delayed responses, scanned when a timer is due
+    origin_conn** delayed = NULL;
+    int delayed_count = 0;
+    int delayed_cap = 0;
+
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int timeout = -1;
+        if (delayed_count > 0) {
+            int64_t soonest = INT64_MAX;
+            for (int i = 0; i < delayed_count; i++) {
+                if (delayed[i]->ready_us < soonest) {
+                    soonest = delayed[i]->ready_us;
+                }
+            }
+            int64_t wait = soonest - now_us();
+            timeout = wait <= 0 ? 0 : (int)((wait + 999) / 1000);
+        }
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            origin_conn* c = events[i].data.ptr;
+            if (c == NULL) {
+                int fd;
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    origin_conn* nc = calloc(1, sizeof(origin_conn));
+                    if (nc == NULL) {
+                        close(fd);
+                        continue;
+                    }
+                    int one = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                    nc->fd = fd;
+                    struct epoll_event cev = {.events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = nc};
+                    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &cev);
+                }
+                continue;
+            }
+            int had_pending = c->pending;
+            int rc = (events[i].events & (EPOLLERR | EPOLLHUP)) ? -1 : origin_read(c);
+            if (rc < 0) {
+                for (int d = 0; d < delayed_count; d++) {
+                    if (delayed[d] == c) {
+                        delayed[d] = delayed[--delayed_count];
+                        break;
+                    }
+                }
+                origin_close(epoll_fd, c);
+                continue;
+            }
+            if (had_pending == 0 && c->pending > 0) {
+                if (delayed_count == delayed_cap) {
+                    delayed_cap = delayed_cap ? delayed_cap * 2 : 64;
+                    delayed = realloc(delayed, delayed_cap * sizeof(*delayed));
+                    if (delayed == NULL) {
+                        perror("Origin timer allocation failed");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                delayed[delayed_count++] = c;
+            }
+        }
+
+        int64_t now = now_us();
+        for (int d = 0; d < delayed_count;) {
+            origin_conn* c = delayed[d];
+            if (c->ready_us > now) {
+                d++;
+                continue;
+            }
+            origin_queue(c, c->pending);
+            c->pending = 0;
+            delayed[d] = delayed[--delayed_count];
+            if (origin_flush(c) < 0) {
+                origin_close(epoll_fd, c);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void origin_start(void) {
+    char head[256];
+    origin_head_len = snprintf(head, sizeof(head),
+                               "HTTP/1.1 200 OK\r\n"
+                               "Content-Type: application/octet-stream\r\n"
+                               "Content-Length: %ld\r\n"
+                               "Cache-Control: max-age=3600\r\n"
+                               "\r\n", body_size);
+    origin_head = strdup(head);
+    origin_body = malloc(body_size > 0 ? body_size : 1);
+    if (origin_head == NULL || origin_body == NULL) {
+        perror("Origin response allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(origin_body, 'x', body_size);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, origin_thread, (void*)(intptr_t)origin_listen()) != 0) {
+        perror("Origin thread creation failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+// Load generator
+
+static int client_connect(int epoll_fd, client_conn* c) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(proxy_port);
+    inet_pton(AF_INET, proxy_host, &addr.sin_addr);
+    // Connect blocking: it is quick on a LAN and keeps the state machine small
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    set_nonblocking(fd);
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        return -1;
+    }
+    c->fd = fd;
+    c->busy = 0;
+    c->response_len = 0;
+    c->expect = -1;
+    c->peer_closed = 0;
+    return 0;
+}
+
+// The proxy may close a keep-alive connection between responses (after
+// its per-connection request limit, say). Reopen it without counting an
+// error, resending the request it may already have been given
+static void client_reopen(load_thread* t, int epoll_fd, client_conn* c) {
+    int busy = c->busy;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    if (client_connect(epoll_fd, c) < 0) {
+        if (atomic_load(&measuring)) {
+            t->errors++;
+        }
+        return;
+    }
+    if (busy) {
+        c->busy = 1;
+        c->request_sent = 0;
+    }
+}
+
+static void client_reset(load_thread* t, int epoll_fd, client_conn* c) {
+    if (c->fd >= 0) {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+        close(c->fd);
+        c->fd = -1;
+    }
+    if (atomic_load(&measuring)) {
+        t->errors++;
+    }
+    c->busy = 0;
+    if (!atomic_load(&stopping) && client_connect(epoll_fd, c) < 0) {
+        c->fd = -1;
+    }
+}
+
+static void client_send(load_thread* t, client_conn* c, int64_t start) {
+    long key = zipf_next(&t->rng);
+    c->request_len = snprintf(c->request, sizeof(c->request),
+                              "GET http://%s:%d/k/%ld HTTP/1.1\r\n"
+                              "Host: %s:%d\r\n"
+                              "\r\n", origin_host, origin_port, key, origin_host, origin_port);
+    c->request_sent = 0;
+    c->response_len = 0;
+    c->expect = -1;
+    c->start_us = start;
+    c->busy = 1;
+}
+
+// Returns -1 on a write error
+static int client_write(client_conn* c) {
+    while (c->busy && c->request_sent < c->request_len) {
+        ssize_t n = send(c->fd, c->request + c->request_sent,
+                         c->request_len - c->request_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->request_sent += n;
+    }
+    return 0;
+}
+
+// Read what has arrived. Returns 1 when the response is complete, 0 when
+// more is expected, -2 if the connection closed before any of it and -1
+// on error
+static int client_read(load_thread* t, client_conn* c) {
+    while (1) {
+        if (c->response_cap - c->response_len < 4096) {
+            int cap = c->response_cap ? c->response_cap * 2 : 16384;
+            char* grown = realloc(c->response, cap);
+            if (grown == NULL) {
+                return -1;
+            }
+            c->response = grown;
+            c->response_cap = cap;
+        }
+        ssize_t n = recv(c->fd, c->response + c->response_len,
+                         c->response_cap - c->response_len - 1, 0);
+        if (n == 0) {
+            return c->response_len == 0 ? -2 : -1;
+        }
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        c->response_len += n;
+        c->response[c->response_len] = '\0';
+
+        if (c->expect < 0) {
+            char* end = strstr(c->response, "\r\n\r\n");
+            if (end == NULL) {
+                continue;
+            }
+            long head = end + 4 - c->response;
+            if (strncmp(c->response, "HTTP/1.", 7) != 0) {
+                return -1;
+            }
+            if (strncmp(c->response + 9, "200", 3) != 0 && atomic_load(&measuring)) {
+                t->status_errors++;
+            }
+            char* cl = strcasestr(c->response, "\r\nContent-Length:");
+            if (cl == NULL || cl > end) {
+                return -1;  // The mock origin always sends Content-Length
+            }
+            c->expect = head + atol(cl + 17);
+        }
+        if (c->response_len >= c->expect) {
+            if (c->response_len > c->expect) {
+                return -1;  // Nothing else was asked for
+            }
+            // Edge-triggered: a FIN that came with the last bytes raises no
+            // further event, so look for it now
+            char b;
+            c->peer_closed = recv(c->fd, &b, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+            return 1;
+        }
+    }
+}
+
+static void* load_thread_run(void* arg) {
+    load_thread* t = arg;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        exit(EXIT_FAILURE);
+    }
+    // Open loop: spread each connection's share of the rate evenly and
+    // stagger the connections so requests do not arrive in bursts
+    int64_t interval = rate > 0 ? (int64_t)(1e6 * connections / rate) : 0;
+    int64_t begin = now_us();
+    for (int i = 0; i < t->conn_count; i++) {
+        client_conn* c = &t->conns[i];
+        c->fd = -1;
+        if (client_connect(epoll_fd, c) < 0) {
+            perror("Connecting to the proxy failed");
+            exit(EXIT_FAILURE);
+        }
+        int global = t->index + i * thread_count;
+        c->next_us = begin + (interval * global) / connections;
+        if (interval == 0) {
+            client_send(t, c, now_us());
+            client_write(c);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!atomic_load(&stopping)) {
+        int timeout = 100;
+        int64_t now = now_us();
+        if (interval > 0) {
+            for (int i = 0; i < t->conn_count; i++) {
+                client_conn* c = &t->conns[i];
+                if (c->fd >= 0 && !c->busy) {
+                    int64_t wait = c->next_us - now;
+                    int ms = wait <= 0 ? 0 : (int)((wait + 999) / 1000);
+                    if (ms < timeout) {
+                        timeout = ms;
+                    }
+                }
+            }
+        }
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            client_conn* c = events[i].data.ptr;
+            if (c->fd < 0) {
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                // A reset with nothing yet read is the keep-alive close race
+                if (c->busy && c->response_len == 0) {
+                    client_reopen(t, epoll_fd, c);
+                    if (c->fd >= 0 && client_write(c) < 0) {
+                        client_reset(t, epoll_fd, c);
+                    }
+                } else {
+                    client_reset(t, epoll_fd, c);
+                }
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && client_write(c) < 0) {
+                client_reset(t, epoll_fd, c);
+                continue;
+            }
+            if (!(events[i].events & EPOLLIN) || !c->busy) {
+                continue;
+            }
+            int rc = client_read(t, c);
+            if (rc == -2) {
+                client_reopen(t, epoll_fd, c);
+                if (c->fd >= 0 && client_write(c) < 0) {
+                    client_reset(t, epoll_fd, c);
+                }
+                continue;
+            }
+            if (rc < 0) {
+                client_reset(t, epoll_fd, c);
+                continue;
+            }
+            if (rc == 0) {
+                continue;
+            }
+            int64_t done = now_us();
+            if (atomic_load(&measuring)) {
+                hist_record(&t->hist, done - c->start_us);
+                t->completed++;
+            }
+            c->busy = 0;
+            if (c->peer_closed) {
+                client_reopen(t, epoll_fd, c);
+                if (c->fd < 0) {
+                    continue;
+                }
+            }
+            if (interval == 0) {
+                client_send(t, c, done);
+                if (client_write(c) < 0) {
+                    client_reset(t, epoll_fd, c);
+                }
+            }
+        }
+
+        // Open loop: a late connection sends at once but is still timed
+        // from when its request was due
+        if (interval > 0) {
+            now = now_us();
+            for (int i = 0; i < t->conn_count; i++) {
+                client_conn* c = &t->conns[i];
+                if (c->fd < 0) {
+                    client_connect(epoll_fd, c);
+                    continue;
+                }
+                if (!c->busy && c->next_us <= now) {
+                    client_send(t, c, c->next_us);
+                    c->next_us += interval;
+                    if (client_write(c) < 0) {
+                        client_reset(t, epoll_fd, c);
+                    }
+                }
+            }
+        } else {
+            for (int i = 0; i < t->conn_count; i++) {
+                client_conn* c = &t->conns[i];
+                if (c->fd < 0 && client_connect(epoll_fd, c) < 0) {
+                    continue;
+                }
+                if (!c->busy) {
+                    client_send(t, c, now_us());
+                    if (client_write(c) < 0) {
+                        client_reset(t, epoll_fd, c);
+                    }
+                }
+            }
+        }
+    }
+    for (int i = 0; i < t->conn_count; i++) {
+        if (t->conns[i].fd >= 0) {
+            close(t->conns[i].fd);
+        }
+        free(t->conns[i].response);
+    }
+    close(epoll_fd);
+    return NULL;
+}
+
+static void sleep_seconds(double s) {
+    struct timespec ts = {(time_t)s, (long)((s - (time_t)s) * 1e9)};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+static void parse_address(const char* arg, char* host, size_t host_size, int* port) {
+    const char* colon = strrchr(arg, ':');
+    if (colon == NULL) {
+        fprintf(stderr, "Expected host:port, got %s\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    snprintf(host, host_size, "%.*s", (int)(colon - arg), arg);
+    *port = atoi(colon + 1);
+}
+
+static void usage(const char* prog) {
+    printf("Usage: %s [options]\n"
+           "  -p, --proxy host:port      proxy to load (default 127.0.0.1:8080)\n"
+           "  -o, --origin host:port     mock origin address (default 127.0.0.1:18080)\n"
+           "  -X, --external-origin      the origin runs elsewhere; no hit ratio\n"
+           "  -O, --origin-only          only serve the mock origin\n"
+           "  -t, --threads n            load threads (default 1)\n"
+           "  -c, --connections n        connections across all threads (default 16)\n"
+           "  -d, --duration s           measured seconds (default 10)\n"
+           "  -w, --warmup s             unmeasured seconds first (default 2)\n"
+           "  -r, --rate n               open loop at n requests/s (default closed loop)\n"
+           "  -k, --keys n               distinct keys (default 10000)\n"
+           "  -s, --zipf s               Zipf exponent, 0 for uniform (default 0.99)\n"
+           "  -b, --body n               response body bytes (default 1024)\n"
+           "  -l, --origin-delay us      mock origin delay per request (default 0)\n"
+           "  -S, --seed n               key sequence seed (default 1)\n"
+           "      --max-p99 ms           fail if p99 is above this\n"
+           "      --min-rps n            fail if throughput is below this\n"
+           "      --min-hit-ratio r      fail if the hit ratio is below this\n", prog);
+}
+
+int main(int argc, char* argv[]) {
+    static struct option options[] = {
+        {"proxy", required_argument, NULL, 'p'},
+        {"origin", required_argument, NULL, 'o'},
+        {"external-origin", no_argument, NULL, 'X'},
+        {"origin-only", no_argument, NULL, 'O'},
+        {"threads", required_argument, NULL, 't'},
+        {"connections", required_argument, NULL, 'c'},
+        {"duration", required_argument, NULL, 'd'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"rate", required_argument, NULL, 'r'},
+        {"keys", required_argument, NULL, 'k'},
+        {"zipf", required_argument, NULL, 's'},
+        {"body", required_argument, NULL, 'b'},
+        {"origin-delay", required_argument, NULL, 'l'},
+        {"seed", required_argument, NULL, 'S'},
+        {"max-p99", required_argument, NULL, 1},
+        {"min-rps", required_argument, NULL, 2},
+        {"min-hit-ratio", required_argument, NULL, 3},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "p:o:XOt:c:d:w:r:k:s:b:l:S:h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'p':
+                parse_address(optarg, proxy_host, sizeof(proxy_host), &proxy_port);
+                break;
+            case 'o':
+                parse_address(optarg, origin_host, sizeof(origin_host), &origin_port);
+                break;
+            case 'X':
+                run_origin = 0;
+                break;
+            case 'O':
+                origin_only = 1;
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'w':
+                warmup = atof(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                break;
+            case 'k':
+                key_count = atol(optarg);
+                break;
+            case 's':
+                zipf_s = atof(optarg);
+                break;
+            case 'b':
+                body_size = atol(optarg);
+                break;
+            case 'l':
+                origin_delay_us = atol(optarg);
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 10);
+                break;
+            case 1:
+                max_p99_ms = atof(optarg);
+                break;
+            case 2:
+                min_rps = atof(optarg);
+                break;
+            case 3:
+                min_hit_ratio = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (thread_count < 1 || connections < thread_count || key_count < 1 ||
+        body_size < 0 || duration <= 0 || warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (origin_only) {
+        origin_start();
+        printf("Mock origin serving %ld-byte bodies on %s:%d\n", body_size, origin_host, origin_port);
+        while (1) {
+            pause();
+        }
+    }
+    if (run_origin) {
+        origin_start();
+    }
+    zipf_init();
+
+    load_thread* threads = calloc(thread_count, sizeof(load_thread));
+    if (threads == NULL) {
+        perror("Thread allocation failed");
+        return 1;
+    }
+    for (int i = 0; i < thread_count; i++) {
+        load_thread* t = &threads[i];
+        t->index = i;
+        t->conn_count = connections / thread_count + (i < connections % thread_count);
+        t->conns = calloc(t->conn_count, sizeof(client_conn));
+        // splitmix64 of the seed and thread, never zero
+        uint64_t z = seed + 0x9E3779B97F4A7C15ULL * (i + 1);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        t->rng = (z ^ (z >> 31)) | 1;
+        if (t->conns == NULL) {
+            perror("Connection allocation failed");
+            return 1;
+        }
+    }
+    for (int i = 0; i < thread_count; i++) {
+        if (pthread_create(&threads[i].thread, NULL, load_thread_run, &threads[i]) != 0) {
+            perror("Load thread creation failed");
+            return 1;
+        }
+    }
+
+    sleep_seconds(warmup);
+    long origin_before = atomic_load(&origin_requests);
+    int64_t measure_start = now_us();
+    atomic_store(&measuring, 1);
+    sleep_seconds(duration);
+    atomic_store(&measuring, 0);
+    int64_t measure_end = now_us();
+    long origin_after = atomic_load(&origin_requests);
+    atomic_store(&stopping, 1);
+
+    latency_histogram* total = calloc(1, sizeof(latency_histogram));
+    uint64_t completed = 0;
+    uint64_t errors = 0;
+    uint64_t status_errors = 0;
+    for (int i = 0; i < thread_count; i++) {
+        pthread_join(threads[i].thread, NULL);
+        hist_merge(total, &threads[i].hist);
+        completed += threads[i].completed;
+        errors += threads[i].errors;
+        status_errors += threads[i].status_errors;
+    }
+
+    double seconds = (measure_end - measure_start) / 1e6;
+    double rps = completed / seconds;
+    printf("Load: %s, %d connections on %d threads, %ld keys, zipf %.2f, %ld-byte bodies\n",
+           rate > 0 ? "open loop" : "closed loop", connections, thread_count,
+           key_count, zipf_s, body_size);
+    if (rate > 0) {
+        printf("Target rate: %.0f requests/s\n", rate);
+    }
+    printf("Requests: %lu in %.2fs, %.0f requests/s\n", completed, seconds, rps);
+    printf("Errors: %lu connection, %lu non-200\n", errors, status_errors);
+    printf("Latency (ms): p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n",
+           hist_percentile(total, 50) / 1000.0, hist_percentile(total, 90) / 1000.0,
+           hist_percentile(total, 99) / 1000.0, hist_percentile(total, 99.9) / 1000.0,
+           total->max / 1000.0);
+    double hit_ratio = -1;
+    if (run_origin && completed > 0) {
+        long misses = origin_after - origin_before;
+        hit_ratio = 1.0 - (double)misses / completed;
+        if (hit_ratio < 0) {
+            hit_ratio = 0;
+        }
+        printf("Hit ratio: %.4f (%ld origin fetches)\n", hit_ratio, misses);
+    }
+
+    int failed = 0;
+    double p99_ms = hist_percentile(total, 99) / 1000.0;
+    if (max_p99_ms > 0 && p99_ms > max_p99_ms) {
+        printf("FAIL: p99 %.3fms is above %.3fms\n", p99_ms, max_p99_ms);
+        failed = 1;
+    }
+    if (min_rps > 0 && rps < min_rps) {
+        printf("FAIL: %.0f requests/s is below %.0f\n", rps, min_rps);
+        failed = 1;
+    }
+    if (min_hit_ratio >= 0) {
+        if (hit_ratio < 0) {
+            printf("FAIL: hit ratio is unknown with an external origin\n");
+            failed = 1;
+        } else if (hit_ratio < min_hit_ratio) {
+            printf("FAIL: hit ratio %.4f is below %.4f\n", hit_ratio, min_hit_ratio);
+            failed = 1;
+        }
+    }
+    int gated = max_p99_ms > 0 || min_rps > 0 || min_hit_ratio >= 0;
+    if (gated && (errors > 0 || status_errors > 0)) {
+        printf("FAIL: %lu requests failed\n", errors + status_errors);
+        failed = 1;
+    }
+    free(total);
+    return failed ? 1 : 0;
+}
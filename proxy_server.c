@@ -1,355 +1,7884 @@
 /*
  * Improved Multithreaded HTTP Proxy Server
- * 
+ *
  * This proxy server handles HTTP GET requests, implementing:
- * - Multithreading for concurrent client connections
- * - LRU caching for improved performance
- * - Thread synchronization using mutexes and semaphores
+ * - Event-driven core: edge-triggered epoll loops multiplexing client and
+ *   upstream sockets (default), the same loops driven by io_uring with
+ *   multishot accept and receive into provided buffers, or a bounded pool
+ *   of worker threads that each serve one connection at a time, stealing
+ *   queued sockets when idle. Each loop has its own SO_REUSEPORT listener
+ *   and may be pinned to a CPU
+ * - Tiered caching: RAM over an optional disk store that takes evicted
+ *   and large responses, serves them with sendfile() and survives
+ *   restarts. RAM eviction is pluggable: LRU, S3-FIFO, or W-TinyLFU with
+ *   size-aware admission, so scans do not flush the hot set. Both tiers
+ *   honour HTTP freshness, revalidating stale entries with conditional
+ *   requests
+ * - stale-while-revalidate background refresh and stale-if-error fallback
+ * - Keep-alive connection pooling to origin servers
+ * - Asynchronous DNS resolution with a shared TTL cache
+ * - Coalescing of concurrent misses on one key into a single fetch
+ * - Persistent client connections with pipelined requests, read by an
+ *   incremental parser that records headers as spans into the buffer
+ * - Streaming relay of responses of any size, with backpressure, through
+ *   pooled refcounted buffers; a miss is captured once as a buffer chain
+ *   that the cache, coalesced clients and the disk writer all share
+ * - Zero-copy splice() relay for large, uncacheable bodies
+ * - Graceful SIGTERM drain, saving a cache snapshot that the next start
+ *   reloads in the background
+ * - Prometheus /metrics on an admin port, from per-thread counters, and
+ *   slow request traces broken down by phase, logged through per-thread
+ *   lock-free rings that a background thread flushes
+ * - Thread synchronization using mutexes, semaphores and lock-free queues
  * - Error handling and HTTP status responses
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <stddef.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <signal.h>
 #include <time.h>
 #include <errno.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/io_uring.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
 
-#define MAX_CLIENTS 10
+#define WORKER_THREADS 64     // Default size of the threads-mode worker pool
+#define WORKER_QUEUE 256      // Accepted sockets queued per worker (power of two)
 #define MAX_BYTES 4096        // 4KB buffer size
-#define MAX_ELEMENT_SIZE 10 * (1<<10)  // Max size of single cache element
-#define MAX_CACHE_SIZE 200 * (1<<20)   // Max total cache size (200MB)
+#define MAX_REQUEST_BYTES (64 * 1024)  // Largest client request buffered, body included
+#define MAX_HEADERS 100       // Header lines accepted per request
+#define MAX_ELEMENT_SIZE 10 * (1<<10)  // Default largest RAM cache element
+#define MAX_ELEMENT_LIMIT IO_BUF_SIZE  // Ceiling on that: one capture buffer, the top slab class
+#define CACHE_SIZE 200        // Default RAM tier size, MB
+#define CONFIG_MAX_LINES 256  // Settings read from one config file
+#define TUNABLE_MAX 32        // Room in startup_config for the tunables
 #define DEFAULT_PORT 8080
+#define MAX_EVENTS 256        // epoll events handled per loop wakeup
+#define URING_ENTRIES 1024    // Submission queue entries per io_uring loop
+#define URING_BUFS 256        // Provided receive buffers per ring (power of two)
+#define URING_BUF_SIZE 4096   // Bytes per provided receive buffer
+#define URING_FILES 4096      // Registered file slots for client sockets per ring
+#define LISTEN_BACKLOG 4096   // Pending connections per listener; the kernel caps it at somaxconn
+#define CACHE_INITIAL_BUCKETS 64       // Hash buckets per shard before first resize (power of two)
+#define CACHE_SHARDS_PER_CPU 4         // Shard count scales with cores to spread lock traffic
+#define POOL_MAX_IDLE 8       // Idle upstream sockets kept per (host, port)
+#define POOL_IDLE_TIMEOUT 30  // Seconds an idle upstream socket stays reusable
+#define POOL_BUCKETS 256      // Hash buckets for the upstream pool table
+#define UPSTREAM_MAX 64       // Backends in the --upstream group
+#define UPSTREAM_TRIES 2      // Backends a request may try before it fails with 502
+#define UPSTREAM_EJECT_FAILURES 5  // Consecutive failed requests that eject a backend
+#define UPSTREAM_EJECT_MS 10000    // First ejection's length; consecutive ones double it
+#define UPSTREAM_EJECT_DOUBLINGS 5 // Cap on that doubling
+#define HEALTH_INTERVAL 5     // Default seconds between active health checks
+#define HEALTH_TIMEOUT 2      // Seconds a check may take to connect and answer
+#define HEALTH_FALLS 2        // Consecutive failed checks that take a backend out
+#define PEER_MAX 64           // Nodes named with --peer
+#define PEER_VNODES 160       // Ring points per node; more spread keys more evenly
+#define PEER_DOWN_MS 5000     // A peer that refused a connection is skipped this long
+#define PEER_RING_GRACE_MS 10000  // A replaced ring is kept at least this long
+#define PEER_HEADER "X-Proxy-Peer"  // Marks a miss one node forwarded to another
+#define LIMIT_BUCKETS 256     // Per-origin miss limiters, chosen by hash
+#define LIMIT_INITIAL 64      // Concurrent misses an origin starts with
+#define LIMIT_MIN 2           // Floor a failing origin's limit backs off to
+#define LIMIT_TOLERANCE 2     // Smoothed TTFB over this multiple of the baseline is congestion
+#define LIMIT_SLACK_US 1000   // Plus this much, so that jitter on fast origins is not
+#define LIMIT_BACKOFF 0.9     // Multiplicative decrease on congestion
+#define LIMIT_DECREASE_MS 100 // At most one decrease this often
+#define LIMIT_BASELINE_MS 30000  // The lowest TTFB seen is relearned this often
+#define DNS_MAX_ADDRS 8       // Addresses kept per name for connect failover
+#define DNS_TTL 60            // Seconds a successful lookup is cached
+#define DNS_NEGATIVE_TTL 5    // Seconds a failed lookup is cached
+#define DNS_BUCKETS 1024      // Hash buckets for the resolver cache
+#define DNS_RESOLVER_THREADS 4  // Threads running getaddrinfo() off the event loops
+#define KEEPALIVE_TIMEOUT 15  // Seconds a client may idle between requests
+#define KEEPALIVE_MAX_REQUESTS 100  // Requests served per client connection
+#define SPLICE_MIN_BYTES (64 * 1024)  // Smallest known body worth a pipe round trip
+#define SPLICE_SPARE_PIPES 16 // Empty pipes each loop keeps for reuse
+#define SLAB_PAGE_SIZE (1 << 20)  // Memory carved into chunks per size-class refill
+#define SLAB_MIN_CHUNK 128    // Smallest size class
+#define SLAB_MAX_CLASSES 64
+#define SLAB_MAGAZINE 32      // Free chunks a thread keeps per size class
+#define COALESCE_MAX_BYTES (64 * 1024)  // Largest response shared with coalesced clients
+#define FLIGHT_BUCKETS 1024   // Hash buckets for the in-flight fetch table
+#define HEURISTIC_FRESHNESS_PERCENT 10     // Of the Last-Modified age, absent an explicit lifetime
+#define HEURISTIC_FRESHNESS_MAX (24 * 3600)  // Cap on that heuristic lifetime, seconds
+#define DISK_BLOCK 4096       // Alignment of records in the disk tier file
+#define DISK_CACHE_SIZE 1024  // Default disk tier size, MB
+#define DISK_MAX_OBJECT (4 << 20)   // Largest response kept; beyond RAM's limit it goes to disk
+#define DISK_QUEUE_MAX (64 << 20)   // Bytes waiting for the disk writer before more are dropped
+#define DISK_BUCKETS 65536    // Hash buckets for the disk tier index
+#define DISK_MAGIC 0x31435850u  // "PXC1" at the start of every record
+#define DISK_RECORD_VARY 1    // Record is a Vary marker
+#define DISK_RECORD_REUSABLE 2  // Response is delimited, so the client connection may persist
+#define CACHE_VARY 1          // add_to_cache(): element is a Vary marker
+#define CACHE_FROM_DISK 2     // add_to_cache(): promoted from the disk tier, which still has it
+#define REFRESH_THREADS 2     // Threads revalidating entries served stale
+#define REFRESH_QUEUE_MAX 256 // Queued refreshes beyond which more are skipped
+#define REFRESH_TIMEOUT 10    // Seconds a background refresh may block on the origin
+#define COMPRESS_THREADS 2    // Threads compressing stored responses with --compress
+#define COMPRESS_QUEUE_MAX 256   // Queued compressions beyond which more are skipped
+#define COMPRESS_MIN_BYTES 512   // Smaller bodies are not worth a variant
+#define COMPRESS_MAX_RATIO 16    // Bodies compressed only if this many times a RAM object
+#define COMPRESS_GZIP_LEVEL 6
+#define COMPRESS_BROTLI_QUALITY 9
+#define CACHE_IF_ABSENT 4     // add_to_cache(): restored from a snapshot; never replaces a live entry
+#define DRAIN_TIMEOUT 30      // Seconds shutdown waits for in-flight connections
+#define SNAPSHOT_MAGIC 0x31534e50u  // "PNS1" at the start of a cache snapshot
+#define SNAPSHOT_RAM 1        // Snapshot record: a RAM entry, data follows the key
+#define SNAPSHOT_DISK 2       // Snapshot record: a disk tier index entry
+#define SNAPSHOT_END 3        // Snapshot record: the file is complete
+#define LATENCY_BUCKETS 13    // Finite histogram buckets, 1ms to 10s
+#define ADMIN_TIMEOUT 5       // Seconds an admin client may take to send or read
+#define ADMIN_ACCEPT_BACKOFF_MS 100  // Pause after a failed accept, e.g. out of descriptors
+#define LOG_RING_BYTES (256 * 1024)  // Log bytes a thread can queue between flushes; a power of two
+#define LOG_LINE_MAX 240      // Longer lines are cut short
+#define LOG_PAD 0xffff        // Record length marking the unused end of a ring
+#define LOG_FLUSH_MS 50       // How often the flusher writes queued lines out
+#define SLOW_REQUEST_MS 1000  // Default --slow-request-ms
+#define SLOW_SAMPLES 64       // Slow request traces kept for /slow
+#define IO_BUF_SIZE (16 * 1024)  // Bytes per pooled I/O buffer; holds any RAM tier entry
+#define IO_BUF_THREAD_CACHE 32   // Free buffers a thread keeps without locking
+#define IO_BUF_POOL_MAX 1024     // Free buffers kept in the shared pool before freeing
+#define CACHE_QUEUES 3        // Queues per shard an eviction policy can use
+#define CACHE_FREQ_MAX 3      // S3-FIFO: saturating per-entry access count
+#define S3FIFO_SMALL_PERCENT 10      // S3-FIFO: share of a shard for entries seen once
+#define TINYLFU_WINDOW_PERCENT 1     // W-TinyLFU: share of a shard for the LRU window
+#define TINYLFU_PROTECTED_PERCENT 80 // W-TinyLFU: share of the main area for reused entries
+#define SKETCH_ENTRY_BYTES 1024      // Mean entry size assumed when sizing sketches and ghosts
+
+// When a stored response may be used: fresh until expires, then stale
+// up to each of the two later limits
+typedef struct cache_freshness {
+    time_t expires;
+    time_t stale_revalidate;
+    time_t stale_error;
+} cache_freshness;
 
 // Cache element structure for LRU implementation
 typedef struct cache_element {
     char* data;              // Cached response data
     int len;                 // Length of cached data
-    char* url;               // URL as cache key
-    time_t lru_time_track;   // Timestamp for LRU tracking
-    struct cache_element* next;  // Next element in linked list
+    char* url;               // Normalized cache key
+    int is_vary;             // Marker whose data lists the Vary header names
+    int from_disk;           // Copy of a disk tier record; not demoted again
+    int reusable;            // Complete and lets the client connection persist
+    _Atomic(time_t) expires; // Wall-clock end of freshness; a 304 pushes it out
+    _Atomic(time_t) stale_revalidate;  // Served stale while refreshing, until this
+    _Atomic(time_t) stale_error;       // Served stale when the origin fails, until this
+    atomic_int refreshing;   // A background refresh is queued or running
+    uint64_t hash;           // Hash of url, selects the shard and bucket
+    atomic_int refcount;     // One for the shard, one per reader still sending it
+    int slab_class;          // Size class of the chunk holding element, url and data
+    size_t charge;           // Bytes of that chunk, charged against the shard
+    struct cache_element* hash_next;  // Next element in the same bucket
+    struct cache_element* queue_prev; // Towards the head of its queue
+    struct cache_element* queue_next; // Towards the tail, which leaves first
+    int queue;               // Which of the shard's queues holds it
+    int freq;                // S3-FIFO: accesses since it was queued
 } cache_element;
 
+// Error response, built once at startup so its Content-Length is exact
+typedef struct canned_response {
+    int status;
+    const char* reason;
+    const char* headers;     // Extra header lines, each ending in CRLF
+    char* text;
+    int len;
+} canned_response;
+
+// Free chunk in a slab size class
+typedef struct slab_chunk {
+    struct slab_chunk* next;
+} slab_chunk;
+
+// Chunks of one size, carved from SLAB_PAGE_SIZE pages
+typedef struct slab_class {
+    pthread_mutex_t lock;
+    size_t size;
+    slab_chunk* free;
+    size_t pages;
+} slab_class;
+
+// Per-thread stash of free chunks so most allocations take no lock
+typedef struct slab_magazine {
+    slab_chunk* chunks[SLAB_MAX_CLASSES];
+    int count[SLAB_MAX_CLASSES];
+} slab_magazine;
+
+// Pooled I/O buffer. Chains link through next; every holder of a chain
+// holds a reference on each of its buffers, and bytes below len never
+// change once another holder can see them
+typedef struct io_buf {
+    atomic_int refs;
+    int len;
+    struct io_buf* next;
+    char data[IO_BUF_SIZE];
+} io_buf;
+
+// Intrusive list of a shard's elements, charged in bytes
+typedef struct cache_queue {
+    cache_element* head;     // Most recently inserted or promoted
+    cache_element* tail;     // Next to leave
+    size_t size;             // Bytes charged to its elements
+} cache_queue;
+
+// Count-min sketch of key popularity: four 4-bit counters per key, sixteen
+// to a word, all halved every sample_limit increments so old hits fade
+typedef struct frequency_sketch {
+    uint64_t* table;
+    size_t mask;             // Words - 1
+    size_t samples;
+    size_t sample_limit;
+} frequency_sketch;
+
+// Independently locked slice of the cache: hash index plus the eviction
+// policy's queues, so lookup, promotion and eviction are O(1) under the
+// shard lock
+typedef struct cache_shard {
+    pthread_mutex_t lock;
+    cache_element** buckets;
+    size_t bucket_count;     // Always a power of two
+    size_t element_count;
+    cache_queue queues[CACHE_QUEUES];  // Roles are the policy's; 0 is the most protected
+    size_t size;             // Bytes charged to this shard
+    size_t capacity;         // This shard's share of the RAM tier size
+    frequency_sketch sketch; // W-TinyLFU: popularity of hits and misses
+    uint64_t* ghost;         // S3-FIFO: keys recently evicted unused, fingerprint << 32 | stamp
+    size_t ghost_mask;
+    uint32_t ghost_clock;    // Ghost insertions so far; ages the stamps
+} cache_shard;
+
+// Queue roles in each policy. Lower numbers are more protected
+enum { LRU_QUEUE = 0 };
+enum { S3FIFO_MAIN = 0, S3FIFO_SMALL = 1 };
+enum { TINYLFU_PROTECTED = 0, TINYLFU_PROBATION = 1, TINYLFU_WINDOW = 2 };
+
+// What stays in a shard and what leaves. Every hook runs under its lock
+typedef struct eviction_policy {
+    const char* name;
+    void (*init)(cache_shard* shard);
+    void (*hit)(cache_shard* shard, cache_element* e);
+    void (*miss)(cache_shard* shard, uint64_t hash);
+    // Queue a new, already indexed element and evict until the shard fits.
+    // Returns 0 if the element itself was turned away; restored skips any
+    // admission test
+    int (*insert)(cache_shard* shard, cache_element* e, int restored);
+} eviction_policy;
+
+// Record header in the disk tier file, followed by the key and the response.
+// Records are DISK_BLOCK aligned so a scan can find them after a restart
+typedef struct disk_record {
+    uint32_t magic;
+    uint32_t key_len;
+    uint32_t data_len;
+    uint32_t flags;          // DISK_RECORD_*
+    uint64_t seq;            // Write order; the newest record of a key wins
+    int64_t expires;
+    int64_t stale_revalidate;
+    int64_t stale_error;
+    uint64_t check;          // FNV-1a of the fields above; rejects torn or overwritten blocks
+} disk_record;
+
+// In-memory index entry for a disk tier record
+typedef struct disk_entry {
+    char* key;
+    uint64_t hash;
+    int is_vary;
+    int reusable;
+    off_t offset;            // Record start in the file
+    off_t length;            // Bytes the record occupies, aligned
+    off_t data_offset;       // Where the response begins
+    uint32_t data_len;
+    uint64_t seq;
+    cache_freshness fresh;
+    atomic_int readers;      // Hits being sent from it; the writer steps around them
+    int indexed;             // Findable by key; not yet superseded or reclaimed
+    struct disk_entry* hash_next;
+    struct disk_entry* fifo_next;  // Next record in ring order
+} disk_entry;
+
+// A response waiting for the disk writer thread
+typedef struct disk_write {
+    cache_element* element;  // Demoted from RAM and referenced, or NULL
+    const char* key;
+    uint64_t hash;
+    int is_vary;
+    int reusable;            // Response is delimited and lets clients persist
+    const char* data;        // Flat response, or NULL to write chain
+    io_buf* chain;           // Referenced capture chain, or NULL
+    int len;
+    cache_freshness fresh;
+    struct disk_write* next;
+} disk_write;
+
+// Start of a cache snapshot file, followed by snapshot_records
+typedef struct snapshot_header {
+    uint32_t magic;
+    uint32_t reserved;
+    int64_t disk_size;       // Disk tier the index records describe, 0 if none
+    int64_t disk_head;
+    uint64_t disk_seq;
+} snapshot_header;
+
+// One saved entry, followed by its key and, for RAM entries, its response
+typedef struct snapshot_record {
+    uint32_t kind;           // SNAPSHOT_*
+    uint32_t flags;          // CACHE_* for RAM entries, DISK_RECORD_* for disk ones
+    uint32_t key_len;
+    uint32_t data_len;
+    int64_t expires;
+    int64_t stale_revalidate;
+    int64_t stale_error;
+    int64_t offset;          // Disk entries: record start in the disk tier file
+    uint64_t seq;            // Disk entries: must match the record header
+} snapshot_record;
+
+// Counters kept per thread and summed when scraped
+typedef enum {
+    STAT_HIT,                // Fresh RAM tier hit
+    STAT_DISK_HIT,           // Fresh disk tier hit sent with sendfile()
+    STAT_STALE,              // Served stale while refreshing in the background
+    STAT_COALESCED,          // Followed another request's in-flight fetch
+    STAT_REVALIDATE,         // Stale entry checked with the origin first
+    STAT_PEER,               // Fetched through the peer owning the key
+    STAT_SHED,               // Miss refused with 503: its origin was at its limit
+    STAT_MISS,               // Fetched from the origin
+    STAT_EVICTIONS,
+    STAT_BYTES_CACHE,        // Response bytes sent from either cache tier
+    STAT_BYTES_ORIGIN,       // Response bytes relayed from origins
+    STAT_CONN_OPENED,
+    STAT_CONN_CLOSED,
+    STAT_COUNTERS
+} stat_counter;
+
+typedef enum {
+    HIST_CONNECT,            // New upstream connection established
+    HIST_TTFB,               // Request sent upstream to first response byte
+    HIST_TOTAL,              // Request read to response written
+    HIST_COUNT
+} stat_histogram;
+
+typedef struct latency_histogram {
+    _Atomic uint64_t buckets[LATENCY_BUCKETS + 1];  // Last one is +Inf
+    _Atomic uint64_t sum_us;
+} latency_histogram;
+
+// One thread's metrics, cache-line aligned so no two threads share a line
+typedef struct thread_stats {
+    _Atomic uint64_t counters[STAT_COUNTERS];
+    latency_histogram latency[HIST_COUNT];
+    struct thread_stats* next;
+} __attribute__((aligned(64))) thread_stats;
+
+// A queued line, padded to 4 bytes; never split across the ring's end
+typedef struct log_record {
+    uint16_t len;                   // Of text, or LOG_PAD
+    uint8_t to_stderr;
+    char text[];                    // Not NUL-terminated
+} log_record;
+
+// One thread's queued log lines: it writes head and the flusher tail,
+// each on its own cache line. Both are byte counts that only grow
+typedef struct log_ring {
+    _Atomic uint32_t head;
+    _Atomic uint64_t dropped;       // Lines lost to a full ring; written by the thread
+    struct log_ring* next;
+    _Atomic uint32_t tail __attribute__((aligned(64)));
+    uint64_t dropped_reported;      // Flusher only
+    char data[LOG_RING_BYTES] __attribute__((aligned(64)));
+} __attribute__((aligned(64))) log_ring;
+
+// When each phase of a request ended, in monotonic us; 0 if it did not
+// happen. The first request of a connection also has its accept time
+typedef enum {
+    TRACE_ACCEPT,            // Connection accepted
+    TRACE_PARSE,             // Request head read and parsed
+    TRACE_LOOKUP,            // Cache consulted
+    TRACE_DNS,               // Upstream address resolved
+    TRACE_CONNECT,           // New upstream connection established
+    TRACE_TTFB,              // First response byte from upstream
+    TRACE_DONE,              // Response written
+    TRACE_MARKS
+} trace_mark;
+
+// How accepted connections are driven
+typedef enum {
+    RUNTIME_EPOLL,           // Fixed set of event loops, one per thread
+    RUNTIME_URING,           // The same loops, waiting on io_uring instead of epoll
+    RUNTIME_THREADS          // Worker pool; each worker serves one connection at a time
+} runtime_mode;
+
+// Options that shape threads, listeners and files. They are read once at
+// startup; a reload parses them but keeps the running values
+typedef struct startup_config {
+    runtime_mode mode;
+    const char* config_path;
+    const char* disk_path;
+    const char* snapshot_path;
+    const char* eviction;
+    const char* upstreams[UPSTREAM_MAX];
+    int upstream_count;
+    const char* health_path;
+    const char* peers[PEER_MAX];
+    int peer_count;
+    const char* peer_self;
+    int admin_port;
+    long disk_mb;
+    long num_loops;
+    long num_workers;
+    int reuse_port;
+    int pin_cpus;
+    int numa;
+    int values[TUNABLE_MAX];       // The tunables as parsed, in tunables[] order
+} startup_config;
+
+// A setting a reload may change, and the default it starts again from.
+// Loops read the live values while a reload is parsed, so they change
+// only once the whole configuration has been accepted
+typedef struct tunable {
+    atomic_int* value;
+    int fallback;
+} tunable;
+
+// Cell of a worker queue; seq says whether it is free or holds a socket
+typedef struct worker_slot {
+    atomic_size_t seq;
+    int fd;
+} worker_slot;
+
+// Pool thread with a bounded lock-free queue (Vyukov's MPMC ring) of
+// accepted sockets: the acceptor pushes, the owner pops and idle workers
+// steal from the head as well
+typedef struct worker {
+    worker_slot slots[WORKER_QUEUE];
+    atomic_size_t head;      // Next socket to take
+    atomic_size_t tail;      // Next free cell; only the acceptor moves it
+    atomic_int sleeping;     // Waiting on wake with nothing to take or steal
+    sem_t wake;              // Posted once per socket pushed, and at shutdown
+    struct event_loop* loop; // Reused for every connection the worker serves
+} worker;
+
+// Idle keep-alive socket to an origin
+typedef struct pooled_socket {
+    int fd;
+    time_t idle_since;
+    struct pooled_socket* next;
+} pooled_socket;
+
+// Idle sockets for one (host, port), most recently used first
+typedef struct upstream_pool {
+    char host[256];
+    int port;
+    int idle_count;
+    pooled_socket* idle;
+    struct upstream_pool* next;
+} upstream_pool;
+
+// How a request picks its backend from the upstream group
+typedef enum {
+    BALANCE_P2C,             // The less loaded of two picked at random
+    BALANCE_LEAST            // Least outstanding requests over the whole group
+} balance_policy;
+
+// One origin server of the --upstream group. Its idle sockets live in the
+// pool under its own (host, port)
+typedef struct upstream_backend {
+    char host[256];
+    int port;
+    atomic_int outstanding;        // Requests sent to it and not yet finished
+    atomic_int failures;           // Consecutive failed requests
+    atomic_int ejections;          // Consecutive ejections; each doubles the next
+    _Atomic int64_t ejected_until; // Monotonic ms until which it takes no traffic
+    atomic_int healthy;            // Active checks pass, or are off
+    int check_failures;            // Consecutive failed checks; health thread only
+    _Atomic uint64_t ejected_total;
+} upstream_backend;
+
+typedef struct peer_node {
+    char host[256];
+    int port;
+    _Atomic int64_t down_until;    // Monotonic ms until which its keys go to the origin
+} peer_node;
+
+typedef struct peer_point {
+    uint64_t hash;
+    int node;
+} peer_point;
+
+// Adaptive limit on one origin's concurrent misses
+typedef struct miss_limiter {
+    atomic_int inflight;           // Misses holding a slot
+    atomic_int limit;              // Whole part of estimate, read without the lock
+    pthread_mutex_t lock;          // Guards the rest
+    double estimate;
+    int64_t smoothed_us;           // Moving average of time to first byte
+    int64_t baseline_us;           // Lowest time to first byte lately
+    int64_t window_min_us;         // Lowest since window_start_ms, the next baseline
+    int64_t window_start_ms;
+    int64_t last_decrease_ms;
+} miss_limiter;
+
+// Nodes on the consistent-hash ring, node 0 being this one; immutable once
+// published, a reload builds a new one
+typedef struct peer_ring {
+    peer_node* nodes;
+    int count;
+    peer_point* points;            // Sorted by hash
+    int point_count;
+    atomic_int refs;               // Connections whose peer is one of its nodes
+    int64_t retired_ms;            // When a reload replaced it
+    struct peer_ring* next_retired;
+} peer_ring;
+
+// Addresses for one name, in getaddrinfo() preference order
+typedef struct dns_result {
+    int count;
+    struct sockaddr_storage addr[DNS_MAX_ADDRS];
+    socklen_t addr_len[DNS_MAX_ADDRS];
+} dns_result;
+
+// Refcounted eventfd used to wake a loop from another thread; outlives the
+// loop while resolver callbacks still hold references
+typedef struct loop_waker {
+    atomic_int refs;
+    int fd;
+} loop_waker;
+
+typedef enum {
+    DNS_PENDING,             // Queued for or inside a resolver thread
+    DNS_READY                // Result (or negative answer) valid until expires
+} dns_state;
+
+// Resolver cache entry, shared by all loops
+typedef struct dns_entry {
+    char host[256];
+    dns_state state;
+    int error;               // getaddrinfo() error for negative answers, else 0
+    time_t expires;
+    dns_result result;
+    loop_waker** waiters;    // Loops to wake when the lookup completes
+    int waiter_count;
+    int waiter_capacity;
+    struct dns_entry* next;  // Bucket chain
+    struct dns_entry* queue_next;
+} dns_entry;
+
+typedef enum {
+    FLIGHT_ACTIVE,           // Leader still fetching; bytes may be published
+    FLIGHT_DONE,             // Whole response published
+    FLIGHT_ABANDONED         // Not shareable or failed; waiters fetch for themselves
+} flight_state;
+
+// A cache miss fetched once for every client asking for the same key in the
+// meantime. Only the leader writes, and published bytes never move, so
+// waiters on any loop read them without a lock
+typedef struct flight {
+    atomic_int refs;         // Table, leader and each waiter
+    _Atomic flight_state state;
+    atomic_int published;    // Bytes of blocks readable by waiters
+    int keep_alive;          // Response is delimited and lets clients persist
+    io_buf* blocks[COALESCE_MAX_BYTES / IO_BUF_SIZE];  // The leader's capture chain, referenced
+    char* key;
+    uint64_t hash;
+    pthread_mutex_t lock;    // Guards waiters
+    loop_waker** waiters;    // Loops to wake as bytes are published
+    int waiter_count;
+    int waiter_capacity;
+    struct flight* next;     // Bucket chain, while FLIGHT_ACTIVE
+} flight;
+
+// What an epoll registration refers to
+typedef enum {
+    HANDLE_LISTENER,
+    HANDLE_CLIENT,
+    HANDLE_UPSTREAM,
+    HANDLE_WAKER
+} handle_kind;
+
+// Per-request progress of a connection through the proxy
+typedef enum {
+    CONN_READ_REQUEST,       // Reading request headers from the client
+    CONN_RESOLVING,          // Waiting for the resolver to look up the origin
+    CONN_CONNECTING,         // Non-blocking connect to origin in progress
+    CONN_SEND_REQUEST,       // Forwarding the request to the origin
+    CONN_READ_RESPONSE,      // Reading the origin's response headers
+    CONN_RELAY_RESPONSE,     // Streaming the origin's response to the client
+    CONN_SEND_RESPONSE,      // Writing a cached or error response to the client
+    CONN_FOLLOW_FLIGHT,      // Streaming another request's in-flight fetch to the client
+    CONN_SEND_FILE,          // Writing a disk tier hit to the client with sendfile()
+    CONN_CLOSED
+} conn_state;
+
+// How the end of a response body is found
+typedef enum {
+    BODY_NONE,               // HEAD, 1xx, 204 and 304 carry no body
+    BODY_LENGTH,             // Content-Length bytes
+    BODY_CHUNKED,            // Until the last-chunk and trailer are seen
+    BODY_UNTIL_CLOSE         // Until the origin closes the connection
+} body_framing;
+
+typedef enum {
+    CHUNK_SIZE,              // Hex chunk size
+    CHUNK_EXT,               // Extension after the size, up to LF
+    CHUNK_DATA,
+    CHUNK_DATA_END,          // CRLF after the data
+    CHUNK_TRAILER,           // Trailer lines after the last-chunk
+    CHUNK_DONE,
+    CHUNK_ERROR              // A size line with no digits or too many
+} chunk_phase;
+
+// Tracks chunked framing over raw bytes without decoding them
+typedef struct chunk_scanner {
+    chunk_phase phase;
+    uint64_t remaining;      // Size being parsed, then data left in chunk
+    int digits;              // Hex digits of the size seen so far
+    int line_len;            // Length of the current trailer line
+} chunk_scanner;
+
+// Background revalidation of a stale entry that was served anyway
+typedef struct refresh_job {
+    cache_element* entry;    // Referenced until the job ends
+    upstream_backend* backend; // Counted as outstanding on, or NULL
+    char host[256];
+    int port;
+    char request[MAX_BYTES]; // Conditional request, ready to send
+    int request_len;
+    struct refresh_job* next;
+} refresh_job;
+
+// A stored response waiting to be compressed; the key is kept after it
+typedef struct compress_job {
+    io_buf* chain;           // Referenced until the job ends
+    int len;
+    cache_freshness fresh;   // The identity entry's, shared by its variants
+    char* key;
+    struct compress_job* next;
+} compress_job;
+
+// A request header as offsets into the receive buffer, which may grow
+typedef struct header_span {
+    int name;
+    int name_len;
+    int value;               // Surrounding whitespace trimmed
+    int value_len;
+} header_span;
+
+// Incremental request parser; fields before headers are reset per request
+typedef struct request_parser {
+    int scanned;             // Bytes examined so far; the next call resumes here
+    int line;                // Start of the line being scanned
+    int method;              // Request line spans; method_len is 0 until it is parsed
+    int method_len;
+    int target;
+    int target_len;
+    int version;
+    int version_len;
+    int header_count;
+    int blank;               // Start of the empty line ending the head
+    int head_len;            // Bytes up to the body, 0 until the head is complete
+    long body_len;           // Content-Length
+    int length_seen;
+    int error;               // Malformed: answered with 400
+    int reject;              // 413 or 501 for a body that isn't taken, else 0
+    header_span headers[MAX_HEADERS];
+} request_parser;
+
+struct connection;
+struct io_handle;
+
+typedef enum {
+    URING_POLL,              // Multishot readiness, edge-triggered like the epoll loops
+    URING_RECV,              // Multishot receive into the provided buffer ring
+    URING_ACCEPT             // Multishot accept on a listener
+} uring_op_kind;
+
+// Operation left armed on a ring; user_data points here. Cancelling clears
+// handle, and the op is freed once its last completion comes back
+typedef struct uring_op {
+    struct io_handle* handle;
+    uring_op_kind kind;
+    int slot;                // Registered file slot to free on completion, or -1
+} uring_op;
+
+// epoll_data points at one of these so events can be routed to their owner
+typedef struct io_handle {
+    int fd;
+    handle_kind kind;
+    struct connection* conn;
+    uring_op* poll;          // io_uring: armed poll, or accept on a listener
+    uring_op* recv;          // io_uring: armed receive on a client
+    int slot;                // io_uring: registered file slot, -1 if none
+} io_handle;
+
+// An event loop's io_uring: the mapped queues, a ring of provided buffers
+// that client receives land in, and registered slots for client sockets
+typedef struct uring {
+    int fd;
+    int enabled;             // Created disabled; the loop thread enables it
+    void* rings;             // SQ and CQ rings, one mapping
+    size_t rings_size;
+    struct io_uring_sqe* sqes;
+    unsigned sq_entries;
+    unsigned sq_mask;
+    atomic_uint* sq_head;
+    atomic_uint* sq_tail;
+    unsigned sq_local_tail;  // SQEs handed out; the kernel sees them at the next enter
+    unsigned cq_mask;
+    atomic_uint* cq_head;
+    atomic_uint* cq_tail;
+    struct io_uring_cqe* cqes;
+    struct io_uring_buf_ring* buf_ring;
+    unsigned short buf_tail;
+    char* bufs;
+    int buf_len[URING_BUFS];   // Bytes received into each buffer
+    int buf_next[URING_BUFS];  // Next buffer queued for the same client, or -1
+    int free_slots[URING_FILES];
+    int free_slot_count;
+} uring;
+
+// A single epoll instance and the connections it owns
+typedef struct event_loop {
+    int epoll_fd;                  // -1 when ring drives the loop
+    uring* ring;                   // io_uring engine, or NULL for epoll
+    io_handle listener;            // Accept socket, fd -1 if none
+    int owns_listener;             // SO_REUSEPORT socket of its own, closed on drain
+    int cpu;                       // CPU the loop's thread is pinned to, or -1
+    io_handle wake;                // Readable when another thread wakes the loop
+    loop_waker* waker;
+    int active;                    // Connections currently owned by the loop
+    struct connection* parked;  // Waiting on another thread: DNS or an in-flight fetch
+    struct connection* idle_head;  // Waiting for a request, oldest first
+    struct connection* idle_tail;
+    int spare_pipes[SPLICE_SPARE_PIPES][2];  // Empty pipes for splice relays
+    int spare_pipe_count;
+    struct connection* graveyard;  // Closed during this batch, freed after it
+    pthread_t thread;
+} event_loop;
+
+// Client connection state machine; the same code runs under every runtime
+typedef struct connection {
+    io_handle client;
+    io_handle upstream;            // fd -1 until a miss connects to origin
+    event_loop* loop;
+    conn_state state;
+    char* request;                 // Raw request bytes, grown up to MAX_REQUEST_BYTES
+    int request_cap;
+    request_parser parser;         // Spans into request for the current request
+    int request_len;               // Bytes of the current request
+    int buffered;                  // Bytes received, including pipelined requests
+    char saved;                    // Byte overwritten by the request's terminator
+    int requests_served;
+    int keep_alive;                // Read another request after this response
+    int rx_head;                   // io_uring: received buffers not read yet, -1 if none
+    int rx_tail;
+    int rx_offset;                 // Bytes of rx_head already read
+    int rx_eof;                    // io_uring: the client closed or the receive failed
+    char* forward;                 // Request as sent upstream, hop-by-hop headers removed
+    int forward_cap;
+    int forward_len;
+    int request_sent;              // Bytes of forward written upstream
+    char host[256];                // Origin for this request
+    int port;
+    upstream_backend* backend;     // Group member the miss went to, or NULL
+    peer_node* peer;               // Peer owning the key the miss went to, or NULL
+    peer_ring* peer_ring;          // Referenced while peer points into it
+    miss_limiter* limiter;         // Holds a slot of the endpoint's miss limit, or NULL
+    int backend_tries;             // Backends tried for this request
+    int backend_failed;            // Its response was a 5xx
+    char key[MAX_BYTES];           // Normalized cache key: method scheme://host:port/path?query
+    int key_len;
+    uint64_t key_hash;             // Hashed once; picks shard and bucket
+    int cache_use;                 // Request may be answered from the cache (GET)
+    int cache_store;               // Response may be stored (no no-store or Authorization)
+    int cache_revalidate;          // Client sent no-cache: check with the origin first
+    cache_element* stale;          // Stale entry: renewed by a 304, or served if the origin fails
+    int revalidate_sent;           // Our validators for stale went to the origin
+    flight* flight;                // Coalesced fetch this request leads or follows
+    int flight_leader;             // We fetch and publish; otherwise out_sent tracks our place
+    int flight_skip;               // A flight we followed was abandoned: fetch alone
+    int upstream_reused;           // Upstream socket came from the pool
+    dns_result addrs;              // Resolved origin addresses
+    int addr_index;                // Address currently being connected to
+    int parked;                    // Linked into loop->parked
+    struct connection* park_prev;
+    struct connection* park_next;
+    int64_t idle_since;            // Monotonic ms when the request wait began
+    int idle_linked;               // Linked into the loop's idle list
+    struct connection* idle_prev;
+    struct connection* idle_next;
+    io_buf* relay;                 // Pooled relay buffer, held while fetching
+    int relay_start;               // First byte not yet sent to the client
+    int relay_end;                 // End of bytes received from the origin
+    body_framing framing;
+    int64_t body_remaining;        // For BODY_LENGTH
+    chunk_scanner chunks;          // For BODY_CHUNKED
+    int body_done;
+    int upstream_keep_alive;       // Origin socket may be pooled once done
+    io_buf* fill;                  // Capture chain for the cache and the flight, or NULL
+    io_buf* fill_tail;
+    int fill_len;
+    int fill_store;                // Still small enough to cache
+    int pipe_fds[2];               // Splice pipe while relaying zero-copy, else -1
+    int pipe_len;                  // Bytes sitting in the pipe
+    const char* out;               // Bytes being written to the client
+    cache_element* cached;         // Referenced cache hit backing out, if any
+    disk_entry* disk;              // Pinned disk tier hit being sent with sendfile()
+    off_t file_offset;
+    off_t file_remaining;
+    int64_t started_us;            // Monotonic time the request was complete
+    int64_t upstream_us;           // When connect, then forwarding, began
+    int64_t trace[TRACE_MARKS];    // This request's phases, for slow request logging
+    int out_len;
+    int out_sent;
+    struct connection* next_closed;
+} connection;
+
 // Global variables
-pthread_t tid[MAX_CLIENTS];         // Thread IDs
-pthread_mutex_t cache_lock;         // Cache access lock
-sem_t connection_semaphore;         // Connection limit semaphore
-cache_element* cache_head = NULL;   // Cache linked list head
-int total_cache_size = 0;          // Current cache size
+cache_shard* cache_shards = NULL;   // Cache, split by key hash
+size_t cache_shard_count = 0;       // Power of two
+const eviction_policy* cache_policy = NULL;  // Chosen by cache_set_policy()
+slab_class slab_classes[SLAB_MAX_CLASSES];  // Backing store for cache entries
+int slab_class_count = 0;
+pthread_key_t slab_magazine_key;    // Flushes a thread's magazine when it exits
+pthread_mutex_t io_buf_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards io_buf_pool
+io_buf* io_buf_pool = NULL;         // Free buffers shared by all threads
+int io_buf_pool_count = 0;
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards pool_buckets
+upstream_pool* pool_buckets[POOL_BUCKETS];              // Idle origin sockets
+atomic_int pool_max_idle = POOL_MAX_IDLE;
+atomic_int pool_idle_timeout = POOL_IDLE_TIMEOUT;
+upstream_backend* upstreams = NULL; // Reverse-proxy group; misses go here when set
+int upstream_count = 0;
+atomic_int upstream_balance = BALANCE_P2C;
+atomic_int health_interval = HEALTH_INTERVAL; // Seconds, 0 to stop checking
+const char* health_path = NULL;     // GET for active checks; NULL just connects
+_Atomic(peer_ring*) peer_ring_current = NULL;
+peer_ring* peer_rings_retired = NULL;  // Replaced, freed once unused; main thread only
+atomic_int miss_limit_max = 0;      // Ceiling on each origin's adaptive miss limit; 0 is off
+miss_limiter limiters[LIMIT_BUCKETS];
+pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards the refresh queue
+pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+struct refresh_job* refresh_head = NULL;
+struct refresh_job* refresh_tail = NULL;
+int refresh_queued = 0;
+atomic_int compress_enabled = 0;    // Keep compressed variants of textual responses
+pthread_mutex_t compress_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards the compress queue
+pthread_cond_t compress_cond = PTHREAD_COND_INITIALIZER;
+compress_job* compress_head = NULL;
+compress_job* compress_tail = NULL;
+int compress_queued = 0;
+pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards flight_buckets
+flight* flight_buckets[FLIGHT_BUCKETS];                  // Misses being fetched right now
+pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;   // Guards the resolver cache
+pthread_cond_t dns_queue_cond = PTHREAD_COND_INITIALIZER;
+dns_entry* dns_buckets[DNS_BUCKETS];
+dns_entry* dns_queue_head = NULL;   // Lookups waiting for a resolver thread
+dns_entry* dns_queue_tail = NULL;
+atomic_int dns_ttl = DNS_TTL;
+atomic_int dns_negative_ttl = DNS_NEGATIVE_TTL;
+atomic_int keepalive_timeout = KEEPALIVE_TIMEOUT;
+atomic_int keepalive_max_requests = KEEPALIVE_MAX_REQUESTS;
+atomic_int splice_enabled = 1;
+canned_response canned_responses[] = {
+    {500, "Internal Server Error", "", NULL, 0},  // First: the fallback for other codes
+    {400, "Bad Request", "", NULL, 0},
+    {403, "Forbidden", "", NULL, 0},
+    {404, "Not Found", "", NULL, 0},
+    {413, "Content Too Large", "", NULL, 0},
+    {501, "Not Implemented", "", NULL, 0},
+    {502, "Bad Gateway", "", NULL, 0},
+    {503, "Service Unavailable", "Retry-After: 1\r\n", NULL, 0},  // Shed load
+    {504, "Gateway Timeout", "", NULL, 0},
+};
+int uring_enabled = 0;              // Event loops try io_uring before epoll
+atomic_int listen_backlog = LISTEN_BACKLOG;
+int reuse_port = 1;                 // One SO_REUSEPORT listener per event loop
+int pin_cpus = 0;                   // Pin event loop threads to CPUs
+int numa_preferred = 0;             // Pinned loops prefer memory on their node
+atomic_int stale_while_revalidate = 0; // Default windows, seconds, for responses
+atomic_int stale_if_error = 0;         // whose Cache-Control names none
+atomic_int cache_max_object = MAX_ELEMENT_SIZE; // Largest response copied for caching
+atomic_int ram_max_object = MAX_ELEMENT_SIZE; // Largest response the RAM tier keeps
+atomic_int cache_size_mb = CACHE_SIZE;
+atomic_int drain_timeout = DRAIN_TIMEOUT;
+int disk_fd = -1;                   // Disk tier file, -1 when the tier is off
+off_t disk_size = 0;
+off_t disk_head = 0;                // Next write position in the ring
+uint64_t disk_seq = 1;
+pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards the index and ring
+disk_entry** disk_buckets = NULL;
+disk_entry* disk_fifo_head = NULL;  // Records in ring order from disk_head, oldest first
+disk_entry* disk_fifo_tail = NULL;
+pthread_mutex_t disk_queue_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards the write queue
+pthread_cond_t disk_queue_cond = PTHREAD_COND_INITIALIZER;
+disk_write* disk_queue_head = NULL;
+disk_write* disk_queue_tail = NULL;
+size_t disk_queue_bytes = 0;
+pthread_cond_t disk_idle_cond = PTHREAD_COND_INITIALIZER;  // Queue drained
+int disk_ready = 0;                 // Index loaded; the writer may touch the ring
+atomic_int shutdown_requested;      // SIGTERM seen: stop accepting and drain
+atomic_int reload_requested;        // SIGHUP seen: reread the config file
+sem_t shutdown_sem;                 // Posted by the signal handlers for main
+event_loop** running_loops = NULL;  // Woken by the signal handler to drain
+long running_loop_count = 0;
+int listen_socket = -1;             // Shut down to unblock the legacy accept()
+worker* workers = NULL;             // Threads-mode pool
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;  // Guards stats_head
+thread_stats* stats_head = NULL;    // Every thread's metrics block
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;    // Guards log_head and flushing
+log_ring* log_head = NULL;          // Every thread's log ring
+atomic_int slow_request_ms = SLOW_REQUEST_MS; // Requests taking longer are traced; 0 for none
+pthread_mutex_t slow_lock = PTHREAD_MUTEX_INITIALIZER;   // Guards the slow samples
+char slow_samples[SLOW_SAMPLES][LOG_LINE_MAX];
+uint64_t slow_next = 0;             // Samples ever taken; the next goes at this modulo
+long worker_count = 0;
 
 // Function declarations
-cache_element* find_in_cache(char* url);
-int add_to_cache(char* data, int size, char* url);
-void remove_from_cache(void);
-int send_error_response(int socket, int status_code);
-int connect_to_server(char* host, int port);
-void* handle_client(void* client_socket);
+void slab_init(void);
+void* slab_alloc(size_t size, int* slab_class);
+io_buf* io_buf_get(void);
+void io_buf_release(io_buf* b);
+void io_chain_release(io_buf* chain);
+void slab_free(void* chunk, int slab_class);
+size_t slab_chunk_size(int slab_class);
+void cache_init(void);
+void cache_resize(size_t bytes);
+int cache_set_policy(const char* name);
+cache_element* find_in_cache(const char* key, uint64_t hash);
+void release_cache_element(cache_element* element);
+int add_to_cache(const char* data, int size, const char* key, uint64_t hash,
+                 int flags, const cache_freshness* fresh);
+void renew_cache_element(cache_element* element, const char* head, int head_len);
+uint64_t cache_hash(const char* key, int len);
+void remove_from_cache(cache_shard* shard, cache_element* element);
+void disk_init(const char* path, off_t size);
+disk_entry* disk_lookup(const char* key, uint64_t hash);
+void disk_release(disk_entry* d);
+cache_element* disk_promote(disk_entry* d);
+void disk_submit(io_buf* chain, int size, const char* key, uint64_t hash, int reusable,
+                 const cache_freshness* fresh);
+void disk_demote(cache_element* element);
+void stat_add(stat_counter counter, uint64_t n);
+void stat_latency(stat_histogram histogram, int64_t us);
+void stats_start(int listen_fd);
+void log_info(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void log_error(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void log_flush(void);
+void log_start(void);
+void trace_sample(const char* line);
+char* trace_render(size_t* len);
+int disk_quiesce(void);
+void warm_start(const char* snapshot_path);
+void snapshot_save(const char* path);
+int send_error_response(connection* c, int status_code);
+int connect_to_server(const struct sockaddr* addr, socklen_t addr_len);
+void dns_init(void);
+void refresh_init(void);
+int refresh_submit(refresh_job* job);
+#ifdef HAVE_ZLIB
+void compress_init(void);
+void compress_submit(io_buf* chain, int len, const char* key, const cache_freshness* fresh);
+void compress_renew(const char* key, const char* head, int head_len);
+#endif
+int dns_resolve(const char* host, int port, loop_waker* waker, dns_result* out);
+int pool_acquire(const char* host, int port);
+void pool_release(const char* host, int port, int fd);
+int upstream_add(const char* authority);
+upstream_backend* upstream_pick(const upstream_backend* avoid);
+void upstream_done(upstream_backend* b, int outcome);
+void health_start(void);
+int peer_ring_build(const startup_config* s, peer_ring** out);
+void peer_ring_publish(peer_ring* ring);
+void peer_ring_release(peer_ring* ring);
+peer_node* peer_owner(const connection* c, peer_ring** held);
+void limiter_init(void);
+miss_limiter* limiter_for(const char* host, int port);
+int limiter_acquire(miss_limiter* l, int may_shed);
+void limiter_release(miss_limiter* l, int64_t ttfb_us, int outcome);
+flight* flight_join(const char* key, uint64_t hash, loop_waker* waker, int* leader);
+int flight_publish(flight* f, io_buf* at, int len);
+void flight_finish(flight* f, flight_state state);
+void flight_release(flight* f);
+void worker_init(event_loop** loops, long count);
+void worker_dispatch(int client_fd);
+void* worker_thread(void* arg);
+event_loop* loop_create(int listen_fd);
+uring* uring_create(void);
+void uring_destroy(uring* r);
+int uring_watch(uring* r, io_handle* h);
+void uring_unwatch(uring* r, io_handle* h);
+ssize_t uring_recv(connection* c, char* buf, size_t len);
+int uring_wait(event_loop* loop, int timeout);
+void loop_run(event_loop* loop);
+void loop_destroy(event_loop* loop);
+connection* conn_create(event_loop* loop, int client_fd);
+void conn_drive(connection* c);
+void conn_close(connection* c);
+void conn_connect_next(connection* c);
+void conn_start_request(connection* c);
+int conn_serve_stale(connection* c);
+void conn_backend_done(connection* c, int outcome);
+void conn_fetch_done(connection* c, int outcome);
+int conn_backend_failover(connection* c);
 
 
 // Add these function implementations before the main() function
 
-// Function to establish connection with destination server
-int connect_to_server(char* host, int port) {
-    struct hostent *server;
-    struct sockaddr_in server_addr;
-    
-    // Get host information
-    server = gethostbyname(host);
-    if (server == NULL) {
-        fprintf(stderr, "Error: Could not resolve hostname %s\n", host);
+// Put a socket into non-blocking mode
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
         return -1;
     }
-    
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Function to establish connection with destination server
+// Returns a non-blocking socket whose connect() may still be in progress
+int connect_to_server(const struct sockaddr* addr, socklen_t addr_len) {
     // Create socket for server connection
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    int server_socket = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (server_socket < 0) {
-        perror("Error creating socket for server connection");
+        log_error("Error creating socket for server connection: %s\n", strerror(errno));
         return -1;
     }
-    
-    // Configure server address structure
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    memcpy(&server_addr.sin_addr.s_addr, server->h_addr, server->h_length);
-    
-    // Establish connection to server
-    if (connect(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Error connecting to destination server");
+
+    // Start connecting; completion is reported as writability
+    if (connect(server_socket, addr, addr_len) < 0 && errno != EINPROGRESS) {
+        log_error("Error connecting to destination server: %s\n", strerror(errno));
         close(server_socket);
         return -1;
     }
-    
+
     return server_socket;
 }
 
-// Function to send HTTP error responses back to client
-int send_error_response(int socket, int status_code) {
-    char *response;
-    switch(status_code) {
-        case 400:
-            response = "HTTP/1.1 400 Bad Request\r\n"
-                      "Content-Type: text/html\r\n"
-                      "Content-Length: 35\r\n\r\n"
-                      "<html>400 - Bad Request</html>\r\n";
-            break;
-        case 403:
-            response = "HTTP/1.1 403 Forbidden\r\n"
-                      "Content-Type: text/html\r\n"
-                      "Content-Length: 32\r\n\r\n"
-                      "<html>403 - Forbidden</html>\r\n";
-            break;
-        case 404:
-            response = "HTTP/1.1 404 Not Found\r\n"
-                      "Content-Type: text/html\r\n"
-                      "Content-Length: 32\r\n\r\n"
-                      "<html>404 - Not Found</html>\r\n";
-            break;
-        case 500:
-            response = "HTTP/1.1 500 Internal Server Error\r\n"
-                      "Content-Type: text/html\r\n"
-                      "Content-Length: 45\r\n\r\n"
-                      "<html>500 - Internal Server Error</html>\r\n";
-            break;
-        case 502:
-            response = "HTTP/1.1 502 Bad Gateway\r\n"
-                      "Content-Type: text/html\r\n"
-                      "Content-Length: 35\r\n\r\n"
-                      "<html>502 - Bad Gateway</html>\r\n";
-            break;
-        default:
-            response = "HTTP/1.1 500 Internal Server Error\r\n"
-                      "Content-Type: text/html\r\n"
-                      "Content-Length: 45\r\n\r\n"
-                      "<html>500 - Internal Server Error</html>\r\n";
+static loop_waker* waker_create(void) {
+    loop_waker* w = malloc(sizeof(loop_waker));
+    if (w == NULL) {
+        return NULL;
+    }
+    w->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->fd < 0) {
+        free(w);
+        return NULL;
     }
-    
-    return send(socket, response, strlen(response), 0);
+    atomic_init(&w->refs, 1);
+    return w;
 }
 
-// Main server implementation
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        printf("Usage: %s <port_number>\n", argv[0]);
-        exit(EXIT_FAILURE);
+static void waker_release(loop_waker* w) {
+    if (atomic_fetch_sub(&w->refs, 1) == 1) {
+        close(w->fd);
+        free(w);
     }
+}
 
-    int port = atoi(argv[1]);
-    if (port <= 0 || port > 65535) {
-        printf("Invalid port number. Use 1-65535\n");
-        exit(EXIT_FAILURE);
+static void waker_signal(loop_waker* w) {
+    uint64_t one = 1;
+    ssize_t ignored = write(w->fd, &one, sizeof(one));
+    (void)ignored;  // EAGAIN only means a wakeup is already pending
+}
+
+static unsigned dns_bucket(const char* host) {
+    uint64_t h = 1469598103934665603ULL;
+    for (const char* p = host; *p; p++) {
+        h = (h ^ (unsigned char)tolower((unsigned char)*p)) * 1099511628211ULL;
     }
+    return h % DNS_BUCKETS;
+}
 
-    // Initialize synchronization primitives
-    sem_init(&connection_semaphore, 0, MAX_CLIENTS);
-    pthread_mutex_init(&cache_lock, NULL);
+// Resolver thread: drains the queue, runs the blocking lookup, publishes
+// the answer and wakes every loop that parked a connection on it
+static void* dns_worker(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&dns_lock);
+        while (dns_queue_head == NULL) {
+            pthread_cond_wait(&dns_queue_cond, &dns_lock);
+        }
+        dns_entry* e = dns_queue_head;
+        dns_queue_head = e->queue_next;
+        if (dns_queue_head == NULL) {
+            dns_queue_tail = NULL;
+        }
+        char host[256];
+        memcpy(host, e->host, sizeof(host));
+        pthread_mutex_unlock(&dns_lock);
 
-    // Create server socket
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("Failed to create socket");
-        exit(EXIT_FAILURE);
-    }
+        struct addrinfo hints = {0};
+        struct addrinfo* res = NULL;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        int err = getaddrinfo(host, NULL, &hints, &res);
 
-    // Enable socket address reuse
-    int reuse = 1;
-    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        dns_result result = {0};
+        for (struct addrinfo* ai = res; ai != NULL && result.count < DNS_MAX_ADDRS; ai = ai->ai_next) {
+            if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) {
+                continue;
+            }
+            memcpy(&result.addr[result.count], ai->ai_addr, ai->ai_addrlen);
+            result.addr_len[result.count] = ai->ai_addrlen;
+            result.count++;
+        }
+        if (res != NULL) {
+            freeaddrinfo(res);
+        }
+        if (err == 0 && result.count == 0) {
+            err = EAI_NONAME;
+        }
+        if (err != 0) {
+            log_error("Error: Could not resolve hostname %s: %s\n", host, gai_strerror(err));
+        }
 
-    // Configure server address
-    struct sockaddr_in server_addr = {0};
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+        pthread_mutex_lock(&dns_lock);
+        e->result = result;
+        e->error = err;
+        e->expires = time(NULL) + (err == 0 ? dns_ttl : dns_negative_ttl);
+        e->state = DNS_READY;
+        loop_waker** waiters = e->waiters;
+        int waiter_count = e->waiter_count;
+        e->waiters = NULL;
+        e->waiter_count = e->waiter_capacity = 0;
+        pthread_mutex_unlock(&dns_lock);
 
-    // Bind socket to address
-    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Binding failed");
-        exit(EXIT_FAILURE);
+        for (int i = 0; i < waiter_count; i++) {
+            waker_signal(waiters[i]);
+            waker_release(waiters[i]);
+        }
+        free(waiters);
     }
+    return NULL;
+}
 
-    // Listen for connections
-    if (listen(server_socket, MAX_CLIENTS) < 0) {
-        perror("Listen failed");
-        exit(EXIT_FAILURE);
+void dns_init(void) {
+    for (int i = 0; i < DNS_RESOLVER_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, dns_worker, NULL) != 0) {
+            perror("Resolver thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
     }
+}
 
-    printf("Proxy server listening on port %d...\n", port);
+// Look up host without blocking. Returns 1 with addresses (port filled in)
+// copied to out, -1 for a cached failure, or 0 if a lookup is in flight, in
+// which case waker is signalled once it completes
+int dns_resolve(const char* host, int port, loop_waker* waker, dns_result* out) {
+    time_t now = time(NULL);
+    dns_entry** link = &dns_buckets[dns_bucket(host)];
+    dns_entry* e = NULL;
 
-    // Main server loop
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        // Accept new connection
-        int* client_socket = malloc(sizeof(int));
-        *client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-        
-        if (*client_socket < 0) {
-            perror("Accept failed");
-            free(client_socket);
+    pthread_mutex_lock(&dns_lock);
+    while (*link != NULL) {
+        dns_entry* cur = *link;
+        if (strcasecmp(cur->host, host) == 0) {
+            e = cur;
+            break;
+        }
+        // Drop expired answers nobody is waiting on as we pass them
+        if (cur->state == DNS_READY && cur->expires <= now) {
+            *link = cur->next;
+            free(cur);
             continue;
         }
+        link = &cur->next;
+    }
 
-        // Log connection
-        char client_ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
-        printf("New connection from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
-
-        // Create thread to handle client
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, (void*)client_socket) != 0) {
-            perror("Thread creation failed");
-            close(*client_socket);
-            free(client_socket);
-            continue;
+    if (e != NULL && e->state == DNS_READY && e->expires > now) {
+        int found = e->error == 0;
+        if (found) {
+            *out = e->result;
+        }
+        pthread_mutex_unlock(&dns_lock);
+        if (!found) {
+            return -1;
         }
-        pthread_detach(thread_id);
+        for (int i = 0; i < out->count; i++) {
+            if (out->addr[i].ss_family == AF_INET6) {
+                ((struct sockaddr_in6*)&out->addr[i])->sin6_port = htons(port);
+            } else {
+                ((struct sockaddr_in*)&out->addr[i])->sin_port = htons(port);
+            }
+        }
+        return 1;
+    }
+
+    if (e == NULL) {
+        e = calloc(1, sizeof(dns_entry));
+        if (e == NULL) {
+            pthread_mutex_unlock(&dns_lock);
+            return -1;
+        }
+        snprintf(e->host, sizeof(e->host), "%s", host);
+        e->next = dns_buckets[dns_bucket(host)];
+        dns_buckets[dns_bucket(host)] = e;
+        e->state = DNS_READY;  // Queued just below
+    }
+    if (e->state == DNS_READY) {
+        // Missing or expired: queue a fresh lookup
+        e->state = DNS_PENDING;
+        e->queue_next = NULL;
+        if (dns_queue_tail != NULL) {
+            dns_queue_tail->queue_next = e;
+        } else {
+            dns_queue_head = e;
+        }
+        dns_queue_tail = e;
+        pthread_cond_signal(&dns_queue_cond);
     }
 
-    // Cleanup (though we never reach here in this implementation)
-    close(server_socket);
-    sem_destroy(&connection_semaphore);
-    pthread_mutex_destroy(&cache_lock);
+    int registered = 0;
+    for (int i = 0; i < e->waiter_count; i++) {
+        registered |= e->waiters[i] == waker;
+    }
+    if (!registered && e->waiter_count == e->waiter_capacity) {
+        int capacity = e->waiter_capacity ? e->waiter_capacity * 2 : 4;
+        loop_waker** grown = realloc(e->waiters, capacity * sizeof(loop_waker*));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&dns_lock);
+            return -1;
+        }
+        e->waiters = grown;
+        e->waiter_capacity = capacity;
+    }
+    if (!registered) {
+        atomic_fetch_add(&waker->refs, 1);
+        e->waiters[e->waiter_count++] = waker;
+    }
+    pthread_mutex_unlock(&dns_lock);
     return 0;
 }
 
-// Thread function to handle client requests
-void* handle_client(void* arg) {
-    int client_socket = *(int*)arg;
-    free(arg);
-
-    // Wait for available connection slot
-    sem_wait(&connection_semaphore);
+// Find the pool for (host, port); caller holds pool_lock
+static upstream_pool* pool_find(const char* host, int port, int create) {
+    uint64_t h = 1469598103934665603ULL;
+    for (const char* p = host; *p; p++) {
+        h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    }
+    h = (h ^ (uint64_t)port) * 1099511628211ULL;
 
-    char buffer[MAX_BYTES];
-    ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
-    
-    if (bytes_received <= 0) {
-        close(client_socket);
-        sem_post(&connection_semaphore);
+    upstream_pool** link = &pool_buckets[h % POOL_BUCKETS];
+    for (upstream_pool* p = *link; p != NULL; p = p->next) {
+        if (p->port == port && strcmp(p->host, host) == 0) {
+            return p;
+        }
+    }
+    if (!create) {
         return NULL;
     }
+    upstream_pool* p = calloc(1, sizeof(upstream_pool));
+    if (p != NULL) {
+        snprintf(p->host, sizeof(p->host), "%s", host);
+        p->port = port;
+        p->next = *link;
+        *link = p;
+    }
+    return p;
+}
+
+// Close sockets idle past the timeout; caller holds pool_lock
+static void pool_expire(upstream_pool* p, time_t now) {
+    pooled_socket** link = &p->idle;
+    while (*link != NULL) {
+        pooled_socket* s = *link;
+        if (now - s->idle_since >= pool_idle_timeout) {
+            *link = s->next;
+            close(s->fd);
+            free(s);
+            p->idle_count--;
+        } else {
+            link = &s->next;
+        }
+    }
+}
 
-    buffer[bytes_received] = '\0';
+// An idle socket must have nothing to read: data or EOF means the
+// origin closed it or sent something unsolicited
+static int pool_socket_healthy(int fd) {
+    char byte;
+    ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
 
-    // Check cache first
-    pthread_mutex_lock(&cache_lock);
-    cache_element* cached = find_in_cache(buffer);
-    if (cached != NULL) {
-        send(client_socket, cached->data, cached->len, 0);
-        pthread_mutex_unlock(&cache_lock);
-        printf("Cache hit - serving from cache\n");
-    } else {
-        pthread_mutex_unlock(&cache_lock);
-        
-        // Parse request and forward to destination server
-        // Note: Simplified for example - you should properly parse HTTP headers
-        char* host_start = strstr(buffer, "Host: ") + 6;
-        char* host_end = strstr(host_start, "\r\n");
-        char host[256] = {0};
-        strncpy(host, host_start, host_end - host_start);
-
-        int server_socket = connect_to_server(host, 80);
-        if (server_socket < 0) {
-            send_error_response(client_socket, 502);
-            close(client_socket);
-            sem_post(&connection_semaphore);
-            return NULL;
+// Take a warm, connected socket to (host, port), or -1 if none is idle
+int pool_acquire(const char* host, int port) {
+    int fd = -1;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&pool_lock);
+    upstream_pool* p = pool_find(host, port, 0);
+    if (p != NULL) {
+        pool_expire(p, now);
+        while (fd < 0 && p->idle != NULL) {
+            pooled_socket* s = p->idle;
+            p->idle = s->next;
+            p->idle_count--;
+            if (pool_socket_healthy(s->fd)) {
+                fd = s->fd;
+            } else {
+                close(s->fd);
+            }
+            free(s);
+        }
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return fd;
+}
+
+// Park a socket whose last response was fully read; closes it if the pool is full
+void pool_release(const char* host, int port, int fd) {
+    time_t now = time(NULL);
+    pooled_socket* s = malloc(sizeof(pooled_socket));
+
+    pthread_mutex_lock(&pool_lock);
+    upstream_pool* p = pool_find(host, port, 1);
+    if (p != NULL) {
+        pool_expire(p, now);
+    }
+    if (p == NULL || s == NULL || p->idle_count >= pool_max_idle) {
+        pthread_mutex_unlock(&pool_lock);
+        free(s);
+        close(fd);
+        return;
+    }
+    s->fd = fd;
+    s->idle_since = now;
+    s->next = p->idle;
+    p->idle = s;
+    p->idle_count++;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+void flight_release(flight* f) {
+    if (f == NULL || atomic_fetch_sub(&f->refs, 1) != 1) {
+        return;
+    }
+    for (int i = 0; i < COALESCE_MAX_BYTES / IO_BUF_SIZE; i++) {
+        if (f->blocks[i] != NULL) {
+            io_buf_release(f->blocks[i]);
+        }
+    }
+    for (int i = 0; i < f->waiter_count; i++) {
+        waker_release(f->waiters[i]);
+    }
+    free(f->waiters);
+    pthread_mutex_destroy(&f->lock);
+    free(f->key);
+    free(f);
+}
+
+// Wake every loop with a connection following f
+static void flight_notify(flight* f) {
+    pthread_mutex_lock(&f->lock);
+    for (int i = 0; i < f->waiter_count; i++) {
+        waker_signal(f->waiters[i]);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+// Follow the fetch already running for key, or start one. Returns the
+// flight with a reference held and *leader set if the caller must fetch
+// it; NULL if neither was possible
+flight* flight_join(const char* key, uint64_t hash, loop_waker* waker, int* leader) {
+    flight** link = &flight_buckets[hash % FLIGHT_BUCKETS];
+
+    pthread_mutex_lock(&flight_lock);
+    for (flight* f = *link; f != NULL; f = f->next) {
+        if (f->hash != hash || strcmp(f->key, key) != 0) {
+            continue;
+        }
+        pthread_mutex_lock(&f->lock);
+        int registered = 0;
+        for (int i = 0; i < f->waiter_count; i++) {
+            registered |= f->waiters[i] == waker;
+        }
+        if (!registered && f->waiter_count == f->waiter_capacity) {
+            int capacity = f->waiter_capacity ? f->waiter_capacity * 2 : 4;
+            loop_waker** grown = realloc(f->waiters, capacity * sizeof(loop_waker*));
+            if (grown == NULL) {
+                pthread_mutex_unlock(&f->lock);
+                pthread_mutex_unlock(&flight_lock);
+                return NULL;
+            }
+            f->waiters = grown;
+            f->waiter_capacity = capacity;
         }
+        if (!registered) {
+            atomic_fetch_add(&waker->refs, 1);
+            f->waiters[f->waiter_count++] = waker;
+        }
+        pthread_mutex_unlock(&f->lock);
+        atomic_fetch_add(&f->refs, 1);
+        pthread_mutex_unlock(&flight_lock);
+        *leader = 0;
+        return f;
+    }
+
+    flight* f = calloc(1, sizeof(flight));
+    if (f == NULL || (f->key = strdup(key)) == NULL) {
+        free(f);
+        pthread_mutex_unlock(&flight_lock);
+        return NULL;
+    }
+    f->hash = hash;
+    atomic_init(&f->refs, 2);
+    atomic_init(&f->state, FLIGHT_ACTIVE);
+    atomic_init(&f->published, 0);
+    pthread_mutex_init(&f->lock, NULL);
+    f->next = *link;
+    *link = f;
+    pthread_mutex_unlock(&flight_lock);
+    *leader = 1;
+    return f;
+}
 
-        // Forward request and get response
-        send(server_socket, buffer, bytes_received, 0);
-        
-        char response[MAX_BYTES];
-        bytes_received = recv(server_socket, response, sizeof(response), 0);
-        
-        if (bytes_received > 0) {
-            send(client_socket, response, bytes_received, 0);
-            
-            // Cache the response
-            pthread_mutex_lock(&cache_lock);
-            add_to_cache(response, bytes_received, buffer);
-            pthread_mutex_unlock(&cache_lock);
+// Leader: the next len bytes of its capture chain, starting in buffer at,
+// are written; share them and wake the waiters. Returns -1 once the
+// response outgrows COALESCE_MAX_BYTES
+int flight_publish(flight* f, io_buf* at, int len) {
+    int published = atomic_load_explicit(&f->published, memory_order_relaxed);
+    if (published + len > COALESCE_MAX_BYTES) {
+        return -1;
+    }
+    // Chain buffers fill completely in order, so offsets map to blocks
+    for (int block = published / IO_BUF_SIZE; block <= (published + len - 1) / IO_BUF_SIZE; block++) {
+        if (f->blocks[block] == NULL) {
+            atomic_fetch_add(&at->refs, 1);
+            f->blocks[block] = at;
         }
+        at = at->next;
+    }
+    published += len;
+    atomic_store_explicit(&f->published, published, memory_order_release);
+    flight_notify(f);
+    return 0;
+}
 
-        close(server_socket);
+// Leader: settle the flight and take it out of the table, so the next miss
+// on the key starts afresh
+void flight_finish(flight* f, flight_state state) {
+    pthread_mutex_lock(&flight_lock);
+    if (atomic_load(&f->state) != FLIGHT_ACTIVE) {
+        pthread_mutex_unlock(&flight_lock);
+        return;
+    }
+    flight** link = &flight_buckets[f->hash % FLIGHT_BUCKETS];
+    while (*link != f) {
+        link = &(*link)->next;
     }
+    *link = f->next;
+    atomic_store(&f->state, state);
+    pthread_mutex_unlock(&flight_lock);
 
-    close(client_socket);
-    sem_post(&connection_semaphore);
-    return NULL;
+    flight_notify(f);
+    flight_release(f);
 }
 
-// Cache management functions
-cache_element* find_in_cache(char* url) {
-    cache_element* current = cache_head;
-    while (current != NULL) {
-        if (strcmp(current->url, url) == 0) {
-            current->lru_time_track = time(NULL);
-            return current;
+// Locate a header value in a header block; returns NULL if absent
+static const char* find_header(const char* headers, const char* end,
+                               const char* name, int* value_len) {
+    size_t name_len = strlen(name);
+    const char* line = memchr(headers, '\n', end - headers);
+    while (line != NULL && ++line < end) {
+        const char* eol = memchr(line, '\n', end - line);
+        if (eol == NULL) {
+            eol = end;
         }
-        current = current->next;
+        if ((size_t)(eol - line) > name_len && line[name_len] == ':' &&
+                strncasecmp(line, name, name_len) == 0) {
+            const char* v = line + name_len + 1;
+            while (v < eol && (*v == ' ' || *v == '\t')) {
+                v++;
+            }
+            const char* v_end = eol;
+            while (v_end > v && (v_end[-1] == '\r' || v_end[-1] == ' ')) {
+                v_end--;
+            }
+            *value_len = v_end - v;
+            return v;
+        }
+        line = eol;
     }
     return NULL;
 }
 
-int add_to_cache(char* data, int size, char* url) {
-    if (size > MAX_ELEMENT_SIZE) {
+// True if the value of a comma-separated header contains token
+static int header_has_token(const char* value, int value_len, const char* token) {
+    size_t token_len = strlen(token);
+    const char* end = value + value_len;
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == ',')) {
+            value++;
+        }
+        const char* item = value;
+        while (value < end && *value != ',') {
+            value++;
+        }
+        const char* item_end = value;
+        while (item_end > item && item_end[-1] == ' ') {
+            item_end--;
+        }
+        if ((size_t)(item_end - item) == token_len && strncasecmp(item, token, token_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// True if the single read holds exactly one complete, self-delimiting
+// response, so that the peer can tell where it ends
+static int response_complete(const char* resp, int len) {
+    const char* body = memmem(resp, len, "\r\n\r\n", 4);
+    if (body == NULL || len < 12 || strncmp(resp, "HTTP/1.", 7) != 0) {
         return 0;
     }
+    body += 4;
 
-    while (total_cache_size + size > MAX_CACHE_SIZE) {
-        remove_from_cache();
+    int vlen;
+    const char* v;
+    int status = atoi(resp + 9);
+    int body_len = len - (body - resp);
+    if (status == 204 || status == 304 || (status >= 100 && status < 200)) {
+        return body_len == 0;
+    }
+    v = find_header(resp, body, "Transfer-Encoding", &vlen);
+    if (v != NULL) {
+        return body_len >= 5 && memcmp(resp + len - 5, "0\r\n\r\n", 5) == 0;
     }
+    v = find_header(resp, body, "Content-Length", &vlen);
+    return v != NULL && atol(v) == body_len;
+}
 
-    cache_element* element = malloc(sizeof(cache_element));
-    element->data = malloc(size);
-    memcpy(element->data, data, size);
-    element->url = strdup(url);
-    element->len = size;
-    element->lru_time_track = time(NULL);
-    element->next = cache_head;
-    cache_head = element;
+// True if the origin did not ask to close the connection after resp
+static int response_keeps_alive(const char* resp, int len) {
+    const char* end = memmem(resp, len, "\r\n\r\n", 4);
+    int vlen;
+    const char* v = end ? find_header(resp, end, "Connection", &vlen) : NULL;
+    if (v != NULL && header_has_token(v, vlen, "close")) {
+        return 0;
+    }
+    return strncmp(resp, "HTTP/1.1 ", 9) == 0 || (v != NULL && header_has_token(v, vlen, "keep-alive"));
+}
 
-    total_cache_size += size + sizeof(cache_element) + strlen(url) + 1;
-    return 1;
+// Advance the scanner over p; returns bytes that belong to the body
+// (fewer than len once the final CRLF has been seen). A size that would
+// overflow, or a size line without one, stops it at CHUNK_ERROR
+static int chunk_scan(chunk_scanner* cs, const char* p, int len) {
+    int i = 0;
+    while (i < len && cs->phase != CHUNK_DONE && cs->phase != CHUNK_ERROR) {
+        char ch = p[i];
+        switch (cs->phase) {
+            case CHUNK_SIZE:
+            case CHUNK_EXT:
+                if (cs->phase == CHUNK_SIZE && isxdigit((unsigned char)ch)) {
+                    if (++cs->digits > 16) {
+                        cs->phase = CHUNK_ERROR;
+                        break;
+                    }
+                    int digit = isdigit((unsigned char)ch) ? ch - '0' : (tolower((unsigned char)ch) - 'a' + 10);
+                    cs->remaining = cs->remaining * 16 + digit;
+                } else if (cs->digits == 0 && ch != '\r') {
+                    cs->phase = CHUNK_ERROR;
+                    break;
+                } else if (ch == '\n') {
+                    cs->phase = cs->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                    cs->line_len = 0;
+                } else if (ch != '\r') {
+                    cs->phase = CHUNK_EXT;
+                }
+                i++;
+                break;
+            case CHUNK_DATA: {
+                uint64_t take = (uint64_t)(len - i) < cs->remaining ? (uint64_t)(len - i) : cs->remaining;
+                i += take;
+                cs->remaining -= take;
+                if (cs->remaining == 0) {
+                    cs->phase = CHUNK_DATA_END;
+                }
+                break;
+            }
+            case CHUNK_DATA_END:
+                i++;
+                if (ch == '\n') {
+                    cs->phase = CHUNK_SIZE;
+                    cs->digits = 0;
+                }
+                break;
+            case CHUNK_TRAILER:
+                i++;
+                if (ch == '\n') {
+                    if (cs->line_len == 0) {
+                        cs->phase = CHUNK_DONE;
+                    }
+                    cs->line_len = 0;
+                } else if (ch != '\r') {
+                    cs->line_len++;
+                }
+                break;
+            case CHUNK_DONE:
+            case CHUNK_ERROR:
+                break;
+        }
+    }
+    return i;
 }
 
-void remove_from_cache(void) {
-    if (cache_head == NULL) {
-        return;
+// Next '\n' in [p, p + len). Header lines are short, so a 16-byte SSE2
+// compare usually finds it in a step or two without a library call
+static const char* scan_newline(const char* p, int len) {
+#ifdef __SSE2__
+    const __m128i newline = _mm_set1_epi8('\n');
+    while (len >= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        if (mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+        len -= 16;
     }
+#endif
+    return memchr(p, '\n', len);
+}
+
+// Case-insensitive match of a parsed header's name
+static int header_is(const char* buf, const header_span* h, const char* name) {
+    size_t len = strlen(name);
+    return (size_t)h->name_len == len && strncasecmp(buf + h->name, name, len) == 0;
+}
 
-    cache_element *oldest = cache_head;
-    cache_element *prev = NULL;
-    cache_element *current = cache_head;
+// Forget the previous request; the span array is simply overwritten
+static void request_parser_reset(request_parser* p) {
+    memset(p, 0, offsetof(request_parser, headers));
+}
 
-    // Find oldest element
-    while (current->next != NULL) {
-        if (current->next->lru_time_track < oldest->lru_time_track) {
-            oldest = current->next;
-            prev = current;
+// Record one line of the request head, [start, end) without its CR/LF;
+// next is where the following line begins. Returns -1 if malformed
+static int request_parse_line(request_parser* p, const char* buf, int start, int end, int next) {
+    const char* line = buf + start;
+    int len = end - start;
+    if (p->method_len == 0) {
+        if (len == 0) {
+            return 0;  // Blank lines may precede a request line
+        }
+        const char* sp1 = memchr(line, ' ', len);
+        const char* sp2 = sp1 ? memchr(sp1 + 1, ' ', line + len - (sp1 + 1)) : NULL;
+        if (sp2 == NULL || sp1 == line || sp2 == sp1 + 1 || line + len - (sp2 + 1) < 8 ||
+                memcmp(sp2 + 1, "HTTP/", 5) != 0) {
+            return -1;
         }
-        current = current->next;
+        p->method = start;
+        p->method_len = sp1 - line;
+        p->target = sp1 + 1 - buf;
+        p->target_len = sp2 - (sp1 + 1);
+        p->version = sp2 + 1 - buf;
+        p->version_len = line + len - (sp2 + 1);
+        return 0;
+    }
+    if (len == 0) {
+        p->blank = start;
+        p->head_len = next;
+        return 0;
     }
 
-    // Remove oldest element
-    if (prev == NULL) {
-        cache_head = oldest->next;
-    } else {
-        prev->next = oldest->next;
+    // Obsolete line folding and whitespace before the colon are rejected
+    const char* colon = memchr(line, ':', len);
+    if (*line == ' ' || *line == '\t' || colon == NULL || colon == line ||
+            colon[-1] == ' ' || colon[-1] == '\t' || p->header_count == MAX_HEADERS) {
+        return -1;
+    }
+    const char* v = colon + 1;
+    const char* v_end = line + len;
+    while (v < v_end && (*v == ' ' || *v == '\t')) {
+        v++;
     }
+    while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) {
+        v_end--;
+    }
+    header_span* h = &p->headers[p->header_count++];
+    h->name = start;
+    h->name_len = colon - line;
+    h->value = v - buf;
+    h->value_len = v_end - v;
+
+    if (header_is(buf, h, "Transfer-Encoding")) {
+        p->reject = 501;  // Chunked bodies aren't taken, nor relayed unframed
+    }
+    if (header_is(buf, h, "Content-Length")) {
+        long n = 0;
+        for (const char* d = v; d < v_end; d++) {
+            if (!isdigit((unsigned char)*d)) {
+                return -1;
+            }
+            n = n <= MAX_REQUEST_BYTES ? n * 10 + (*d - '0') : n;  // Past the limit is enough
+        }
+        if (v == v_end || (p->length_seen && n != p->body_len)) {
+            return -1;
+        }
+        p->body_len = n;
+        p->length_seen = 1;
+    }
+    return 0;
+}
+
+// Advance over bytes received since the last call, one line at a time.
+// Returns the request's full length (head plus Content-Length body) once
+// it is buffered, 0 while more is needed, -1 if it is malformed. A body
+// that can't be taken sets reject and returns the head alone
+static int request_parse(request_parser* p, const char* buf, int len) {
+    while (p->head_len == 0) {
+        if (p->error) {
+            return -1;
+        }
+        const char* eol = scan_newline(buf + p->scanned, len - p->scanned);
+        if (eol == NULL) {
+            p->scanned = len;
+            return 0;
+        }
+        int end = eol - buf;
+        int next = end + 1;
+        if (end > p->line && buf[end - 1] == '\r') {
+            end--;
+        }
+        p->scanned = next;
+        if (request_parse_line(p, buf, p->line, end, next) < 0) {
+            p->error = 1;
+            return -1;
+        }
+        p->line = next;
+    }
+    long total = p->head_len + p->body_len;
+    if (p->reject == 0 && total > MAX_REQUEST_BYTES - 1) {
+        p->reject = 413;
+    }
+    if (p->reject != 0) {
+        return p->head_len;
+    }
+    return total <= len ? (int)total : 0;
+}
+
+// Value of a request header from the parsed spans; NULL if absent
+static const char* request_header(const connection* c, const char* name, int* value_len) {
+    for (int i = 0; i < c->parser.header_count; i++) {
+        const header_span* h = &c->parser.headers[i];
+        if (header_is(c->request, h, name)) {
+            *value_len = h->value_len;
+            return c->request + h->value;
+        }
+    }
+    return NULL;
+}
+
+static int request_method_is(const connection* c, const char* method) {
+    size_t len = strlen(method);
+    return (size_t)c->parser.method_len == len &&
+           memcmp(c->request + c->parser.method, method, len) == 0;
+}
 
-    total_cache_size -= oldest->len + sizeof(cache_element) + strlen(oldest->url) + 1;
-    free(oldest->data);
-    free(oldest->url);
-    free(oldest);
+// Whether the client wants the connection kept open after this request:
+// the HTTP/1.1 default unless it sent close, opt-in for HTTP/1.0
+static int request_keeps_alive(const connection* c) {
+    int http11 = c->parser.version_len == 8 &&
+                 memcmp(c->request + c->parser.version, "HTTP/1.1", 8) == 0;
+
+    int vlen;
+    const char* v = request_header(c, "Connection", &vlen);
+    if (v == NULL) {
+        v = request_header(c, "Proxy-Connection", &vlen);
+    }
+    if (v != NULL && header_has_token(v, vlen, "close")) {
+        return 0;
+    }
+    if (request_header(c, "Transfer-Encoding", &vlen) != NULL) {
+        return 0;  // Chunked request bodies aren't delimited here
+    }
+    return http11 || (v != NULL && header_has_token(v, vlen, "keep-alive"));
+}
+
+// Copy the request for the origin without hop-by-hop connection headers;
+// the proxy manages upstream persistence itself. extra (our own validators
+// when revalidating) is added at the end of the headers and replaces the
+// client's conditionals, and a miss sent to a peer is marked as such.
+// Header lines are copied whole from their spans. Returns -1 if out of
+// memory
+static int build_forward_request(connection* c, const char* extra, int extra_len) {
+    static const char peer_line[] = PEER_HEADER ": 1\r\n";
+    int peer_len = c->peer != NULL ? (int)sizeof(peer_line) - 1 : 0;
+    const request_parser* p = &c->parser;
+    int need = c->request_len - p->method + extra_len + peer_len;
+    if (need > c->forward_cap) {
+        char* grown = realloc(c->forward, need);
+        if (grown == NULL) {
+            return -1;
+        }
+        c->forward = grown;
+        c->forward_cap = need;
+    }
+
+    int first = p->header_count > 0 ? p->headers[0].name : p->blank;
+    memcpy(c->forward, c->request + p->method, first - p->method);
+    c->forward_len = first - p->method;
+    for (int i = 0; i < p->header_count; i++) {
+        const header_span* h = &p->headers[i];
+        if (header_is(c->request, h, "Connection") ||
+                header_is(c->request, h, "Proxy-Connection") ||
+                header_is(c->request, h, "Keep-Alive") ||
+                header_is(c->request, h, PEER_HEADER) ||
+                (extra_len > 0 && (header_is(c->request, h, "If-None-Match") ||
+                                   header_is(c->request, h, "If-Modified-Since")))) {
+            continue;
+        }
+        int line_end = i + 1 < p->header_count ? p->headers[i + 1].name : p->blank;
+        memcpy(c->forward + c->forward_len, c->request + h->name, line_end - h->name);
+        c->forward_len += line_end - h->name;
+    }
+
+    // Then ours, the empty line and the body, copied untouched
+    memcpy(c->forward + c->forward_len, extra, extra_len);
+    c->forward_len += extra_len;
+    memcpy(c->forward + c->forward_len, peer_line, peer_len);
+    c->forward_len += peer_len;
+    memcpy(c->forward + c->forward_len, c->request + p->blank, c->request_len - p->blank);
+    c->forward_len += c->request_len - p->blank;
+    return 0;
+}
+
+// Parse an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"); -1 if invalid
+static time_t parse_http_date(const char* v, int len) {
+    char buf[64];
+    struct tm tm;
+    if (len <= 0 || len >= (int)sizeof(buf)) {
+        return -1;
+    }
+    memcpy(buf, v, len);
+    buf[len] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    if (strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+        return -1;
+    }
+    return timegm(&tm);
+}
+
+// True if a Cache-Control value holds directive; *arg gets its "=N"
+// argument, or -1 when it has none
+static int cache_directive(const char* v, int vlen, const char* directive, long* arg) {
+    size_t len = strlen(directive);
+    const char* end = v + vlen;
+    while (v < end) {
+        while (v < end && (*v == ' ' || *v == ',')) {
+            v++;
+        }
+        const char* item = v;
+        while (v < end && *v != ',') {
+            v++;
+        }
+        if ((size_t)(v - item) >= len && strncasecmp(item, directive, len) == 0 &&
+                (item + len == v || item[len] == '=' || item[len] == ' ')) {
+            const char* a = item + len;
+            *arg = -1;
+            if (a < v && *a == '=') {
+                a += a + 1 < v && a[1] == '"' ? 2 : 1;
+                if (a < v && isdigit((unsigned char)*a)) {
+                    *arg = strtol(a, NULL, 10);
+                }
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Header from head, or from fallback (the stored response) if head lacks it
+static const char* find_header_either(const char* head, const char* head_end,
+                                      const char* fallback, const char* fallback_end,
+                                      const char* name, int* value_len) {
+    const char* v = find_header(head, head_end, name, value_len);
+    if (v == NULL && fallback != NULL) {
+        v = find_header(fallback, fallback_end, name, value_len);
+    }
+    return v;
+}
+
+// Statuses a cache may store without explicit freshness information
+static int status_cacheable(int status) {
+    switch (status) {
+        case 200: case 203: case 204: case 300: case 301: case 308:
+        case 404: case 405: case 410: case 414: case 501:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// When a response stops being fresh and how long it may be served stale
+// after that; -1 if a shared cache must not store it. Lifetime comes from
+// s-maxage, max-age, Expires or a Last-Modified heuristic, less the age it
+// already had on arrival. Directives missing from head are taken from
+// fallback, the stored response that a 304 is refreshing
+static int response_freshness(const char* head, const char* head_end,
+                              const char* fallback, const char* fallback_end,
+                              time_t now, cache_freshness* out) {
+    int cc_len, vlen;
+    long n;
+    const char* cc = find_header_either(head, head_end, fallback, fallback_end,
+                                        "Cache-Control", &cc_len);
+    if (cc != NULL && (cache_directive(cc, cc_len, "no-store", &n) ||
+                       cache_directive(cc, cc_len, "private", &n))) {
+        return -1;
+    }
+
+    const char* v = find_header(head, head_end, "Date", &vlen);
+    time_t date = v ? parse_http_date(v, vlen) : -1;
+    if (date < 0) {
+        date = now;
+    }
+
+    long lifetime = 0;
+    if (cc != NULL && cache_directive(cc, cc_len, "no-cache", &n)) {
+        lifetime = 0;
+    } else if (cc != NULL && cache_directive(cc, cc_len, "s-maxage", &n) && n >= 0) {
+        lifetime = n;
+    } else if (cc != NULL && cache_directive(cc, cc_len, "max-age", &n) && n >= 0) {
+        lifetime = n;
+    } else if ((v = find_header_either(head, head_end, fallback, fallback_end, "Expires", &vlen)) != NULL) {
+        time_t expires = parse_http_date(v, vlen);  // Invalid dates mean already expired
+        lifetime = expires > date ? expires - date : 0;
+    } else if ((v = find_header_either(head, head_end, fallback, fallback_end, "Last-Modified", &vlen)) != NULL) {
+        time_t modified = parse_http_date(v, vlen);
+        if (modified >= 0 && modified < date) {
+            lifetime = (date - modified) * HEURISTIC_FRESHNESS_PERCENT / 100;
+            if (lifetime > HEURISTIC_FRESHNESS_MAX) {
+                lifetime = HEURISTIC_FRESHNESS_MAX;
+            }
+        }
+    }
+
+    // Corrected initial age: the larger of what the origin reports and
+    // how old its Date says the response is
+    long age = 0;
+    v = find_header(head, head_end, "Age", &vlen);
+    if (v != NULL) {
+        age = atol(v);
+    }
+    if (now - date > age) {
+        age = now - date;
+    }
+    out->expires = now + lifetime - age;
+
+    // Stale windows, unless the origin insists on revalidation
+    long stale_revalidate_for = stale_while_revalidate;
+    long stale_error_for = stale_if_error;
+    if (cc != NULL && cache_directive(cc, cc_len, "stale-while-revalidate", &n) && n >= 0) {
+        stale_revalidate_for = n;
+    }
+    if (cc != NULL && cache_directive(cc, cc_len, "stale-if-error", &n) && n >= 0) {
+        stale_error_for = n;
+    }
+    if (cc != NULL && (cache_directive(cc, cc_len, "must-revalidate", &n) ||
+                       cache_directive(cc, cc_len, "proxy-revalidate", &n) ||
+                       cache_directive(cc, cc_len, "no-cache", &n))) {
+        stale_revalidate_for = stale_error_for = 0;
+    }
+    out->stale_revalidate = out->expires + stale_revalidate_for;
+    out->stale_error = out->expires + stale_error_for;
+    return 0;
+}
+
+// What the client allows: only GET is served from or stored in the cache,
+// no-store keeps this response out of it and no-cache (or max-age=0)
+// makes a stored copy go through the origin first
+static void request_cache_policy(connection* c) {
+    c->cache_use = c->key_len > 0 && request_method_is(c, "GET");
+    c->cache_store = c->cache_use;
+    c->cache_revalidate = 0;
+    if (!c->cache_use) {
+        return;
+    }
+
+    int vlen;
+    long n;
+    const char* v = request_header(c, "Cache-Control", &vlen);
+    if (v != NULL) {
+        if (cache_directive(v, vlen, "no-store", &n)) {
+            c->cache_store = 0;
+        }
+        if (cache_directive(v, vlen, "no-cache", &n) ||
+                (cache_directive(v, vlen, "max-age", &n) && n == 0)) {
+            c->cache_revalidate = 1;
+        }
+    } else if ((v = request_header(c, "Pragma", &vlen)) != NULL &&
+               header_has_token(v, vlen, "no-cache")) {
+        c->cache_revalidate = 1;
+    }
+    if (request_header(c, "Authorization", &vlen) != NULL) {
+        c->cache_store = 0;  // Per-user answers don't belong in a shared cache
+    }
+}
+
+// Answer from a cache entry; the reference keeps the data alive while it is
+// sent. Head and body are one stored buffer, so a hit is a single send()
+static void conn_serve_cached(connection* c, cache_element* cached) {
+    c->cached = cached;
+    c->out = cached->data;
+    c->out_len = cached->len;
+    c->out_sent = 0;
+    c->keep_alive = c->keep_alive && cached->reusable;
+    c->state = CONN_SEND_RESPONSE;
+}
+
+// Format every canned response once, with its exact Content-Length
+static void canned_init(void) {
+    int count = sizeof(canned_responses) / sizeof(canned_responses[0]);
+    for (int i = 0; i < count; i++) {
+        canned_response* r = &canned_responses[i];
+        char body[128];
+        int body_len = snprintf(body, sizeof(body), "<html>%d - %s</html>\r\n", r->status, r->reason);
+        r->len = asprintf(&r->text, "HTTP/1.1 %d %s\r\n"
+                                    "Content-Type: text/html\r\n"
+                                    "Content-Length: %d\r\n"
+                                    "%s"
+                                    "Connection: close\r\n\r\n%s",
+                          r->status, r->reason, body_len, r->headers, body);
+        if (r->len < 0) {
+            perror("Building error responses failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static const canned_response* canned_for(int status_code) {
+    const canned_response* response = &canned_responses[0];
+    int count = sizeof(canned_responses) / sizeof(canned_responses[0]);
+    for (int i = 1; i < count; i++) {
+        if (canned_responses[i].status == status_code) {
+            response = &canned_responses[i];
+        }
+    }
+    return response;
+}
+
+// Function to send HTTP error responses back to client
+// The response is queued on the connection, which closes once it is written.
+// An origin failure is answered with a stale copy instead when allowed
+int send_error_response(connection* c, int status_code) {
+    if (status_code == 502 || status_code == 504) {
+        conn_fetch_done(c, -1);
+        if (conn_serve_stale(c)) {
+            return c->out_len;
+        }
+    }
+    const canned_response* response = canned_for(status_code);
+
+    c->out = response->text;
+    c->out_len = response->len;
+    c->out_sent = 0;
+    c->keep_alive = 0;
+    c->state = CONN_SEND_RESPONSE;
+    return c->out_len;
+}
+
+// Blocking socket to (host, port) for threads off the event loops; sends
+// and receives time out after timeout_s. Returns -1 if nothing answers
+static int connect_blocking(const char* host, int port, int timeout_s) {
+    char service[8];
+    struct addrinfo hints = {0};
+    struct addrinfo* res = NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0) {
+        return -1;
+    }
+
+    int fd = -1;
+    struct timeval timeout = {timeout_s, 0};
+    for (struct addrinfo* ai = res; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Refresh a stale entry for the background: blocking I/O is fine on a
+// refresh thread. Returns the length of the complete response, or -1
+static int refresh_fetch(const refresh_job* job, char* buf, int cap) {
+    int fd = connect_blocking(job->host, job->port, REFRESH_TIMEOUT);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int len = 0;
+    int ok = send(fd, job->request, job->request_len, MSG_NOSIGNAL) == job->request_len;
+    while (ok && len < cap && !response_complete(buf, len)) {
+        ssize_t n = recv(fd, buf + len, cap - len, 0);
+        if (n <= 0) {
+            // Only a response without framing may end at close
+            const char* head_end = memmem(buf, len, "\r\n\r\n", 4);
+            int vlen;
+            ok = n == 0 && head_end != NULL &&
+                 find_header(buf, head_end, "Content-Length", &vlen) == NULL &&
+                 find_header(buf, head_end, "Transfer-Encoding", &vlen) == NULL;
+            break;
+        }
+        len += n;
+    }
+    close(fd);
+    return ok && len < cap ? len : -1;
+}
+
+// Refresh thread: revalidate queued entries, renewing them on 304 and
+// replacing them on a new cacheable response. Failures leave the stale
+// copy in place
+static void* refresh_worker(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&refresh_lock);
+        while (refresh_head == NULL) {
+            pthread_cond_wait(&refresh_cond, &refresh_lock);
+        }
+        refresh_job* job = refresh_head;
+        refresh_head = job->next;
+        if (refresh_head == NULL) {
+            refresh_tail = NULL;
+        }
+        refresh_queued--;
+        pthread_mutex_unlock(&refresh_lock);
+
+        cache_element* e = job->entry;
+        io_buf* b = io_buf_get();
+        char* buf = b != NULL ? b->data : NULL;
+        int len = b != NULL ? refresh_fetch(job, buf, ram_max_object) : -1;
+        const char* head_end = len > 12 ? memmem(buf, len, "\r\n\r\n", 4) : NULL;
+        int status = head_end ? atoi(buf + 9) : 0;
+        cache_freshness fresh;
+        if (status == 304) {
+            renew_cache_element(e, buf, head_end + 4 - buf);
+#ifdef HAVE_ZLIB
+            compress_renew(e->url, buf, head_end + 4 - buf);
+#endif
+            log_info("Cache refreshed in background - not modified\n");
+        } else if (status_cacheable(status) &&
+                   response_freshness(buf, head_end, NULL, NULL, time(NULL), &fresh) == 0) {
+            add_to_cache(buf, len, e->url, e->hash, 0, &fresh);
+#ifdef HAVE_ZLIB
+            b->len = len;
+            compress_submit(b, len, e->url, &fresh);
+#endif
+            log_info("Cache refreshed in background - replaced\n");
+        } else {
+            log_error("Background refresh of %s failed\n", job->host);
+        }
+        if (job->backend != NULL) {
+            upstream_done(job->backend, len < 0 || status >= 500 ? -1 : 1);
+        }
+
+        if (b != NULL) {
+            io_buf_release(b);
+        }
+        atomic_store(&e->refreshing, 0);
+        release_cache_element(e);
+        free(job);
+    }
+    return NULL;
+}
+
+void refresh_init(void) {
+    for (int i = 0; i < REFRESH_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, refresh_worker, NULL) != 0) {
+            perror("Refresh thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+}
+
+// Queue a refresh; -1 if the queue is full and the job was not taken
+int refresh_submit(refresh_job* job) {
+    pthread_mutex_lock(&refresh_lock);
+    if (refresh_queued >= REFRESH_QUEUE_MAX) {
+        pthread_mutex_unlock(&refresh_lock);
+        return -1;
+    }
+    job->next = NULL;
+    if (refresh_tail != NULL) {
+        refresh_tail->next = job;
+    } else {
+        refresh_head = job;
+    }
+    refresh_tail = job;
+    refresh_queued++;
+    pthread_cond_signal(&refresh_cond);
+    pthread_mutex_unlock(&refresh_lock);
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+// Compressed variants: a stored response that is whole, length-delimited
+// and textual is compressed on a compress thread into each coding built
+// in, and the result kept in RAM under a derived key. Lookups prefer a
+// fresh variant the client accepts; anything else falls through to the
+// identity entry, which stays the one that is revalidated and refreshed
+
+static const char* const compress_codings[] = {
+#ifdef HAVE_BROTLI
+    "br",
+#endif
+    "gzip"
+};
+
+#define COMPRESS_CODINGS (int)(sizeof(compress_codings) / sizeof(compress_codings[0]))
+
+// The identity key plus a line that no Vary header name can produce
+static int compressed_key(const char* key, const char* coding, char* out, int cap) {
+    int len = snprintf(out, cap, "%s\ncoding=%s", key, coding);
+    return len < cap ? len : -1;
+}
+
+// A 200 carrying exactly its Content-Length, with no coding of its own, no
+// no-transform and a textual type
+static int response_compressible(const char* head, const char* head_end, int len) {
+    static const char* const types[] = {
+        "text/", "application/json", "application/javascript", "application/xml"
+    };
+    int vlen;
+    long n;
+    int body_len = len - (int)(head_end + 4 - head);
+    if (atoi(head + 9) != 200 || body_len < COMPRESS_MIN_BYTES ||
+            find_header(head, head_end, "Content-Encoding", &vlen) != NULL ||
+            find_header(head, head_end, "Transfer-Encoding", &vlen) != NULL) {
+        return 0;
+    }
+    const char* v = find_header(head, head_end, "Content-Length", &vlen);
+    if (v == NULL || atoll(v) != body_len) {
+        return 0;
+    }
+    v = find_header(head, head_end, "Cache-Control", &vlen);
+    if (v != NULL && cache_directive(v, vlen, "no-transform", &n)) {
+        return 0;
+    }
+    v = find_header(head, head_end, "Content-Type", &vlen);
+    if (v == NULL) {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        size_t type_len = strlen(types[i]);
+        if ((size_t)vlen >= type_len && strncasecmp(v, types[i], type_len) == 0) {
+            return 1;
+        }
+    }
+    return memmem(v, vlen, "+xml", 4) != NULL || memmem(v, vlen, "+json", 5) != NULL;
+}
+
+// Deflate the body, which starts head_len bytes into the chain, as gzip
+// into out; -1 if it does not fit in cap
+static int compress_gzip(const io_buf* chain, int head_len, int len, char* out, int cap) {
+    z_stream zs = {0};
+    if (deflateInit2(&zs, COMPRESS_GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = cap;
+    int remaining = len - head_len;
+    int ret = Z_OK;
+    for (const io_buf* b = chain; b != NULL && remaining > 0 && ret == Z_OK; b = b->next) {
+        int start = b == chain ? head_len : 0;
+        int n = b->len - start < remaining ? b->len - start : remaining;
+        remaining -= n;
+        zs.next_in = (Bytef*)b->data + start;
+        zs.avail_in = n;
+        ret = deflate(&zs, remaining == 0 ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_OK && zs.avail_in > 0) {
+            ret = Z_BUF_ERROR;  // Out of room
+        }
+    }
+    int out_len = ret == Z_STREAM_END ? (int)zs.total_out : -1;
+    deflateEnd(&zs);
+    return out_len;
+}
+
+#ifdef HAVE_BROTLI
+static int compress_brotli(const io_buf* chain, int head_len, int len, char* out, int cap) {
+    BrotliEncoderState* s = BrotliEncoderCreateInstance(NULL, NULL, NULL);
+    if (s == NULL) {
+        return -1;
+    }
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_QUALITY, COMPRESS_BROTLI_QUALITY);
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_MODE, BROTLI_MODE_TEXT);
+    BrotliEncoderSetParameter(s, BROTLI_PARAM_SIZE_HINT, len - head_len);
+    uint8_t* next_out = (uint8_t*)out;
+    size_t avail_out = cap;
+    int remaining = len - head_len;
+    int ok = 1;
+    for (const io_buf* b = chain; b != NULL && remaining > 0 && ok; b = b->next) {
+        int start = b == chain ? head_len : 0;
+        int n = b->len - start < remaining ? b->len - start : remaining;
+        remaining -= n;
+        const uint8_t* next_in = (const uint8_t*)b->data + start;
+        size_t avail_in = n;
+        BrotliEncoderOperation op = remaining == 0 ? BROTLI_OPERATION_FINISH
+                                                   : BROTLI_OPERATION_PROCESS;
+        while (ok && (avail_in > 0 || (op == BROTLI_OPERATION_FINISH && !BrotliEncoderIsFinished(s)))) {
+            ok = BrotliEncoderCompressStream(s, op, &avail_in, &next_in, &avail_out, &next_out, NULL) &&
+                 avail_out > 0;
+        }
+    }
+    ok = ok && remaining == 0 && BrotliEncoderIsFinished(s);
+    BrotliEncoderDestroyInstance(s);
+    return ok ? (int)(cap - avail_out) : -1;
+}
+#endif
+
+static int compress_body(const char* coding, const io_buf* chain, int head_len, int len,
+                         char* out, int cap) {
+#ifdef HAVE_BROTLI
+    if (strcmp(coding, "br") == 0) {
+        return compress_brotli(chain, head_len, len, out, cap);
+    }
+#endif
+    (void)coding;
+    return compress_gzip(chain, head_len, len, out, cap);
+}
+
+// The variant: the identity head less its length and ranges, validators
+// weakened since the bytes differ, the coding added and Accept-Encoding
+// merged into Vary, then the body
+static int compressed_response(const char* head, int head_len, const char* coding,
+                               const char* body, int body_len, char* out, int cap) {
+    int vary_seen = 0;
+    const char* line = memchr(head, '\n', head_len);
+    const char* end = head + head_len - 2;  // Before the blank line
+    if (line == NULL) {
+        return -1;
+    }
+    line++;
+    int len = line - head;
+    if (len > cap) {
+        return -1;
+    }
+    memcpy(out, head, len);
+    while (line < end) {
+        const char* next = memchr(line, '\n', end - line);
+        next = next != NULL ? next + 1 : end;
+        int n = next - line;
+        if (strncasecmp(line, "Content-Length:", 15) == 0 ||
+                strncasecmp(line, "Accept-Ranges:", 14) == 0) {
+            line = next;
+            continue;
+        }
+        int is_etag = strncasecmp(line, "ETag:", 5) == 0;
+        const char* tag = line + 5;
+        while (is_etag && tag < next && *tag == ' ') {
+            tag++;
+        }
+        // The first Vary line gains the token unless it has it or is "*"
+        const char* vary = NULL;
+        int vary_len = 0;
+        if (!vary_seen && strncasecmp(line, "Vary:", 5) == 0) {
+            vary_seen = 1;
+            vary = line + 5 + strspn(line + 5, " \t");
+            vary_len = next - vary;
+            while (vary_len > 0 && (vary[vary_len - 1] == '\r' || vary[vary_len - 1] == '\n' ||
+                                    vary[vary_len - 1] == ' ')) {
+                vary_len--;
+            }
+            if (header_has_token(vary, vary_len, "Accept-Encoding") ||
+                    header_has_token(vary, vary_len, "*")) {
+                vary = NULL;
+            }
+        }
+        if (vary != NULL) {
+            int written = snprintf(out + len, cap - len, "Vary: %.*s%sAccept-Encoding\r\n",
+                                   vary_len, vary, vary_len > 0 ? ", " : "");
+            if (written >= cap - len) {
+                return -1;
+            }
+            len += written;
+        } else if (is_etag && strncmp(tag, "W/", 2) != 0) {
+            int written = snprintf(out + len, cap - len, "ETag: W/%.*s", (int)(next - tag), tag);
+            if (written >= cap - len) {
+                return -1;
+            }
+            len += written;
+        } else {
+            if (n > cap - len) {
+                return -1;
+            }
+            memcpy(out + len, line, n);
+            len += n;
+        }
+        line = next;
+    }
+    int written = snprintf(out + len, cap - len, "Content-Encoding: %s\r\nContent-Length: %d\r\n"
+                           "%s\r\n", coding, body_len, vary_seen ? "" : "Vary: Accept-Encoding\r\n");
+    if (written >= cap - len || body_len > cap - len - written) {
+        return -1;
+    }
+    len += written;
+    memcpy(out + len, body, body_len);
+    return len + body_len;
+}
+
+static void* compress_worker(void* arg) {
+    (void)arg;
+    char* body = malloc(MAX_ELEMENT_LIMIT);
+    char* out = malloc(MAX_ELEMENT_LIMIT);
+    while (body != NULL && out != NULL) {
+        pthread_mutex_lock(&compress_lock);
+        while (compress_head == NULL) {
+            pthread_cond_wait(&compress_cond, &compress_lock);
+        }
+        compress_job* job = compress_head;
+        compress_head = job->next;
+        if (compress_head == NULL) {
+            compress_tail = NULL;
+        }
+        compress_queued--;
+        pthread_mutex_unlock(&compress_lock);
+
+        const char* head = job->chain->data;
+        int head_len = (const char*)memmem(head, job->chain->len, "\r\n\r\n", 4) + 4 - head;
+        int cap = ram_max_object;
+        for (int i = 0; i < COMPRESS_CODINGS; i++) {
+            const char* coding = compress_codings[i];
+            int body_len = compress_body(coding, job->chain, head_len, job->len, body, cap);
+            char key[MAX_BYTES];
+            int key_len = compressed_key(job->key, coding, key, sizeof(key));
+            int len = body_len >= 0 && body_len < job->len - head_len ?
+                      compressed_response(head, head_len, coding, body, body_len, out, cap) : -1;
+            if (len > 0 && key_len > 0) {
+                add_to_cache(out, len, key, cache_hash(key, key_len), 0, &job->fresh);
+            }
+        }
+        io_chain_release(job->chain);
+        free(job);
+    }
+    return NULL;
+}
+
+void compress_init(void) {
+    for (int i = 0; i < COMPRESS_THREADS; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, compress_worker, NULL) != 0) {
+            perror("Compress thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+}
+
+// Queue a just-stored response for compression, taking references on its
+// chain. Skipped when the queue is full: the identity entry serves anyway
+void compress_submit(io_buf* chain, int len, const char* key, const cache_freshness* fresh) {
+    const char* head_end = memmem(chain->data, chain->len, "\r\n\r\n", 4);
+    if (!compress_enabled || head_end == NULL || len > COMPRESS_MAX_RATIO * ram_max_object ||
+            !response_compressible(chain->data, head_end, len)) {
+        return;
+    }
+    size_t key_len = strlen(key);
+    compress_job* job = malloc(sizeof(compress_job) + key_len + 1);
+    if (job == NULL) {
+        return;
+    }
+    job->key = (char*)(job + 1);
+    memcpy(job->key, key, key_len + 1);
+    job->chain = chain;
+    job->len = len;
+    job->fresh = *fresh;
+    job->next = NULL;
+
+    pthread_mutex_lock(&compress_lock);
+    if (compress_queued >= COMPRESS_QUEUE_MAX) {
+        pthread_mutex_unlock(&compress_lock);
+        free(job);
+        return;
+    }
+    for (io_buf* b = chain; b != NULL; b = b->next) {
+        atomic_fetch_add(&b->refs, 1);
+    }
+    if (compress_tail != NULL) {
+        compress_tail->next = job;
+    } else {
+        compress_head = job;
+    }
+    compress_tail = job;
+    compress_queued++;
+    pthread_cond_signal(&compress_cond);
+    pthread_mutex_unlock(&compress_lock);
+}
+
+// A 304 renewed the identity entry at key; its variants hold the same
+// content, so they take the new freshness too
+void compress_renew(const char* key, const char* head, int head_len) {
+    for (int i = 0; i < COMPRESS_CODINGS; i++) {
+        char variant[MAX_BYTES];
+        int variant_len = compressed_key(key, compress_codings[i], variant, sizeof(variant));
+        cache_element* e = variant_len > 0 ?
+                           find_in_cache(variant, cache_hash(variant, variant_len)) : NULL;
+        if (e != NULL) {
+            renew_cache_element(e, head, head_len);
+            release_cache_element(e);
+        }
+    }
+}
+#endif
+
+// Register a handle with the loop; edge-triggered for both directions
+static int loop_watch(event_loop* loop, io_handle* h) {
+    if (loop->ring != NULL) {
+        return uring_watch(loop->ring, h);
+    }
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = h;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, h->fd, &ev);
+}
+
+// Stop watching h before its socket is closed or handed on. epoll forgets
+// a closed socket by itself; operations on a ring must be cancelled
+static void loop_unwatch(event_loop* loop, io_handle* h, int closing) {
+    if (loop->ring != NULL) {
+        uring_unwatch(loop->ring, h);
+    } else if (!closing) {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, h->fd, NULL);
+    }
+}
+
+// Create an event loop, optionally sharing a listening socket
+event_loop* loop_create(int listen_fd) {
+    event_loop* loop = calloc(1, sizeof(event_loop));
+    if (loop == NULL) {
+        return NULL;
+    }
+
+    loop->epoll_fd = -1;
+    if (uring_enabled && (loop->ring = uring_create()) == NULL) {
+        static atomic_flag warned = ATOMIC_FLAG_INIT;
+        if (!atomic_flag_test_and_set(&warned)) {
+            fprintf(stderr, "no io_uring multishot receive here (Linux 6.0+), using epoll\n");
+        }
+    }
+    if (loop->ring == NULL && (loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        perror("epoll_create1 failed");
+        free(loop);
+        return NULL;
+    }
+
+    loop->waker = waker_create();
+    if (loop->waker == NULL) {
+        perror("eventfd failed");
+        loop_destroy(loop);
+        return NULL;
+    }
+    loop->wake.fd = loop->waker->fd;
+    loop->wake.kind = HANDLE_WAKER;
+    if (loop->ring != NULL) {
+        uring_watch(loop->ring, &loop->wake);
+    } else {
+        struct epoll_event wake_ev = {0};
+        wake_ev.events = EPOLLIN | EPOLLET;
+        wake_ev.data.ptr = &loop->wake;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake.fd, &wake_ev);
+    }
+
+    loop->cpu = -1;
+    loop->listener.fd = listen_fd;
+    loop->listener.kind = HANDLE_LISTENER;
+    if (listen_fd >= 0 && loop->ring != NULL) {
+        // Multishot: one armed accept keeps delivering sockets
+        if (uring_watch(loop->ring, &loop->listener) < 0) {
+            perror("Arming accept on listener failed");
+            loop_destroy(loop);
+            return NULL;
+        }
+    } else if (listen_fd >= 0) {
+        // EPOLLEXCLUSIVE wakes only one of the loops sharing the socket
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+        ev.data.ptr = &loop->listener;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+            perror("epoll_ctl on listener failed");
+            loop_destroy(loop);
+            return NULL;
+        }
+    }
+    return loop;
+}
+
+void loop_destroy(event_loop* loop) {
+    for (int i = 0; i < loop->spare_pipe_count; i++) {
+        close(loop->spare_pipes[i][0]);
+        close(loop->spare_pipes[i][1]);
+    }
+    if (loop->owns_listener && loop->listener.fd >= 0) {
+        close(loop->listener.fd);
+    }
+    if (loop->ring != NULL) {
+        uring_destroy(loop->ring);
+    } else {
+        close(loop->epoll_fd);
+    }
+    if (loop->waker != NULL) {
+        waker_release(loop->waker);
+    }
+    free(loop);
+}
+
+// Wait for another thread's wakeup: a resolver answer or flight progress
+static void conn_park(connection* c) {
+    event_loop* loop = c->loop;
+    c->park_prev = NULL;
+    c->park_next = loop->parked;
+    if (loop->parked != NULL) {
+        loop->parked->park_prev = c;
+    }
+    loop->parked = c;
+    c->parked = 1;
+}
+
+static void conn_unpark(connection* c) {
+    if (!c->parked) {
+        return;
+    }
+    if (c->park_prev != NULL) {
+        c->park_prev->park_next = c->park_next;
+    } else {
+        c->loop->parked = c->park_next;
+    }
+    if (c->park_next != NULL) {
+        c->park_next->park_prev = c->park_prev;
+    }
+    c->parked = 0;
+}
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Start the idle clock; the list stays in arrival order so expiry is a
+// walk from the head
+static void idle_link(connection* c) {
+    event_loop* loop = c->loop;
+    c->idle_since = now_ms();
+    c->idle_next = NULL;
+    c->idle_prev = loop->idle_tail;
+    if (loop->idle_tail != NULL) {
+        loop->idle_tail->idle_next = c;
+    } else {
+        loop->idle_head = c;
+    }
+    loop->idle_tail = c;
+    c->idle_linked = 1;
+}
+
+static void idle_unlink(connection* c) {
+    if (!c->idle_linked) {
+        return;
+    }
+    event_loop* loop = c->loop;
+    if (c->idle_prev != NULL) {
+        c->idle_prev->idle_next = c->idle_next;
+    } else {
+        loop->idle_head = c->idle_next;
+    }
+    if (c->idle_next != NULL) {
+        c->idle_next->idle_prev = c->idle_prev;
+    } else {
+        loop->idle_tail = c->idle_prev;
+    }
+    c->idle_linked = 0;
+}
+
+// Close clients that idled past the timeout; returns ms until the next
+// expiry for epoll_wait, or -1 when nothing is waiting
+static int loop_expire_idle(event_loop* loop) {
+    int64_t timeout = (int64_t)keepalive_timeout * 1000;
+    int64_t now = now_ms();
+    while (loop->idle_head != NULL) {
+        int64_t left = loop->idle_head->idle_since + timeout - now;
+        if (left > 0) {
+            return left > 60000 ? 60000 : (int)left;
+        }
+        conn_close(loop->idle_head);
+    }
+    return -1;
+}
+
+// Take over an accepted socket: log it and start on its first request
+static void loop_adopt(event_loop* loop, int fd, const struct sockaddr_in* addr) {
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr->sin_addr, client_ip, sizeof(client_ip));
+    log_info("New connection from %s:%d\n", client_ip, ntohs(addr->sin_port));
+
+    if (conn_create(loop, fd) == NULL) {
+        close(fd);
+    }
+}
+
+// Accept every pending connection on the loop's listener
+static void loop_accept(event_loop* loop) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_socket = accept4(loop->listener.fd, (struct sockaddr*)&client_addr,
+                                    &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_error("Accept failed: %s\n", strerror(errno));
+            }
+            return;
+        }
+        loop_adopt(loop, client_socket, &client_addr);
+    }
+}
+
+// Shutdown: stop accepting and close clients waiting between requests.
+// The rest close once their current response is written
+static void loop_drain(event_loop* loop) {
+    connection* c = loop->idle_head;
+    while (c != NULL) {
+        connection* next = c->idle_next;
+        if (c->buffered == 0) {
+            conn_close(c);
+        }
+        c = next;
+    }
+    if (loop->listener.fd >= 0) {
+        loop_unwatch(loop, &loop->listener, 0);
+        if (loop->owns_listener) {
+            // Nobody else accepts from this socket: take what is queued first
+            loop_accept(loop);
+            close(loop->listener.fd);
+        }
+        loop->listener.fd = -1;
+    }
+}
+
+// A lookup finished or a flight progressed: let every parked connection try
+// again. Also how the signal handler asks the loop to drain
+static void loop_wake(event_loop* loop) {
+    uint64_t count;
+    while (read(loop->wake.fd, &count, sizeof(count)) > 0) {
+    }
+    if (atomic_load(&shutdown_requested)) {
+        loop_drain(loop);
+    }
+
+    connection* parked = loop->parked;
+    loop->parked = NULL;
+    while (parked != NULL) {
+        connection* c = parked;
+        parked = c->park_next;
+        c->parked = 0;
+        conn_drive(c);
+    }
+}
+
+// Route one readiness event to its connection
+static void loop_dispatch(event_loop* loop, io_handle* h, uint32_t events) {
+    if (h->kind == HANDLE_LISTENER) {
+        loop_accept(loop);
+        return;
+    }
+    if (h->kind == HANDLE_WAKER) {
+        loop_wake(loop);
+        return;
+    }
+
+    connection* c = h->conn;
+    if (c->state == CONN_CLOSED) {
+        return;
+    }
+
+    if (h->kind == HANDLE_CLIENT && (events & (EPOLLERR | EPOLLHUP))) {
+        conn_close(c);
+        return;
+    }
+
+    if (h->kind == HANDLE_UPSTREAM && c->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(h->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+            log_error("Error connecting to destination server: %s\n", strerror(err));
+            loop_unwatch(loop, &c->upstream, 1);
+            close(c->upstream.fd);
+            c->upstream.fd = -1;
+            c->addr_index++;
+            conn_connect_next(c);
+        } else if (events & EPOLLOUT) {
+            c->trace[TRACE_CONNECT] = now_us();
+            stat_latency(HIST_CONNECT, c->trace[TRACE_CONNECT] - c->upstream_us);
+            c->state = CONN_SEND_REQUEST;
+        } else {
+            return;
+        }
+    }
+
+    conn_drive(c);
+}
+
+// Free closed connections once no pending event can reference them
+static void loop_reap(event_loop* loop) {
+    while (loop->graveyard != NULL) {
+        connection* c = loop->graveyard;
+        loop->graveyard = c->next_closed;
+        release_cache_element(c->cached);
+        release_cache_element(c->stale);
+        disk_release(c->disk);
+        io_chain_release(c->fill);
+        if (c->relay != NULL) {
+            io_buf_release(c->relay);
+        }
+        free(c->request);
+        free(c->forward);
+        free(c);
+    }
+}
+
+// Run the loop until it has no listener and no connections left
+void loop_run(event_loop* loop) {
+    struct epoll_event events[MAX_EVENTS];
+
+    while (loop->listener.fd >= 0 || loop->active > 0) {
+        int timeout = loop_expire_idle(loop);
+        loop_reap(loop);
+        if (loop->listener.fd < 0 && loop->active == 0) {
+            break;
+        }
+        if (loop->ring != NULL) {
+            // Completions are dispatched as they are reaped
+            if (uring_wait(loop, timeout) < 0) {
+                break;
+            }
+            loop_reap(loop);
+            continue;
+        }
+        int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            loop_dispatch(loop, events[i].data.ptr, events[i].events);
+        }
+
+        loop_reap(loop);
+    }
+    loop_reap(loop);
+}
+
+// Pin the calling loop thread to loop->cpu and, with --numa, prefer
+// memory on that CPU's node for what the loop allocates
+static void loop_pin(event_loop* loop) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(loop->cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Pinning event loop to CPU %d failed\n", loop->cpu);
+        return;
+    }
+    unsigned cpu, node;
+    if (numa_preferred && getcpu(&cpu, &node) == 0 && node < 8 * sizeof(unsigned long)) {
+        unsigned long nodes = 1UL << node;
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodes, 8 * sizeof(nodes) + 1) < 0) {
+            perror("set_mempolicy failed");
+        }
+    }
+}
+
+static void* loop_thread(void* arg) {
+    event_loop* loop = arg;
+    if (loop->cpu >= 0) {
+        loop_pin(loop);
+    }
+    loop_run(loop);
+    return NULL;
+}
+
+// Drop this request's part in a flight. A leader that hasn't completed
+// the response abandons it, so its waiters fetch for themselves
+static void conn_leave_flight(connection* c) {
+    if (c->flight == NULL) {
+        return;
+    }
+    if (c->flight_leader) {
+        flight_finish(c->flight, FLIGHT_ABANDONED);
+    }
+    flight_release(c->flight);
+    c->flight = NULL;
+    c->flight_leader = 0;
+}
+
+// The request is done with its backend: outcome 1 for a response, -1 for a
+// failure that counts towards ejection, 0 when the client went away
+void conn_backend_done(connection* c, int outcome) {
+    if (c->backend != NULL) {
+        upstream_done(c->backend, outcome);
+        c->backend = NULL;
+    }
+}
+
+// Forget the peer, letting go of the ring it belongs to
+static void conn_drop_peer(connection* c) {
+    if (c->peer_ring != NULL) {
+        peer_ring_release(c->peer_ring);
+        c->peer_ring = NULL;
+    }
+    c->peer = NULL;
+}
+
+// The miss is over: release its backend and its slot under the origin's
+// limit, which learns from the time to first byte
+void conn_fetch_done(connection* c, int outcome) {
+    conn_backend_done(c, outcome);
+    if (c->limiter != NULL) {
+        int64_t ttfb = c->trace[TRACE_TTFB] > 0 ? c->trace[TRACE_TTFB] - c->upstream_us : 0;
+        limiter_release(c->limiter, ttfb, outcome);
+        c->limiter = NULL;
+    }
+}
+
+// Where the upstream socket goes: the peer owning the key, the chosen
+// backend in reverse-proxy mode, otherwise the origin the request names
+static const char* conn_origin(const connection* c, int* port) {
+    if (c->peer != NULL) {
+        *port = c->peer->port;
+        return c->peer->host;
+    }
+    if (c->backend != NULL) {
+        *port = c->backend->port;
+        return c->backend->host;
+    }
+    *port = c->port;
+    return c->host;
+}
+
+// Attach a freshly accepted socket to a loop
+connection* conn_create(event_loop* loop, int client_fd) {
+    connection* c = calloc(1, sizeof(connection));
+    if (c == NULL) {
+        return NULL;
+    }
+
+    c->loop = loop;
+    c->state = CONN_READ_REQUEST;
+    c->client.fd = client_fd;
+    c->client.kind = HANDLE_CLIENT;
+    c->client.conn = c;
+    c->upstream.fd = -1;
+    c->upstream.kind = HANDLE_UPSTREAM;
+    c->upstream.conn = c;
+    c->pipe_fds[0] = c->pipe_fds[1] = -1;
+    c->rx_head = -1;
+    c->trace[TRACE_ACCEPT] = now_us();
+    c->request_cap = MAX_BYTES;
+    c->request = malloc(c->request_cap);
+
+    if (c->request == NULL || loop_watch(loop, &c->client) < 0) {
+        log_error("Watching client socket failed: %s\n", strerror(errno));
+        free(c->request);
+        free(c);
+        return NULL;
+    }
+    loop->active++;
+    stat_add(STAT_CONN_OPENED, 1);
+    idle_link(c);
+
+    // Data may already be waiting; edge-triggered epoll would not report it
+    conn_drive(c);
+    return c;
+}
+
+// Close both sockets and hand the connection to the loop for freeing
+void conn_close(connection* c) {
+    if (c->state == CONN_CLOSED) {
+        return;
+    }
+    conn_unpark(c);
+    idle_unlink(c);
+    conn_leave_flight(c);
+    conn_fetch_done(c, 0);
+    conn_drop_peer(c);
+    if (c->pipe_fds[0] >= 0) {
+        // May still hold unsent bytes, so it can't be reused
+        close(c->pipe_fds[0]);
+        close(c->pipe_fds[1]);
+        c->pipe_fds[0] = c->pipe_fds[1] = -1;
+    }
+    if (c->upstream.fd >= 0) {
+        loop_unwatch(c->loop, &c->upstream, 1);
+        close(c->upstream.fd);
+        c->upstream.fd = -1;
+    }
+    loop_unwatch(c->loop, &c->client, 1);
+    close(c->client.fd);
+    c->state = CONN_CLOSED;
+    c->loop->active--;
+    stat_add(STAT_CONN_CLOSED, 1);
+    c->next_closed = c->loop->graveyard;
+    c->loop->graveyard = c;
+}
+
+// Client bytes: from the socket, or under io_uring from buffers the kernel
+// has already filled
+static ssize_t conn_recv(connection* c, char* buf, size_t len) {
+    if (c->loop->ring != NULL) {
+        return uring_recv(c, buf, len);
+    }
+    return recv(c->client.fd, buf, len, 0);
+}
+
+// Read until a whole request is buffered; returns 1 when done (see
+// c->parser.error), 0 when more data is needed, -1 when the client went away
+static int conn_read_request(connection* c) {
+    while (1) {
+        // A pipelined request may already be waiting in the buffer
+        int len = request_parse(&c->parser, c->request, c->buffered);
+        if (len < 0 || (len == 0 && c->buffered == MAX_REQUEST_BYTES - 1)) {
+            // Malformed or at the limit: handle what we have and don't trust
+            // what follows. Without a whole head that is a 400
+            len = c->buffered;
+            c->parser.error |= c->parser.head_len == 0;
+            c->keep_alive = 0;
+        } else if (len > 0) {
+            // The rest of a refused body would be read as the next request
+            c->keep_alive = c->parser.reject == 0 && request_keeps_alive(c);
+        }
+        if (len > 0) {
+            c->request_len = len;
+            c->saved = c->request[len];
+            c->request[len] = '\0';
+            return 1;
+        }
+
+        if (c->buffered == c->request_cap - 1) {
+            int cap = c->request_cap * 2 < MAX_REQUEST_BYTES ? c->request_cap * 2 : MAX_REQUEST_BYTES;
+            char* grown = realloc(c->request, cap);
+            if (grown == NULL) {
+                return -1;
+            }
+            c->request = grown;
+            c->request_cap = cap;
+        }
+        ssize_t n = conn_recv(c, c->request + c->buffered, c->request_cap - 1 - c->buffered);
+        if (n > 0) {
+            c->buffered += n;
+            c->request[c->buffered] = '\0';
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        return -1;
+    }
+}
+
+// Log a request slower than --slow-request-ms with the time each phase
+// took, and keep it as a sample for /slow. Marks are then cleared
+static void conn_trace(connection* c) {
+    static const char* const names[TRACE_MARKS] = {
+        "accept", "parse", "lookup", "dns", "connect", "ttfb", "transfer"
+    };
+    int64_t total = c->trace[TRACE_DONE] - c->trace[TRACE_PARSE];
+    if (slow_request_ms > 0 && total >= (int64_t)slow_request_ms * 1000) {
+        char line[LOG_LINE_MAX];
+        int len = snprintf(line, sizeof(line), "Slow request %.1f ms:", total / 1000.0);
+        int64_t prev = 0;
+        for (int i = 0; i < TRACE_MARKS; i++) {
+            if (c->trace[i] == 0) {
+                continue;
+            }
+            if (prev != 0 && len < (int)sizeof(line)) {
+                len += snprintf(line + len, sizeof(line) - len, " %s %.1f", names[i],
+                                (c->trace[i] - prev) / 1000.0);
+            }
+            prev = c->trace[i];
+        }
+        if (len < (int)sizeof(line)) {
+            snprintf(line + len, sizeof(line) - len, " %.*s\n", c->key_len, c->key);
+        }
+        trace_sample(line);
+        log_info("%s", line);
+    }
+    memset(c->trace, 0, sizeof(c->trace));
+}
+
+// Response written: go back to reading, keeping any pipelined bytes
+static void conn_next_request(connection* c) {
+    release_cache_element(c->cached);
+    c->cached = NULL;
+    disk_release(c->disk);
+    c->disk = NULL;
+    release_cache_element(c->stale);
+    c->stale = NULL;
+    conn_leave_flight(c);
+    c->flight_skip = 0;
+    c->out = NULL;
+    c->out_len = c->out_sent = 0;
+    if (c->relay != NULL) {
+        io_buf_release(c->relay);  // Idle connections hold no relay buffer
+        c->relay = NULL;
+    }
+    c->requests_served++;
+    c->trace[TRACE_DONE] = now_us();
+    stat_latency(HIST_TOTAL, c->trace[TRACE_DONE] - c->started_us);
+    conn_trace(c);
+
+    if (!c->keep_alive || c->requests_served >= keepalive_max_requests ||
+            atomic_load(&shutdown_requested)) {
+        conn_close(c);
+        return;
+    }
+
+    c->request[c->request_len] = c->saved;
+    c->buffered -= c->request_len;
+    memmove(c->request, c->request + c->request_len, c->buffered);
+    c->request[c->buffered] = '\0';
+    c->request_len = 0;
+    request_parser_reset(&c->parser);
+    c->state = CONN_READ_REQUEST;
+    idle_link(c);
+}
+
+// Connect to the next resolved address, failing over past ones that refuse
+void conn_connect_next(connection* c) {
+    while (c->addr_index < c->addrs.count) {
+        int i = c->addr_index;
+        c->upstream.fd = connect_to_server((struct sockaddr*)&c->addrs.addr[i],
+                                           c->addrs.addr_len[i]);
+        if (c->upstream.fd >= 0 && loop_watch(c->loop, &c->upstream) == 0) {
+            c->upstream_us = now_us();
+            c->state = CONN_CONNECTING;
+            return;
+        }
+        if (c->upstream.fd >= 0) {
+            close(c->upstream.fd);
+            c->upstream.fd = -1;
+        }
+        c->addr_index++;
+    }
+    if (!conn_backend_failover(c)) {
+        send_error_response(c, 502);
+    }
+}
+
+// Look up the origin; parks the connection on the loop while that is pending
+static void conn_resolve(connection* c) {
+    int port;
+    const char* host = conn_origin(c, &port);
+    int found = dns_resolve(host, port, c->loop->waker, &c->addrs);
+    if (found == 0) {
+        c->state = CONN_RESOLVING;
+        if (!c->parked) {
+            conn_park(c);
+        }
+        return;
+    }
+    if (found < 0) {
+        if (!conn_backend_failover(c)) {
+            send_error_response(c, 502);
+        }
+        return;
+    }
+    c->trace[TRACE_DNS] = now_us();
+    c->addr_index = 0;
+    conn_connect_next(c);
+}
+
+// In reverse-proxy mode, choose a backend for a miss that has none and
+// isn't going to a peer
+static void conn_pick_backend(connection* c, const upstream_backend* avoid) {
+    if (upstream_count > 0 && c->backend == NULL && c->peer == NULL) {
+        c->backend = upstream_pick(avoid);
+        c->backend_failed = 0;
+        atomic_fetch_add(&c->backend->outstanding, 1);
+    }
+}
+
+// The miss moved to another endpoint: so does its slot, the one it left
+// charged with a failure. It was admitted already, so it is not shed
+static void conn_move_limit(connection* c) {
+    if (c->limiter == NULL) {
+        return;
+    }
+    limiter_release(c->limiter, 0, -1);
+    int port;
+    const char* host = conn_origin(c, &port);
+    c->limiter = limiter_for(host, port);
+    limiter_acquire(c->limiter, 0);
+}
+
+// Attach an upstream socket, preferring a warm pooled one. In reverse-proxy
+// mode a backend is chosen first; a retry stays on the same one
+static void conn_connect_upstream(connection* c, int allow_pooled) {
+    c->request_sent = 0;
+    c->upstream_reused = 0;
+    conn_pick_backend(c, NULL);
+    int port;
+    const char* host = conn_origin(c, &port);
+    c->upstream.fd = allow_pooled ? pool_acquire(host, port) : -1;
+    if (c->upstream.fd >= 0 && loop_watch(c->loop, &c->upstream) == 0) {
+        c->upstream_reused = 1;
+        c->state = CONN_SEND_REQUEST;
+        return;
+    }
+    if (c->upstream.fd >= 0) {
+        close(c->upstream.fd);
+        c->upstream.fd = -1;
+    }
+    conn_resolve(c);
+}
+
+// An unreachable backend: count it against that one and move the request
+// to another while tries remain. An unreachable peer is skipped for a
+// while and the request goes to the origin instead
+int conn_backend_failover(connection* c) {
+    if (c->peer != NULL) {
+        log_info("Peer %s:%d unreachable; fetching from the origin\n",
+                 c->peer->host, c->peer->port);
+        atomic_store(&c->peer->down_until, now_ms() + PEER_DOWN_MS);
+        conn_drop_peer(c);
+        conn_pick_backend(c, NULL);
+        conn_move_limit(c);
+        c->revalidate_sent = 0;  // A stale copy stays the stale-if-error fallback
+        if (build_forward_request(c, NULL, 0) < 0) {
+            return 0;
+        }
+        conn_connect_upstream(c, 1);
+        return 1;
+    }
+    if (c->backend == NULL || upstream_count < 2 || c->backend_tries + 1 >= UPSTREAM_TRIES) {
+        return 0;
+    }
+    upstream_backend* failed = c->backend;
+    conn_backend_done(c, -1);
+    c->backend_tries++;
+    conn_pick_backend(c, failed);
+    conn_move_limit(c);
+    conn_connect_upstream(c, 1);
+    return 1;
+}
+
+// A pooled socket the origin closed under us: retry once on a fresh one
+static int conn_retry_stale(connection* c) {
+    if (!c->upstream_reused) {
+        return 0;
+    }
+    loop_unwatch(c->loop, &c->upstream, 1);
+    close(c->upstream.fd);
+    c->upstream.fd = -1;
+    conn_connect_upstream(c, 0);
+    return 1;
+}
+
+// Split an authority into host and port; accepts [v6]:port literals
+static int parse_authority(const char* p, int len, char* host, size_t host_size, int* port) {
+    const char* host_end = p + len;
+    const char* port_start = NULL;
+    if (len > 0 && p[0] == '[') {
+        const char* close = memchr(p, ']', len);
+        if (close == NULL) {
+            return -1;
+        }
+        host_end = close;
+        p++;
+        if (close + 1 < p + len - 1 && close[1] == ':') {
+            port_start = close + 2;
+        }
+    } else {
+        const char* colon = memchr(p, ':', len);
+        if (colon != NULL) {
+            host_end = colon;
+            port_start = colon + 1;
+        }
+    }
+    if (host_end - p <= 0 || (size_t)(host_end - p) >= host_size) {
+        return -1;
+    }
+    for (int i = 0; i < host_end - p; i++) {
+        host[i] = tolower((unsigned char)p[i]);
+    }
+    host[host_end - p] = '\0';
+
+    *port = 80;
+    if (port_start != NULL && port_start < p + len) {
+        *port = atoi(port_start);
+        if (*port <= 0 || *port > 65535) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Upstream group: with --upstream, every miss goes to one of a fixed set of
+// backends instead of the origin the request names. Each request picks a
+// backend by load, a run of failures ejects one for a while, and a health
+// thread takes those that stop answering checks out of rotation
+
+// Add a backend from "host:port"; startup only
+int upstream_add(const char* authority) {
+    if (upstreams == NULL) {
+        upstreams = calloc(UPSTREAM_MAX, sizeof(upstream_backend));
+    }
+    if (upstreams == NULL || upstream_count == UPSTREAM_MAX) {
+        return -1;
+    }
+    upstream_backend* b = &upstreams[upstream_count];
+    if (parse_authority(authority, strlen(authority), b->host, sizeof(b->host), &b->port) < 0) {
+        return -1;
+    }
+    atomic_init(&b->healthy, 1);
+    upstream_count++;
+    return 0;
+}
+
+static int upstream_usable(const upstream_backend* b, int64_t now) {
+    return atomic_load(&b->healthy) && now >= atomic_load(&b->ejected_until);
+}
+
+static uint32_t upstream_random(void) {
+    static __thread uint64_t state = 0;
+    if (state == 0) {
+        state = ((uint64_t)(uintptr_t)&state ^ (uint64_t)now_us()) | 1;
+    }
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (uint32_t)(state >> 32);
+}
+
+// Choose a backend, other than avoid if another will do. Ejected and
+// unhealthy ones are passed over unless nothing else is left, so a group
+// that is all down still gets tried rather than refusing everything
+upstream_backend* upstream_pick(const upstream_backend* avoid) {
+    int candidates[UPSTREAM_MAX];
+    int count = 0;
+    int64_t now = now_ms();
+    for (int pass = 0; pass < 3 && count == 0; pass++) {
+        for (int i = 0; i < upstream_count; i++) {
+            const upstream_backend* b = &upstreams[i];
+            if ((pass == 0 && b == avoid) || (pass < 2 && !upstream_usable(b, now))) {
+                continue;
+            }
+            candidates[count++] = i;
+        }
+    }
+
+    int first = upstream_random() % count;
+    upstream_backend* best = &upstreams[candidates[first]];
+    if (upstream_balance == BALANCE_P2C) {
+        if (count > 1) {
+            int second = upstream_random() % (count - 1);
+            upstream_backend* other = &upstreams[candidates[second >= first ? second + 1 : second]];
+            if (atomic_load(&other->outstanding) < atomic_load(&best->outstanding)) {
+                best = other;
+            }
+        }
+        return best;
+    }
+    // Least outstanding, starting the scan at random to spread ties
+    for (int k = 1; k < count; k++) {
+        upstream_backend* b = &upstreams[candidates[(first + k) % count]];
+        if (atomic_load(&b->outstanding) < atomic_load(&best->outstanding)) {
+            best = b;
+        }
+    }
+    return best;
+}
+
+// A request on b finished: outcome 1 succeeded, -1 failed, 0 neither. The
+// UPSTREAM_EJECT_FAILURES'th failure in a row ejects b, for longer each
+// time it happens again before a success
+void upstream_done(upstream_backend* b, int outcome) {
+    atomic_fetch_sub(&b->outstanding, 1);
+    if (outcome > 0) {
+        atomic_store(&b->failures, 0);
+        atomic_store(&b->ejections, 0);
+        return;
+    }
+    if (outcome == 0 || atomic_fetch_add(&b->failures, 1) + 1 < UPSTREAM_EJECT_FAILURES) {
+        return;
+    }
+    int64_t now = now_ms();
+    int64_t until = atomic_load(&b->ejected_until);
+    int n = atomic_load(&b->ejections);
+    int64_t ms = (int64_t)UPSTREAM_EJECT_MS << (n < UPSTREAM_EJECT_DOUBLINGS ? n : UPSTREAM_EJECT_DOUBLINGS);
+    if (now >= until && atomic_compare_exchange_strong(&b->ejected_until, &until, now + ms)) {
+        atomic_fetch_add(&b->ejections, 1);
+        atomic_store(&b->failures, 0);
+        atomic_fetch_add(&b->ejected_total, 1);
+        log_info("Upstream %s:%d ejected for %ld ms\n", b->host, b->port, (long)ms);
+    }
+}
+
+// One active check: connect, and with --health-check GET the path and
+// expect a 2xx or 3xx
+static int health_probe(const upstream_backend* b) {
+    int fd = connect_blocking(b->host, b->port, HEALTH_TIMEOUT);
+    if (fd < 0) {
+        return 0;
+    }
+    int ok = 1;
+    if (health_path != NULL) {
+        char req[MAX_BYTES];
+        char status[13];  // "HTTP/1.1 200" and its terminator
+        int got = 0;
+        int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s:%d\r\n"
+                           "Connection: close\r\n\r\n", health_path, b->host, b->port);
+        ok = len < (int)sizeof(req) && send(fd, req, len, MSG_NOSIGNAL) == len;
+        while (ok && got < (int)sizeof(status) - 1) {
+            ssize_t n = recv(fd, status + got, sizeof(status) - 1 - got, 0);
+            ok = n > 0;
+            got += ok ? n : 0;
+        }
+        status[got] = '\0';
+        int code = ok ? atoi(status + 9) : 0;
+        ok = ok && strncmp(status, "HTTP/1.", 7) == 0 && code >= 200 && code < 400;
+    }
+    close(fd);
+    return ok;
+}
+
+static void* health_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        for (int i = 0; i < upstream_count; i++) {
+            upstream_backend* b = &upstreams[i];
+            if (health_interval <= 0 || health_probe(b)) {
+                b->check_failures = 0;
+                if (!atomic_exchange(&b->healthy, 1)) {
+                    log_info("Upstream %s:%d is passing health checks\n", b->host, b->port);
+                }
+            } else if (++b->check_failures >= HEALTH_FALLS && atomic_exchange(&b->healthy, 0)) {
+                log_info("Upstream %s:%d is failing health checks\n", b->host, b->port);
+            }
+        }
+        sleep(health_interval > 0 ? health_interval : 1);
+    }
+    return NULL;
+}
+
+// Check the group off the event loops, which only read the result
+void health_start(void) {
+    if (upstream_count == 0) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, health_thread, NULL) != 0) {
+        perror("Health check thread creation failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+// Peering: with --peer, nodes share one consistent-hash ring over the cache
+// key. A miss on a key another node owns is forwarded to that node, marked
+// with PEER_HEADER so it fetches rather than forwards again, and is not
+// kept here: each object is cached once across the group. Each node has
+// PEER_VNODES points, so a node joining or leaving moves only the keys on
+// its own arcs
+
+// cache_hash() is FNV-1a, whose high bits barely move between names that
+// differ at the end; the ring orders by them, so finish with a full mix
+static uint64_t peer_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static int peer_point_compare(const void* a, const void* b) {
+    uint64_t x = ((const peer_point*)a)->hash;
+    uint64_t y = ((const peer_point*)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+static void peer_ring_free(peer_ring* ring) {
+    free(ring->points);
+    free(ring->nodes);
+    free(ring);
+}
+
+// Build s's ring, into *out; NULL without peers. Node 0 is this one, and a
+// --peer naming it is skipped, so every node can share one peer list
+int peer_ring_build(const startup_config* s, peer_ring** out) {
+    *out = NULL;
+    if (s->peer_count == 0) {
+        return 0;
+    }
+    if (s->peer_self == NULL) {
+        printf("--peer needs --peer-self host:port, this node's address on the ring\n");
+        return -1;
+    }
+    peer_ring* ring = calloc(1, sizeof(peer_ring));
+    if (ring == NULL || (ring->nodes = calloc(s->peer_count + 1, sizeof(peer_node))) == NULL ||
+            (ring->points = calloc((s->peer_count + 1) * PEER_VNODES, sizeof(peer_point))) == NULL) {
+        perror("Peer ring allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = -1; i < s->peer_count; i++) {
+        const char* authority = i < 0 ? s->peer_self : s->peers[i];
+        peer_node* n = &ring->nodes[ring->count];
+        if (parse_authority(authority, strlen(authority), n->host, sizeof(n->host), &n->port) < 0) {
+            printf("Invalid peer '%s'. Use host:port\n", authority);
+            peer_ring_free(ring);
+            return -1;
+        }
+        if (i >= 0 && strcmp(n->host, ring->nodes[0].host) == 0 && n->port == ring->nodes[0].port) {
+            continue;
+        }
+        atomic_init(&n->down_until, 0);
+        for (int v = 0; v < PEER_VNODES; v++) {
+            char name[300];
+            int len = snprintf(name, sizeof(name), "%s:%d#%d", n->host, n->port, v);
+            peer_point* p = &ring->points[ring->point_count++];
+            p->hash = peer_mix(cache_hash(name, len));
+            p->node = ring->count;
+        }
+        ring->count++;
+    }
+    qsort(ring->points, ring->point_count, sizeof(peer_point), peer_point_compare);
+    *out = ring;
+    return 0;
+}
+
+// Make ring the current one. The ring it replaces is retired, and retired
+// rings are freed at later reloads, once no connection holds them and
+// PEER_RING_GRACE_MS has passed: that covers a reader that loaded the old
+// pointer just before the swap and has yet to take its reference
+void peer_ring_publish(peer_ring* ring) {
+    peer_ring* old = atomic_exchange(&peer_ring_current, ring);
+    int64_t now = now_ms();
+    if (old != NULL) {
+        old->retired_ms = now;
+        old->next_retired = peer_rings_retired;
+        peer_rings_retired = old;
+    }
+    peer_ring** link = &peer_rings_retired;
+    while (*link != NULL) {
+        peer_ring* r = *link;
+        if (now - r->retired_ms >= PEER_RING_GRACE_MS && atomic_load(&r->refs) == 0) {
+            *link = r->next_retired;
+            peer_ring_free(r);
+        } else {
+            link = &r->next_retired;
+        }
+    }
+}
+
+// A reference on the current ring, or NULL without one. A ring replaced
+// between the load and the increment is let go again, so retired rings
+// only lose references
+static peer_ring* peer_ring_acquire(void) {
+    while (1) {
+        peer_ring* ring = atomic_load(&peer_ring_current);
+        if (ring == NULL) {
+            return NULL;
+        }
+        atomic_fetch_add(&ring->refs, 1);
+        if (atomic_load(&peer_ring_current) == ring) {
+            return ring;
+        }
+        atomic_fetch_sub(&ring->refs, 1);
+    }
+}
+
+void peer_ring_release(peer_ring* ring) {
+    atomic_fetch_sub(&ring->refs, 1);
+}
+
+// The peer owning this request's key, or NULL to fetch it here: keys this
+// node owns, requests a peer sent, and keys of a peer that is down, which
+// go to the origin rather than move to another node. A peer comes with a
+// reference on its ring in *held
+peer_node* peer_owner(const connection* c, peer_ring** held) {
+    int vlen;
+    if (atomic_load(&peer_ring_current) == NULL || !c->cache_store || c->key_len == 0 ||
+            request_header(c, PEER_HEADER, &vlen) != NULL) {
+        return NULL;
+    }
+    peer_ring* ring = peer_ring_acquire();
+    if (ring == NULL) {
+        return NULL;
+    }
+    // First point at or after the key's hash, wrapping past the end
+    uint64_t hash = peer_mix(c->key_hash);
+    int lo = 0;
+    int hi = ring->point_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    peer_node* n = &ring->nodes[ring->points[lo < ring->point_count ? lo : 0].node];
+    if (n == &ring->nodes[0] || now_ms() < atomic_load(&n->down_until)) {
+        peer_ring_release(ring);
+        return NULL;
+    }
+    *held = ring;
+    return n;
+}
+
+// Miss limiting: each origin may have only so many misses in flight, a
+// limit that adapts to how it answers. Time to first byte is smoothed and
+// compared with the lowest recently seen: while it stays near that, a
+// limit in use grows by one per limit's worth of responses; when it climbs
+// past LIMIT_TOLERANCE times or a fetch fails, the limit is cut by
+// LIMIT_BACKOFF. Misses over the limit are answered 503 at once instead of
+// queueing behind a struggling origin; hits never touch it. Limits are
+// per endpoint, the backend or peer a miss goes to or else its origin,
+// and endpoints share one only when they hash to the same of LIMIT_BUCKETS
+
+void limiter_init(void) {
+    for (int i = 0; i < LIMIT_BUCKETS; i++) {
+        miss_limiter* l = &limiters[i];
+        pthread_mutex_init(&l->lock, NULL);
+        atomic_init(&l->inflight, 0);
+        l->estimate = LIMIT_INITIAL;
+        atomic_init(&l->limit, LIMIT_INITIAL);
+    }
+}
+
+miss_limiter* limiter_for(const char* host, int port) {
+    uint64_t hash = cache_hash(host, strlen(host)) ^ (uint64_t)port;
+    return &limiters[hash % LIMIT_BUCKETS];
+}
+
+// Take a slot for a miss; -1 sheds it, which only a new miss may be.
+// Counted even when limiting is off, so that turning it on by reload
+// starts from the true load
+int limiter_acquire(miss_limiter* l, int may_shed) {
+    int inflight = atomic_fetch_add(&l->inflight, 1);
+    int limit = atomic_load(&l->limit);
+    if (may_shed && miss_limit_max > 0 &&
+            inflight >= (limit < miss_limit_max ? limit : miss_limit_max)) {
+        atomic_fetch_sub(&l->inflight, 1);
+        return -1;
+    }
+    return 0;
+}
+
+// A miss finished: outcome 1 with its time to first byte, -1 failed, 0
+// tells nothing about the origin
+void limiter_release(miss_limiter* l, int64_t ttfb_us, int outcome) {
+    int inflight = atomic_fetch_sub(&l->inflight, 1);
+    if (miss_limit_max <= 0 || outcome == 0 || (outcome > 0 && ttfb_us <= 0)) {
+        return;
+    }
+    int64_t now = now_ms();
+    pthread_mutex_lock(&l->lock);
+    if (outcome > 0) {
+        l->smoothed_us = l->smoothed_us > 0 ? l->smoothed_us + (ttfb_us - l->smoothed_us) / 8 : ttfb_us;
+        if (l->window_min_us == 0 || ttfb_us < l->window_min_us) {
+            l->window_min_us = ttfb_us;
+        }
+        if (l->baseline_us == 0 || ttfb_us < l->baseline_us) {
+            l->baseline_us = ttfb_us;
+        }
+        // Relearn the baseline now and then, in case the origin got slower for good
+        if (now - l->window_start_ms >= LIMIT_BASELINE_MS) {
+            l->baseline_us = l->window_min_us;
+            l->window_min_us = 0;
+            l->window_start_ms = now;
+        }
+    }
+    int congested = outcome < 0 ||
+                    l->smoothed_us > l->baseline_us * LIMIT_TOLERANCE + LIMIT_SLACK_US;
+    if (congested) {
+        if (now - l->last_decrease_ms >= LIMIT_DECREASE_MS) {
+            l->estimate *= LIMIT_BACKOFF;  // One cut per burst of bad news
+            l->last_decrease_ms = now;
+        }
+    } else if (inflight * 2 >= l->estimate) {
+        l->estimate += 1.0 / l->estimate;
+    }
+    if (l->estimate < LIMIT_MIN) {
+        l->estimate = LIMIT_MIN;
+    } else if (l->estimate > miss_limit_max) {
+        l->estimate = miss_limit_max;
+    }
+    atomic_store(&l->limit, (int)l->estimate);
+    pthread_mutex_unlock(&l->lock);
+}
+
+// Work out the origin and the normalized cache key from the request line
+// (absolute-form or origin-form plus Host). Headers that do not change
+// the resource, like User-Agent or cookie order, stay out of the key
+static int build_cache_key(connection* c) {
+    const char* target = c->request + c->parser.target;
+    const char* target_end = target + c->parser.target_len;
+
+    const char* path = target;
+    int path_len = target_end - target;
+    if (path_len > 7 && strncasecmp(target, "http://", 7) == 0) {
+        // Absolute-form: the authority in the URI wins over Host
+        const char* authority = target + 7;
+        const char* slash = memchr(authority, '/', target_end - authority);
+        const char* auth_end = slash ? slash : target_end;
+        if (parse_authority(authority, auth_end - authority, c->host, sizeof(c->host), &c->port) < 0) {
+            return -1;
+        }
+        path = slash ? slash : "/";
+        path_len = slash ? target_end - slash : 1;
+    } else {
+        int vlen;
+        const char* host = request_header(c, "Host", &vlen);
+        if (host == NULL || parse_authority(host, vlen, c->host, sizeof(c->host), &c->port) < 0) {
+            return -1;
+        }
+    }
+
+    // The fragment never reaches the origin
+    const char* hash_mark = memchr(path, '#', path_len);
+    if (hash_mark != NULL) {
+        path_len = hash_mark - path;
+    }
+
+    c->key_len = snprintf(c->key, sizeof(c->key), "%.*s http://%s:%d%.*s",
+                          c->parser.method_len, c->request + c->parser.method,
+                          c->host, c->port, path_len, path);
+    if (c->key_len >= (int)sizeof(c->key)) {
+        c->key_len = 0;  // Too long to key: proxied, never cached
+    }
+    c->key_hash = cache_hash(c->key, c->key_len);
+    return 0;
+}
+
+// Secondary key for a Vary'd response: the primary key plus the request's
+// value of each named header, with whitespace runs collapsed
+static int build_variant_key(const connection* c, const char* names, int names_len,
+                             char* out, int cap) {
+    int len = 0;
+    if (c->key_len >= cap) {
+        return -1;
+    }
+    memcpy(out, c->key, c->key_len);
+    len = c->key_len;
+
+    const char* p = names;
+    const char* end = names + names_len;
+    while (p < end) {
+        const char* comma = memchr(p, ',', end - p);
+        const char* name_end = comma ? comma : end;
+        char name[128];
+        int name_len = name_end - p;
+        if (name_len > 0 && name_len < (int)sizeof(name)) {
+            memcpy(name, p, name_len);
+            name[name_len] = '\0';
+
+            int vlen = 0;
+            const char* v = request_header(c, name, &vlen);
+            if (len + name_len + 2 >= cap) {
+                return -1;
+            }
+            out[len++] = '\n';
+            memcpy(out + len, name, name_len);
+            len += name_len;
+            out[len++] = ':';
+            for (int i = 0; v != NULL && i < vlen; i++) {
+                if (len + 1 >= cap) {
+                    return -1;
+                }
+                if (v[i] == ' ' || v[i] == '\t') {
+                    if (len > 0 && out[len - 1] != ' ' && out[len - 1] != ':') {
+                        out[len++] = ' ';
+                    }
+                } else {
+                    out[len++] = v[i];
+                }
+            }
+        }
+        p = name_end + 1;
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// Lowercased, space-free Vary header names from a response head; returns
+// -1 for Vary: * (never cacheable), 0 when there is no Vary
+static int response_vary_names(const char* head, int head_len, char* out, int cap) {
+    const char* end = memmem(head, head_len, "\r\n\r\n", 4);
+    int vlen;
+    const char* v = end ? find_header(head, end, "Vary", &vlen) : NULL;
+    if (v == NULL) {
+        return 0;
+    }
+    int len = 0;
+    for (int i = 0; i < vlen; i++) {
+        if (v[i] == '*') {
+            return -1;
+        }
+        if (v[i] == ' ' || v[i] == '\t') {
+            continue;
+        }
+        if (len + 1 >= cap) {
+            return -1;
+        }
+        out[len++] = tolower((unsigned char)v[i]);
+    }
+    out[len] = '\0';
+    return len;
+}
+
+// Put a captured response in the tier it fits: RAM up to ram_max_object,
+// which one buffer always holds, larger ones to the disk writer, which
+// takes the chain itself
+static void cache_store(io_buf* chain, int len, const char* key, uint64_t hash,
+                        int reusable, const cache_freshness* fresh) {
+    if (len <= ram_max_object) {
+        add_to_cache(chain->data, len, key, hash, 0, fresh);
+    } else {
+        disk_submit(chain, len, key, hash, reusable, fresh);
+    }
+}
+
+// Store a finished response under the request's key, or under a variant
+// key with a marker at the primary key when the origin sent Vary. The
+// head is all in the chain's first buffer, as the relay buffer held it
+static void conn_store_response(connection* c, io_buf* chain, int len) {
+    const char* data = chain->data;
+    const char* head_end = memmem(data, chain->len, "\r\n\r\n", 4);
+    if (!c->cache_store || c->peer != NULL || head_end == NULL ||
+            !status_cacheable(atoi(data + 9))) {
+        return;  // Not storable, or the owning peer keeps it
+    }
+    time_t now = time(NULL);
+    cache_freshness fresh;
+    int vlen;
+    if (response_freshness(data, head_end, NULL, NULL, now, &fresh) < 0 ||
+            (fresh.expires <= now && fresh.stale_error <= now &&
+             find_header(data, head_end, "ETag", &vlen) == NULL &&
+             find_header(data, head_end, "Last-Modified", &vlen) == NULL)) {
+        return;  // Forbidden, or stale with no way to revalidate or fall back on
+    }
+
+    char names[256];
+    int names_len = response_vary_names(data, chain->len, names, sizeof(names));
+    if (names_len < 0) {
+        return;
+    }
+    int reusable = c->framing != BODY_UNTIL_CLOSE &&
+                   response_keeps_alive(data, head_end + 4 - data);
+    if (names_len == 0) {
+        cache_store(chain, len, c->key, c->key_hash, reusable, &fresh);
+#ifdef HAVE_ZLIB
+        compress_submit(chain, len, c->key, &fresh);
+#endif
+        return;
+    }
+
+    char variant[MAX_BYTES];
+    int variant_len = build_variant_key(c, names, names_len, variant, sizeof(variant));
+    if (variant_len < 0) {
+        return;
+    }
+    add_to_cache(names, names_len, c->key, c->key_hash, CACHE_VARY, NULL);
+    cache_store(chain, len, variant, cache_hash(variant, variant_len), reusable, &fresh);
+#ifdef HAVE_ZLIB
+    compress_submit(chain, len, variant, &fresh);
+#endif
+}
+
+// RAM first, then the disk tier: small records are promoted into RAM,
+// larger ones come back pinned in *disk to be sent from the file
+static cache_element* cache_tier_lookup(const char* key, uint64_t hash, disk_entry** disk) {
+    cache_element* e = find_in_cache(key, hash);
+    if (e != NULL) {
+        return e;
+    }
+    disk_entry* d = disk_lookup(key, hash);
+    if (d == NULL) {
+        return NULL;
+    }
+    if (d->data_len > (uint32_t)ram_max_object) {
+        *disk = d;
+        return NULL;
+    }
+    return disk_promote(d);
+}
+
+#ifdef HAVE_ZLIB
+// Whether the request's Accept-Encoding lists coding at a nonzero q
+static int request_accepts_coding(const connection* c, const char* coding) {
+    int vlen;
+    const char* v = request_header(c, "Accept-Encoding", &vlen);
+    if (v == NULL) {
+        return 0;
+    }
+    const char* end = v + vlen;
+    size_t coding_len = strlen(coding);
+    while (v < end) {
+        const char* item_end = memchr(v, ',', end - v);
+        if (item_end == NULL) {
+            item_end = end;
+        }
+        while (v < item_end && (*v == ' ' || *v == '\t')) {
+            v++;
+        }
+        const char* p = v;
+        while (p < item_end && *p != ';' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+        if ((size_t)(p - v) == coding_len && strncasecmp(v, coding, coding_len) == 0) {
+            const char* q = memmem(p, item_end - p, "q=", 2);
+            return q == NULL || strtod(q + 2, NULL) > 0;
+        }
+        v = item_end + 1;
+    }
+    return 0;
+}
+
+// A fresh compressed variant the client accepts, in the order the codings
+// are listed; anything found stale is left to expire
+static cache_element* conn_lookup_compressed(connection* c, const char* base, disk_entry** disk) {
+    if (!compress_enabled || c->cache_revalidate) {
+        return NULL;
+    }
+    time_t now = time(NULL);
+    for (int i = 0; i < COMPRESS_CODINGS; i++) {
+        char key[MAX_BYTES];
+        int key_len = compressed_key(base, compress_codings[i], key, sizeof(key));
+        if (key_len < 0 || !request_accepts_coding(c, compress_codings[i])) {
+            continue;
+        }
+        cache_element* e = cache_tier_lookup(key, cache_hash(key, key_len), disk);
+        if (e != NULL && now < atomic_load(&e->expires)) {
+            return e;
+        }
+        release_cache_element(e);
+        if (*disk != NULL && now < (*disk)->fresh.expires) {
+            return NULL;
+        }
+        disk_release(*disk);
+        *disk = NULL;
+    }
+    return NULL;
+}
+#endif
+
+// Find the stored response for this request, following a Vary marker
+static cache_element* conn_lookup_cache(connection* c, disk_entry** disk) {
+    *disk = NULL;
+#ifdef HAVE_ZLIB
+    cache_element* compressed = conn_lookup_compressed(c, c->key, disk);
+    if (compressed != NULL || *disk != NULL) {
+        return compressed;
+    }
+#endif
+    cache_element* e = cache_tier_lookup(c->key, c->key_hash, disk);
+    if (e == NULL || !e->is_vary) {
+        return e;
+    }
+    char variant[MAX_BYTES];
+    int variant_len = build_variant_key(c, e->data, e->len, variant, sizeof(variant));
+    release_cache_element(e);
+    if (variant_len < 0) {
+        return NULL;
+    }
+#ifdef HAVE_ZLIB
+    compressed = conn_lookup_compressed(c, variant, disk);
+    if (compressed != NULL || *disk != NULL) {
+        return compressed;
+    }
+#endif
+    return cache_tier_lookup(variant, cache_hash(variant, variant_len), disk);
+}
+
+// Forward the request with the stored entry's validators so the origin
+// can answer 304; -1 if the entry has none
+static int conn_forward_conditional(connection* c, const cache_element* e) {
+    const char* head_end = memmem(e->data, e->len, "\r\n\r\n", 4);
+    if (head_end == NULL) {
+        return -1;
+    }
+    char extra[512];
+    int extra_len = 0;
+    int vlen;
+    const char* v = find_header(e->data, head_end, "ETag", &vlen);
+    if (v != NULL && vlen < 200) {
+        extra_len += sprintf(extra + extra_len, "If-None-Match: %.*s\r\n", vlen, v);
+    }
+    v = find_header(e->data, head_end, "Last-Modified", &vlen);
+    if (v != NULL && vlen < 200) {
+        extra_len += sprintf(extra + extra_len, "If-Modified-Since: %.*s\r\n", vlen, v);
+    }
+    if (extra_len == 0) {
+        return -1;
+    }
+    return build_forward_request(c, extra, extra_len);
+}
+
+// Leader has the response head: publish it if any client asking for the
+// key could be given this same response, else release the waiters
+static void conn_flight_begin(connection* c, int status, int head_len) {
+    const char* head = c->relay->data;
+    const char* head_end = head + head_len;
+    int vlen;
+    cache_freshness fresh;
+    if (status == 304 && c->revalidate_sent) {
+        return;  // Waiters are released once the entry has been refreshed
+    }
+    int shareable = status_cacheable(status) &&
+                    response_freshness(head, head_end, NULL, NULL, time(NULL), &fresh) == 0 &&
+                    find_header(head, head_end, "Vary", &vlen) == NULL &&
+                    (c->framing != BODY_LENGTH || head_len + c->body_remaining <= COALESCE_MAX_BYTES);
+    if (shareable) {
+        c->flight->keep_alive = c->framing != BODY_UNTIL_CLOSE && response_keeps_alive(head, head_len);
+    }
+    if (!shareable || c->fill == NULL || flight_publish(c->flight, c->fill, head_len) < 0) {
+        conn_leave_flight(c);
+    }
+}
+
+// Waiter: send what the leader has published, parking while caught up. An
+// abandoned flight sends us to fetch alone, unless part of it went out
+static void conn_follow_flight(connection* c) {
+    flight* f = c->flight;
+    while (1) {
+        // State first: once DONE is seen, published is final
+        flight_state state = atomic_load(&f->state);
+        int published = atomic_load_explicit(&f->published, memory_order_acquire);
+
+        if (c->out_sent < published) {
+            // Everything published so far in one call, straight from the
+            // leader's buffers
+            struct iovec iov[COALESCE_MAX_BYTES / IO_BUF_SIZE];
+            int count = 0;
+            for (int at = c->out_sent; at < published; count++) {
+                int offset = at % IO_BUF_SIZE;
+                int len = published - at;
+                if (len > IO_BUF_SIZE - offset) {
+                    len = IO_BUF_SIZE - offset;
+                }
+                iov[count].iov_base = f->blocks[at / IO_BUF_SIZE]->data + offset;
+                iov[count].iov_len = len;
+                at += len;
+            }
+            struct msghdr msg = {.msg_iov = iov, .msg_iovlen = count};
+            ssize_t n = sendmsg(c->client.fd, &msg, MSG_NOSIGNAL);
+            if (n > 0) {
+                c->out_sent += n;
+                stat_add(STAT_BYTES_ORIGIN, n);
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            conn_close(c);
+            return;
+        }
+
+        if (state == FLIGHT_DONE) {
+            c->keep_alive = c->keep_alive && f->keep_alive;
+            conn_next_request(c);
+            return;
+        }
+        if (state == FLIGHT_ABANDONED) {
+            if (c->out_sent > 0) {
+                conn_close(c);  // The client has part of a response that won't finish
+                return;
+            }
+            conn_leave_flight(c);
+            c->flight_skip = 1;
+            conn_start_request(c);
+            return;
+        }
+        if (!c->parked) {
+            conn_park(c);
+        }
+        return;
+    }
+}
+
+static void conn_fill_drop(connection* c) {
+    io_chain_release(c->fill);
+    c->fill = c->fill_tail = NULL;
+    c->fill_store = 0;
+}
+
+// Capture the response into a chain of pooled buffers while the cache may
+// store it or coalesced clients are reading it. Returns the buffer the
+// bytes start in, NULL once neither needs them
+static io_buf* conn_fill_append(connection* c, const char* data, int len) {
+    if (c->fill == NULL) {
+        return NULL;
+    }
+    if (c->fill_len + len > cache_max_object) {
+        c->fill_store = 0;
+    }
+    if (!c->fill_store && !c->flight_leader) {
+        conn_fill_drop(c);
+        return NULL;
+    }
+    io_buf* start = c->fill_tail->len < IO_BUF_SIZE ? c->fill_tail : NULL;
+    c->fill_len += len;
+    while (len > 0) {
+        io_buf* b = c->fill_tail;
+        if (b->len == IO_BUF_SIZE) {
+            if ((b->next = io_buf_get()) == NULL) {
+                conn_fill_drop(c);
+                return NULL;
+            }
+            b = c->fill_tail = b->next;
+        }
+        if (start == NULL) {
+            start = b;
+        }
+        int take = len < IO_BUF_SIZE - b->len ? len : IO_BUF_SIZE - b->len;
+        memcpy(b->data + b->len, data, take);
+        b->len += take;
+        data += take;
+        len -= take;
+    }
+    return start;
+}
+
+// Account for len body bytes at the end of the relay buffer; trims any
+// bytes past the end of the body so they are never sent or cached
+static void conn_consume_body(connection* c, int len) {
+    char* p = c->relay->data + c->relay_end;
+    int used = len;
+    switch (c->framing) {
+        case BODY_NONE:
+            used = 0;
+            break;
+        case BODY_LENGTH:
+            if (used > c->body_remaining) {
+                used = c->body_remaining;
+            }
+            c->body_remaining -= used;
+            c->body_done = c->body_remaining == 0;
+            break;
+        case BODY_CHUNKED:
+            used = chunk_scan(&c->chunks, p, len);
+            c->body_done = c->chunks.phase == CHUNK_DONE;
+            break;
+        case BODY_UNTIL_CLOSE:
+            break;
+    }
+    if (used < len) {
+        c->upstream_keep_alive = 0;  // Origin sent more than one response
+    }
+    io_buf* at = conn_fill_append(c, p, used);
+    if (c->flight_leader && used > 0 && (at == NULL || flight_publish(c->flight, at, used) < 0)) {
+        conn_leave_flight(c);
+    }
+    c->relay_end += used;
+    if (c->framing == BODY_CHUNKED && c->chunks.phase == CHUNK_ERROR) {
+        // Misframed: cut the client off and never reuse the origin socket
+        int port;
+        log_error("Malformed chunked response from %s\n", conn_origin(c, &port));
+        c->keep_alive = 0;
+        c->upstream_keep_alive = 0;
+        c->backend_failed = 1;
+        conn_fill_drop(c);
+        conn_leave_flight(c);
+        c->body_done = 1;
+    }
+}
+
+// Headers are in the relay buffer: work out framing and reuse of both sides
+static int conn_begin_relay(connection* c, int head_len) {
+    const char* head = c->relay->data;
+    const char* head_end = head + head_len;
+    if (head_len < 12 || strncmp(head, "HTTP/1.", 7) != 0) {
+        return -1;
+    }
+    int status = atoi(head + 9);
+    c->backend_failed = status >= 500;
+
+    int vlen;
+    const char* te = find_header(head, head_end, "Transfer-Encoding", &vlen);
+    int chunked = te != NULL && header_has_token(te, vlen, "chunked");
+    const char* cl = find_header(head, head_end, "Content-Length", &vlen);
+
+    memset(&c->chunks, 0, sizeof(c->chunks));
+    c->body_done = 0;
+    if (request_method_is(c, "HEAD") || status == 204 || status == 304 ||
+            (status >= 100 && status < 200)) {
+        c->framing = BODY_NONE;
+        c->body_done = 1;
+    } else if (chunked) {
+        c->framing = BODY_CHUNKED;
+    } else if (cl != NULL) {
+        c->framing = BODY_LENGTH;
+        c->body_remaining = atoll(cl);
+        c->body_done = c->body_remaining == 0;
+    } else {
+        c->framing = BODY_UNTIL_CLOSE;
+    }
+
+    c->upstream_keep_alive = c->framing != BODY_UNTIL_CLOSE &&
+                             strncmp(head, "HTTP/1.1 ", 9) == 0 &&
+                             response_keeps_alive(head, head_len);
+    // The client can only keep going if it can tell where this ends
+    c->keep_alive = c->keep_alive && c->framing != BODY_UNTIL_CLOSE &&
+                    response_keeps_alive(head, head_len);
+
+    c->fill_len = 0;
+    c->fill_store = c->cache_store &&
+                    (c->framing != BODY_LENGTH || head_len + c->body_remaining <= cache_max_object);
+    if ((c->fill_store || c->flight_leader) && (c->fill = c->fill_tail = io_buf_get()) != NULL) {
+        conn_fill_append(c, head, head_len);
+    }
+    if (c->flight_leader) {
+        conn_flight_begin(c, status, head_len);
+    }
+    if (c->fill != NULL && !c->fill_store && !c->flight_leader) {
+        conn_fill_drop(c);
+    }
+
+    // Body bytes that arrived with the headers
+    int extra = c->relay_end - head_len;
+    c->relay_end = head_len;
+    conn_consume_body(c, extra);
+    return 0;
+}
+
+// Switch to splice once nothing needs to see the bytes: the cache copy was
+// abandoned and the framing can be followed by counting alone
+static int conn_try_splice(connection* c) {
+    if (!splice_enabled || c->fill != NULL || c->flight != NULL || c->body_done ||
+            (c->framing != BODY_LENGTH && c->framing != BODY_UNTIL_CLOSE) ||
+            (c->framing == BODY_LENGTH && c->body_remaining < SPLICE_MIN_BYTES)) {
+        return 0;
+    }
+    event_loop* loop = c->loop;
+    if (loop->spare_pipe_count > 0) {
+        loop->spare_pipe_count--;
+        c->pipe_fds[0] = loop->spare_pipes[loop->spare_pipe_count][0];
+        c->pipe_fds[1] = loop->spare_pipes[loop->spare_pipe_count][1];
+    } else if (pipe2(c->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        c->pipe_fds[0] = c->pipe_fds[1] = -1;
+        return 0;
+    }
+    c->pipe_len = 0;
+    return 1;
+}
+
+// Hand an empty pipe back to the loop for the next splice relay
+static void conn_release_pipe(connection* c) {
+    event_loop* loop = c->loop;
+    if (c->pipe_len == 0 && loop->spare_pipe_count < SPLICE_SPARE_PIPES) {
+        loop->spare_pipes[loop->spare_pipe_count][0] = c->pipe_fds[0];
+        loop->spare_pipes[loop->spare_pipe_count][1] = c->pipe_fds[1];
+        loop->spare_pipe_count++;
+    } else {
+        close(c->pipe_fds[0]);
+        close(c->pipe_fds[1]);
+    }
+    c->pipe_fds[0] = c->pipe_fds[1] = -1;
+}
+
+// Origin closed or failed mid-body: the natural end for BODY_UNTIL_CLOSE,
+// a truncated response otherwise
+static void conn_upstream_ended(connection* c) {
+    if (c->framing != BODY_UNTIL_CLOSE) {
+        c->keep_alive = 0;
+        conn_fill_drop(c);
+        conn_leave_flight(c);
+    }
+    c->body_done = 1;
+    c->upstream_keep_alive = 0;
+}
+
+// Pool the origin socket if the response ended cleanly, else close it
+static void conn_release_upstream(connection* c) {
+    if (c->pipe_fds[0] >= 0) {
+        conn_release_pipe(c);
+    }
+    if (c->upstream.fd >= 0) {
+        loop_unwatch(c->loop, &c->upstream, 0);
+        if (c->upstream_keep_alive && c->body_done) {
+            int port;
+            const char* host = conn_origin(c, &port);
+            pool_release(host, port, c->upstream.fd);
+        } else {
+            close(c->upstream.fd);
+        }
+        c->upstream.fd = -1;
+    }
+    conn_fetch_done(c, c->backend_failed ? -1 : 1);
+}
+
+// Drop the fetch in progress and answer with the stale entry instead;
+// 0 if there is none or stale-if-error no longer covers it
+int conn_serve_stale(connection* c) {
+    cache_element* stale = c->stale;
+    if (stale == NULL || time(NULL) >= atomic_load(&stale->stale_error)) {
+        return 0;
+    }
+    c->stale = NULL;
+    log_info("Origin failed - serving stale from cache\n");
+
+    c->upstream_keep_alive = 0;
+    conn_release_upstream(c);
+    conn_fill_drop(c);
+    conn_leave_flight(c);
+    c->relay_start = c->relay_end = 0;
+    conn_serve_cached(c, stale);
+    return 1;
+}
+
+// Response headers arrived while holding a stale entry. A 304 to our
+// validators renews it and the client gets the stored copy, a server
+// error falls back on it, anything else replaces it through the relay
+static void conn_finish_revalidation(connection* c, int head_len) {
+    int status = atoi(c->relay->data + 9);
+    if (status >= 500 && status <= 504 && status != 501 && conn_serve_stale(c)) {
+        return;
+    }
+    cache_element* stale = c->stale;
+    c->stale = NULL;
+    if (status != 304 || !c->revalidate_sent) {
+        release_cache_element(stale);
+        return;
+    }
+
+    renew_cache_element(stale, c->relay->data, head_len);
+#ifdef HAVE_ZLIB
+    compress_renew(stale->url, c->relay->data, head_len);
+#endif
+    log_info("Cache revalidated - serving from cache\n");
+    conn_leave_flight(c);  // Waiters now find the refreshed entry
+
+    conn_release_upstream(c);
+    conn_fill_drop(c);
+    c->relay_start = c->relay_end = 0;
+    conn_serve_cached(c, stale);
+}
+
+// Send a large disk tier hit straight from the file
+static void conn_serve_file(connection* c, disk_entry* d) {
+    c->disk = d;
+    c->file_offset = d->data_offset;
+    c->file_remaining = d->data_len;
+    c->keep_alive = c->keep_alive && d->reusable;
+    c->state = CONN_SEND_FILE;
+}
+
+// Serve-stale hit: hand the entry to a refresh thread, at most one at a time
+static void conn_refresh_in_background(connection* c, cache_element* e) {
+    if (atomic_exchange(&e->refreshing, 1)) {
+        return;
+    }
+    refresh_job* job = malloc(sizeof(refresh_job));
+    if (job != NULL && ((conn_forward_conditional(c, e) < 0 && build_forward_request(c, NULL, 0) < 0) ||
+                        c->forward_len > (int)sizeof(job->request))) {
+        free(job);
+        job = NULL;
+    }
+    if (job == NULL) {
+        atomic_store(&e->refreshing, 0);
+        return;
+    }
+    atomic_fetch_add(&e->refcount, 1);
+    job->entry = e;
+    upstream_backend* b = upstream_count > 0 ? upstream_pick(NULL) : NULL;
+    if (b != NULL) {
+        atomic_fetch_add(&b->outstanding, 1);
+    }
+    job->backend = b;
+    snprintf(job->host, sizeof(job->host), "%s", b != NULL ? b->host : c->host);
+    job->port = b != NULL ? b->port : c->port;
+    memcpy(job->request, c->forward, c->forward_len);
+    job->request_len = c->forward_len;
+    if (refresh_submit(job) < 0) {
+        if (b != NULL) {
+            upstream_done(b, 0);
+        }
+        atomic_store(&e->refreshing, 0);
+        release_cache_element(e);
+        free(job);
+    }
+}
+
+// Body fully relayed: pool or close the origin socket and cache the copy
+static void conn_finish_relay(connection* c) {
+    conn_release_upstream(c);
+
+    // Cache the response
+    if (c->fill != NULL && c->fill_store && c->body_done) {
+        conn_store_response(c, c->fill, c->fill_len);
+    }
+    // Stored first, so no miss slips in between the flight and the entry
+    if (c->flight_leader && c->body_done) {
+        flight_finish(c->flight, FLIGHT_DONE);
+    }
+    conn_fill_drop(c);
+
+    c->relay_start = c->relay_end = 0;
+    conn_next_request(c);
+}
+
+// Zero-copy variant of conn_relay: origin -> pipe -> client with splice(),
+// the body never enters user space. The pipe's capacity bounds how far the
+// origin can run ahead of the client
+static void conn_relay_splice(connection* c) {
+    while (1) {
+        int progressed = 0;
+
+        if (c->pipe_len > 0) {
+            // Hint more is coming unless this is the tail of the body
+            unsigned flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (c->body_done ? 0 : SPLICE_F_MORE);
+            ssize_t n = splice(c->pipe_fds[0], NULL, c->client.fd, NULL, c->pipe_len, flags);
+            if (n > 0) {
+                c->pipe_len -= n;
+                stat_add(STAT_BYTES_ORIGIN, n);
+                progressed = 1;
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                conn_close(c);
+                return;
+            }
+        }
+        if (c->pipe_len == 0 && c->body_done) {
+            conn_finish_relay(c);
+            return;
+        }
+
+        if (!c->body_done) {
+            size_t want = 1 << 20;
+            if (c->framing == BODY_LENGTH && (int64_t)want > c->body_remaining) {
+                want = c->body_remaining;
+            }
+            ssize_t n = splice(c->upstream.fd, NULL, c->pipe_fds[1], NULL, want,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                c->pipe_len += n;
+                if (c->framing == BODY_LENGTH) {
+                    c->body_remaining -= n;
+                    c->body_done = c->body_remaining == 0;
+                }
+                progressed = 1;
+            } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                // EAGAIN covers both an empty socket and a full pipe; the
+                // client draining the pipe or new origin data wakes us
+                conn_upstream_ended(c);
+                progressed = 1;
+            }
+        }
+
+        if (!progressed) {
+            return;
+        }
+    }
+}
+
+// Move bytes origin -> buffer -> client until both sides would block.
+// Reading stops while the buffer is full, so a slow client throttles the
+// origin instead of growing memory
+static void conn_relay(connection* c) {
+    if (c->pipe_fds[0] >= 0) {
+        conn_relay_splice(c);
+        return;
+    }
+    while (c->state == CONN_RELAY_RESPONSE) {
+        int progressed = 0;
+
+        if (c->relay_start < c->relay_end) {
+            ssize_t n = send(c->client.fd, c->relay->data + c->relay_start,
+                             c->relay_end - c->relay_start, MSG_NOSIGNAL);
+            if (n > 0) {
+                c->relay_start += n;
+                stat_add(STAT_BYTES_ORIGIN, n);
+                progressed = 1;
+            } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                conn_close(c);
+                return;
+            }
+        }
+        if (c->relay_start == c->relay_end) {
+            c->relay_start = c->relay_end = 0;
+            if (c->body_done) {
+                conn_finish_relay(c);
+                return;
+            }
+            if (conn_try_splice(c)) {
+                conn_relay_splice(c);
+                return;
+            }
+        }
+
+        if (!c->body_done && c->relay_end < IO_BUF_SIZE) {
+            ssize_t n = recv(c->upstream.fd, c->relay->data + c->relay_end,
+                             IO_BUF_SIZE - c->relay_end, 0);
+            if (n > 0) {
+                conn_consume_body(c, n);
+                progressed = 1;
+            } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                conn_upstream_ended(c);
+                progressed = 1;
+            }
+        }
+
+        if (!progressed) {
+            return;
+        }
+    }
+}
+
+// Serve from cache, or start the upstream fetch on a miss
+void conn_start_request(connection* c) {
+    if (c->parser.error || build_cache_key(c) < 0) {
+        send_error_response(c, 400);
+        return;
+    }
+    if (c->parser.reject != 0) {
+        send_error_response(c, c->parser.reject);
+        return;
+    }
+
+    request_cache_policy(c);
+    conn_drop_peer(c);
+
+    // Check cache first; fresh entries are served as they are
+    disk_entry* disk = NULL;
+    cache_element* cached = c->cache_use ? conn_lookup_cache(c, &disk) : NULL;
+    time_t now = time(NULL);
+    c->trace[TRACE_LOOKUP] = now_us();
+    if (disk != NULL && !c->cache_revalidate && now < disk->fresh.expires) {
+        log_info("Cache hit - serving from disk\n");
+        stat_add(STAT_DISK_HIT, 1);
+        conn_serve_file(c, disk);
+        return;
+    }
+    disk_release(disk);  // Stale large records are simply fetched again
+    if (cached != NULL && !c->cache_revalidate && now < atomic_load(&cached->expires)) {
+        log_info("Cache hit - serving from cache\n");
+        stat_add(STAT_HIT, 1);
+        conn_serve_cached(c, cached);
+        return;
+    }
+    if (cached != NULL && !c->cache_revalidate && c->cache_store &&
+            now < atomic_load(&cached->stale_revalidate)) {
+        log_info("Cache stale - serving while revalidating\n");
+        stat_add(STAT_STALE, 1);
+        conn_refresh_in_background(c, cached);
+        conn_serve_cached(c, cached);
+        return;
+    }
+
+    // Another client is already fetching this key: follow its response
+    if (c->cache_store && !c->flight_skip) {
+        int leader = 0;
+        c->flight = flight_join(c->key, c->key_hash, c->loop->waker, &leader);
+        if (c->flight != NULL && !leader) {
+            log_info("Cache miss - following in-flight fetch\n");
+            stat_add(STAT_COALESCED, 1);
+            release_cache_element(cached);
+            c->out_sent = 0;
+            c->state = CONN_FOLLOW_FLIGHT;
+            return;
+        }
+        c->flight_leader = c->flight != NULL;
+    }
+
+    // The endpoint is chosen first, as the limit is its own: past it the
+    // miss fails fast, stale-if-error allowing a stored copy instead, and
+    // waiters on its flight fetch for themselves
+    c->backend_tries = 0;
+    c->peer = peer_owner(c, &c->peer_ring);
+    conn_pick_backend(c, NULL);
+    int port;
+    const char* host = conn_origin(c, &port);
+    miss_limiter* limiter = limiter_for(host, port);
+    if (limiter_acquire(limiter, 1) < 0) {
+        log_info("%s:%d at its concurrency limit - shedding miss\n", host, port);
+        stat_add(STAT_SHED, 1);
+        conn_backend_done(c, 0);
+        conn_drop_peer(c);
+        conn_leave_flight(c);
+        c->stale = cached;
+        if (!conn_serve_stale(c)) {
+            send_error_response(c, 503);
+        }
+        return;
+    }
+    c->limiter = limiter;
+
+    // Stale entries are revalidated where possible and kept as the
+    // stale-if-error fallback, everything else is a plain fetch
+    c->revalidate_sent = cached != NULL && conn_forward_conditional(c, cached) == 0;
+    stat_add(c->revalidate_sent ? STAT_REVALIDATE : c->peer != NULL ? STAT_PEER : STAT_MISS, 1);
+    if (c->revalidate_sent) {
+        log_info("Cache stale - revalidating with origin\n");
+    } else if (build_forward_request(c, NULL, 0) < 0) {
+        release_cache_element(cached);
+        send_error_response(c, 400);
+        return;
+    }
+    c->stale = cached;
+    conn_connect_upstream(c, 1);
+}
+
+// Advance the connection as far as it can go without blocking
+void conn_drive(connection* c) {
+    while (1) {
+        ssize_t n;
+        switch (c->state) {
+            case CONN_READ_REQUEST: {
+                int done = conn_read_request(c);
+                if (done < 0) {
+                    conn_close(c);
+                    return;
+                }
+                if (done == 0) {
+                    return;
+                }
+                idle_unlink(c);
+                c->started_us = now_us();
+                c->trace[TRACE_PARSE] = c->started_us;
+                conn_start_request(c);
+                break;
+            }
+
+            case CONN_RESOLVING:
+                conn_resolve(c);
+                if (c->state == CONN_RESOLVING) {
+                    return;
+                }
+                break;
+
+            case CONN_CONNECTING:
+                // Woken by loop_dispatch once the socket becomes writable
+                return;
+
+            case CONN_SEND_REQUEST:
+                // Forward request
+                if (c->request_sent == 0) {
+                    c->upstream_us = now_us();
+                }
+                n = send(c->upstream.fd, c->forward + c->request_sent,
+                         c->forward_len - c->request_sent, MSG_NOSIGNAL);
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return;
+                    }
+                    if (errno == EINTR) {
+                        break;
+                    }
+                    if (!conn_retry_stale(c)) {
+                        send_error_response(c, 502);
+                    }
+                    break;
+                }
+                c->request_sent += n;
+                if (c->request_sent == c->forward_len) {
+                    c->state = CONN_READ_RESPONSE;
+                }
+                break;
+
+            case CONN_READ_RESPONSE: {
+                if (c->relay == NULL && (c->relay = io_buf_get()) == NULL) {
+                    send_error_response(c, 502);
+                    break;
+                }
+                n = recv(c->upstream.fd, c->relay->data + c->relay_end,
+                         IO_BUF_SIZE - c->relay_end, 0);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    return;
+                }
+                if (n < 0 && errno == EINTR) {
+                    break;
+                }
+                if (n <= 0) {
+                    // Nothing received yet on a pooled socket: it went stale
+                    if (c->relay_end > 0 || !conn_retry_stale(c)) {
+                        send_error_response(c, 502);
+                    }
+                    c->relay_end = 0;
+                    break;
+                }
+                if (c->relay_end == 0) {
+                    c->trace[TRACE_TTFB] = now_us();
+                    stat_latency(HIST_TTFB, c->trace[TRACE_TTFB] - c->upstream_us);
+                }
+                c->relay_end += n;
+
+                char* head_end = memmem(c->relay->data, c->relay_end, "\r\n\r\n", 4);
+                if (head_end == NULL) {
+                    if (c->relay_end == IO_BUF_SIZE) {
+                        // Headers larger than the relay buffer
+                        c->relay_end = 0;
+                        send_error_response(c, 502);
+                    }
+                    break;
+                }
+                if (conn_begin_relay(c, head_end + 4 - c->relay->data) < 0) {
+                    c->relay_end = 0;
+                    send_error_response(c, 502);
+                    break;
+                }
+                c->relay_start = 0;
+                c->state = CONN_RELAY_RESPONSE;
+                if (c->stale != NULL) {
+                    conn_finish_revalidation(c, head_end + 4 - c->relay->data);
+                }
+                break;
+            }
+
+            case CONN_RELAY_RESPONSE:
+                conn_relay(c);
+                if (c->state == CONN_RELAY_RESPONSE) {
+                    return;
+                }
+                break;
+
+            case CONN_FOLLOW_FLIGHT:
+                conn_follow_flight(c);
+                if (c->state == CONN_FOLLOW_FLIGHT) {
+                    return;
+                }
+                break;
+
+            case CONN_SEND_FILE:
+                n = sendfile(c->client.fd, disk_fd, &c->file_offset, c->file_remaining);
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return;
+                    }
+                    if (errno == EINTR) {
+                        break;
+                    }
+                    conn_close(c);
+                    return;
+                }
+                c->file_remaining -= n;
+                stat_add(STAT_BYTES_CACHE, n);
+                if (n == 0 || c->file_remaining == 0) {
+                    if (c->file_remaining > 0) {
+                        conn_close(c);  // File shorter than the index says
+                        return;
+                    }
+                    conn_next_request(c);
+                }
+                break;
+
+            case CONN_SEND_RESPONSE:
+                n = send(c->client.fd, c->out + c->out_sent,
+                         c->out_len - c->out_sent, MSG_NOSIGNAL);
+                if (n < 0) {
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        return;
+                    }
+                    if (errno == EINTR) {
+                        break;
+                    }
+                    conn_close(c);
+                    return;
+                }
+                c->out_sent += n;
+                if (c->cached != NULL) {
+                    stat_add(STAT_BYTES_CACHE, n);
+                }
+                if (c->out_sent == c->out_len) {
+                    conn_next_request(c);
+                }
+                break;
+
+            case CONN_CLOSED:
+                return;
+        }
+    }
+}
+
+// SIGTERM and SIGINT: only async-signal-safe calls here
+static void handle_shutdown(int sig) {
+    (void)sig;
+    atomic_store(&shutdown_requested, 1);
+    for (long i = 0; i < running_loop_count; i++) {
+        waker_signal(running_loops[i]->waker);
+    }
+    for (long i = 0; i < worker_count; i++) {
+        sem_post(&workers[i].wake);
+    }
+    if (listen_socket >= 0) {
+        shutdown(listen_socket, SHUT_RD);  // Fails the blocked accept()
+    }
+    sem_post(&shutdown_sem);
+}
+
+// SIGHUP: main rereads the configuration once it is woken
+static void handle_reload(int sig) {
+    (void)sig;
+    atomic_store(&reload_requested, 1);
+    sem_post(&shutdown_sem);
+}
+
+// Bound, listening IPv4 socket for port; exits on failure. With reuse_port
+// each event loop binds its own and the kernel spreads connections over them
+static int open_listener(int port, int reuse_port) {
+    // Create server socket
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_socket < 0) {
+        perror("Failed to create socket");
+        exit(EXIT_FAILURE);
+    }
+
+    // Enable socket address reuse
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT,
+                                 &reuse, sizeof(reuse)) < 0) {
+        perror("SO_REUSEPORT failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Configure server address
+    struct sockaddr_in server_addr = {0};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr.s_addr = INADDR_ANY;
+
+    // Bind socket to address
+    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        perror("Binding failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Listen for connections
+    if (listen(server_socket, listen_backlog) < 0) {
+        perror("Listen failed");
+        exit(EXIT_FAILURE);
+    }
+    return server_socket;
+}
+
+// Configuration: a file of the long options, one per line, read first and
+// then overridden by the command line. SIGHUP rereads both and applies the
+// tunables to the running server, keeping its connections and cache
+
+static const struct option long_options[] = {
+    {"config", required_argument, NULL, 'c'},
+    {"mode", required_argument, NULL, 'm'},
+    {"loops", required_argument, NULL, 't'},
+    {"cache-size", required_argument, NULL, 's'},
+    {"max-object-size", required_argument, NULL, 'o'},
+    {"pool-max-idle", required_argument, NULL, 'P'},
+    {"pool-idle-timeout", required_argument, NULL, 'I'},
+    {"dns-ttl", required_argument, NULL, 'D'},
+    {"dns-negative-ttl", required_argument, NULL, 'N'},
+    {"keepalive-timeout", required_argument, NULL, 'K'},
+    {"keepalive-requests", required_argument, NULL, 'R'},
+    {"no-splice", no_argument, NULL, 'S'},
+    {"stale-while-revalidate", required_argument, NULL, 'W'},
+    {"stale-if-error", required_argument, NULL, 'E'},
+    {"disk-cache", required_argument, NULL, 'F'},
+    {"disk-cache-size", required_argument, NULL, 'Z'},
+    {"snapshot", required_argument, NULL, 'C'},
+    {"drain-timeout", required_argument, NULL, 'T'},
+    {"backlog", required_argument, NULL, 'B'},
+    {"no-reuseport", no_argument, NULL, 'U'},
+    {"pin-cpus", no_argument, NULL, 'A'},
+    {"numa", no_argument, NULL, 'M'},
+    {"workers", required_argument, NULL, 'w'},
+    {"admin-port", required_argument, NULL, 'a'},
+    {"eviction", required_argument, NULL, 'e'},
+    {"upstream", required_argument, NULL, 'u'},
+    {"balance", required_argument, NULL, 'b'},
+    {"health-check", required_argument, NULL, 'H'},
+    {"health-interval", required_argument, NULL, 'i'},
+    {"compress", no_argument, NULL, 'z'},
+    {"peer", required_argument, NULL, 'p'},
+    {"peer-self", required_argument, NULL, 'n'},
+    {"slow-request-ms", required_argument, NULL, 'L'},
+    {"miss-limit", required_argument, NULL, 'l'},
+    {NULL, 0, NULL, 0}
+};
+
+// Each reload starts again from these defaults, so a setting taken out of
+// the file stops applying
+static const tunable tunables[] = {
+    {&cache_size_mb, CACHE_SIZE},
+    {&ram_max_object, MAX_ELEMENT_SIZE},
+    {&pool_max_idle, POOL_MAX_IDLE},
+    {&pool_idle_timeout, POOL_IDLE_TIMEOUT},
+    {&dns_ttl, DNS_TTL},
+    {&dns_negative_ttl, DNS_NEGATIVE_TTL},
+    {&keepalive_timeout, KEEPALIVE_TIMEOUT},
+    {&keepalive_max_requests, KEEPALIVE_MAX_REQUESTS},
+    {&splice_enabled, 1},
+    {&stale_while_revalidate, 0},
+    {&stale_if_error, 0},
+    {&drain_timeout, DRAIN_TIMEOUT},
+    {&listen_backlog, LISTEN_BACKLOG},
+    {&upstream_balance, BALANCE_P2C},
+    {&health_interval, HEALTH_INTERVAL},
+    {&compress_enabled, 0},
+    {&slow_request_ms, SLOW_REQUEST_MS},
+    {&miss_limit_max, 0}
+};
+
+#define TUNABLE_COUNT (sizeof(tunables) / sizeof(tunables[0]))
+
+_Static_assert(TUNABLE_COUNT <= TUNABLE_MAX, "startup_config has no room for the tunables");
+
+static void startup_defaults(startup_config* s) {
+    memset(s, 0, sizeof(*s));
+    for (size_t i = 0; i < TUNABLE_COUNT; i++) {
+        s->values[i] = tunables[i].fallback;
+    }
+    s->mode = RUNTIME_EPOLL;
+    s->disk_mb = DISK_CACHE_SIZE;
+    s->num_loops = sysconf(_SC_NPROCESSORS_ONLN);
+    s->num_workers = WORKER_THREADS;
+    s->reuse_port = 1;
+}
+
+// s's parsed value for the tunable live
+static int* config_value(startup_config* s, const atomic_int* live) {
+    size_t i = 0;
+    while (tunables[i].value != live) {
+        i++;
+    }
+    return &s->values[i];
+}
+
+// Publish s's tunables to the running server
+static void config_apply(const startup_config* s) {
+    for (size_t i = 0; i < TUNABLE_COUNT; i++) {
+        atomic_store_explicit(tunables[i].value, s->values[i], memory_order_relaxed);
+    }
+    if (disk_fd < 0) {
+        // disk_init() raises it for its tier
+        atomic_store_explicit(&cache_max_object, ram_max_object, memory_order_relaxed);
+    }
+}
+
+// Apply one parsed option to s; -1 rejects it
+static int config_option(int opt, const char* arg, startup_config* s) {
+    switch (opt) {
+        case 'c':
+            s->config_path = arg;
+            break;
+        case 'm':
+            if (strcmp(arg, "epoll") == 0) {
+                s->mode = RUNTIME_EPOLL;
+            } else if (strcmp(arg, "io_uring") == 0) {
+                s->mode = RUNTIME_URING;
+            } else if (strcmp(arg, "threads") == 0) {
+                s->mode = RUNTIME_THREADS;
+            } else {
+                printf("Unknown mode '%s'. Use epoll, io_uring or threads\n", arg);
+                return -1;
+            }
+            break;
+        case 't':
+            s->num_loops = atol(arg);
+            break;
+        case 's':
+            *config_value(s, &cache_size_mb) = atoi(arg);
+            break;
+        case 'o':
+            *config_value(s, &ram_max_object) = atoi(arg);
+            break;
+        case 'P':
+            *config_value(s, &pool_max_idle) = atoi(arg);
+            break;
+        case 'I':
+            *config_value(s, &pool_idle_timeout) = atoi(arg);
+            break;
+        case 'D':
+            *config_value(s, &dns_ttl) = atoi(arg);
+            break;
+        case 'N':
+            *config_value(s, &dns_negative_ttl) = atoi(arg);
+            break;
+        case 'K':
+            *config_value(s, &keepalive_timeout) = atoi(arg);
+            break;
+        case 'R':
+            *config_value(s, &keepalive_max_requests) = atoi(arg);
+            break;
+        case 'S':
+            *config_value(s, &splice_enabled) = 0;
+            break;
+        case 'W':
+            *config_value(s, &stale_while_revalidate) = atoi(arg);
+            break;
+        case 'E':
+            *config_value(s, &stale_if_error) = atoi(arg);
+            break;
+        case 'F':
+            s->disk_path = arg;
+            break;
+        case 'Z':
+            s->disk_mb = atol(arg);
+            break;
+        case 'C':
+            s->snapshot_path = arg;
+            break;
+        case 'T':
+            *config_value(s, &drain_timeout) = atoi(arg);
+            break;
+        case 'B':
+            *config_value(s, &listen_backlog) = atoi(arg);
+            break;
+        case 'U':
+            s->reuse_port = 0;
+            break;
+        case 'A':
+            s->pin_cpus = 1;
+            break;
+        case 'M':
+            s->pin_cpus = 1;
+            s->numa = 1;
+            break;
+        case 'w':
+            s->num_workers = atol(arg);
+            break;
+        case 'a':
+            s->admin_port = atoi(arg);
+            break;
+        case 'e':
+            s->eviction = arg;
+            break;
+        case 'u':
+            if (s->upstream_count == UPSTREAM_MAX) {
+                printf("At most %d upstreams\n", UPSTREAM_MAX);
+                return -1;
+            }
+            s->upstreams[s->upstream_count++] = arg;
+            break;
+        case 'b':
+            if (strcmp(arg, "p2c") == 0) {
+                *config_value(s, &upstream_balance) = BALANCE_P2C;
+            } else if (strcmp(arg, "least-outstanding") == 0) {
+                *config_value(s, &upstream_balance) = BALANCE_LEAST;
+            } else {
+                printf("Unknown balancing '%s'. Use p2c or least-outstanding\n", arg);
+                return -1;
+            }
+            break;
+        case 'H':
+            s->health_path = arg;
+            break;
+        case 'i':
+            *config_value(s, &health_interval) = atoi(arg);
+            break;
+        case 'z':
+            *config_value(s, &compress_enabled) = 1;
+            break;
+        case 'p':
+            if (s->peer_count == PEER_MAX) {
+                printf("At most %d peers\n", PEER_MAX);
+                return -1;
+            }
+            s->peers[s->peer_count++] = arg;
+            break;
+        case 'n':
+            s->peer_self = arg;
+            break;
+        case 'L':
+            *config_value(s, &slow_request_ms) = atoi(arg);
+            break;
+        case 'l':
+            *config_value(s, &miss_limit_max) = atoi(arg);
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+// Run argv's options through config_option(); returns the index of the
+// first operand, or -1 on a bad option
+static int config_parse(int argc, char** argv, startup_config* s) {
+    int opt;
+    optind = 0;  // Makes getopt start over, as each pass rescans from argv[1]
+    while ((opt = getopt_long(argc, argv, "c:m:t:", long_options, NULL)) != -1) {
+        if (config_option(opt, optarg, s) < 0) {
+            return -1;
+        }
+    }
+    return optind;
+}
+
+static void config_free(char** args) {
+    for (int i = 1; args != NULL && args[i] != NULL; i++) {
+        free(args[i]);
+    }
+    free(args);
+}
+
+// Parse a config file: "name value" or "name = value" per line, names as
+// the long options without dashes, '#' to the end of a line a comment.
+// Returns the argument vector built from it, which s's strings point into,
+// or NULL on failure
+static char** config_load(const char* path, startup_config* s) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot read config %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    char** args = calloc(CONFIG_MAX_LINES + 2, sizeof(char*));
+    int count = 0;
+    int ok = args != NULL;
+    if (ok) {
+        args[count++] = (char*)path;  // getopt names its errors after argv[0]
+    }
+    char line[MAX_BYTES];
+    while (ok && fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "#\r\n")] = '\0';
+        char* name = line + strspn(line, " \t");
+        int name_len = strcspn(name, " \t=");
+        if (name_len == 0) {
+            continue;
+        }
+        char* value = name + name_len;
+        value += strspn(value, " \t=");
+        int value_len = strlen(value);
+        while (value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+            value_len--;
+        }
+        char* arg = NULL;
+        if (count > CONFIG_MAX_LINES) {
+            fprintf(stderr, "%s: more than %d settings\n", path, CONFIG_MAX_LINES);
+        } else if (value_len > 0) {
+            if (asprintf(&arg, "--%.*s=%.*s", name_len, name, value_len, value) < 0) {
+                arg = NULL;
+            }
+        } else if (asprintf(&arg, "--%.*s", name_len, name) < 0) {
+            arg = NULL;
+        }
+        ok = arg != NULL;
+        if (ok) {
+            args[count++] = arg;
+        }
+    }
+    fclose(f);
+    if (ok && config_parse(count, args, s) != count) {
+        ok = 0;
+    }
+    if (!ok) {
+        config_free(args);
+        return NULL;
+    }
+    return args;
+}
+
+// Hold what was parsed into s to what the server can do
+static void config_check(startup_config* s) {
+    int* backlog = config_value(s, &listen_backlog);
+    int* size_mb = config_value(s, &cache_size_mb);
+    int* max_object = config_value(s, &ram_max_object);
+    if (*backlog < 1) {
+        *backlog = LISTEN_BACKLOG;
+    }
+    if (*size_mb < 1) {
+        *size_mb = 1;
+    }
+    if (*max_object < 0) {
+        *max_object = 0;
+    } else if (*max_object > MAX_ELEMENT_LIMIT) {
+        printf("The RAM tier keeps objects of up to %d bytes\n", MAX_ELEMENT_LIMIT);
+        *max_object = MAX_ELEMENT_LIMIT;
+    }
+#ifndef HAVE_ZLIB
+    int* compress = config_value(s, &compress_enabled);
+    if (*compress) {
+        printf("--compress needs a build with -DHAVE_ZLIB -lz\n");
+        *compress = 0;
+    }
+#endif
+}
+
+static int same_path(const char* a, const char* b) {
+    return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+static int startup_changed(const startup_config* a, const startup_config* b) {
+    int upstreams_changed = a->upstream_count != b->upstream_count;
+    for (int i = 0; !upstreams_changed && i < a->upstream_count; i++) {
+        upstreams_changed = !same_path(a->upstreams[i], b->upstreams[i]);
+    }
+    return upstreams_changed || !same_path(a->health_path, b->health_path) ||
+           a->mode != b->mode || a->num_loops != b->num_loops ||
+           a->num_workers != b->num_workers || a->admin_port != b->admin_port ||
+           a->disk_mb != b->disk_mb || a->reuse_port != b->reuse_port ||
+           a->pin_cpus != b->pin_cpus || a->numa != b->numa ||
+           !same_path(a->disk_path, b->disk_path) ||
+           !same_path(a->snapshot_path, b->snapshot_path) ||
+           !same_path(a->eviction, b->eviction);
+}
+
+// SIGHUP: reread the file, then the command line, from the tunables'
+// defaults and apply the result. A file that fails to parse changes nothing
+static void config_reload(const startup_config* running, int argc, char** argv) {
+    if (running->config_path == NULL) {
+        printf("SIGHUP ignored: no --config file to reload\n");
+        return;
+    }
+    // Parsed from the tunables' defaults into next, away from the live values
+    startup_config next;
+    startup_defaults(&next);
+    peer_ring* ring = NULL;
+    char** args = config_load(running->config_path, &next);
+    if (args == NULL || config_parse(argc, argv, &next) < 0 || peer_ring_build(&next, &ring) < 0) {
+        config_free(args);
+        fprintf(stderr, "Reload failed; keeping the running configuration\n");
+        return;
+    }
+    config_check(&next);
+    config_apply(&next);
+
+    // Connections pick the rest up as they next read them
+    cache_resize((size_t)cache_size_mb << 20);
+    for (long i = 0; i < running_loop_count; i++) {
+        if (running_loops[i]->listener.fd >= 0) {
+            listen(running_loops[i]->listener.fd, listen_backlog);
+        }
+    }
+    if (listen_socket >= 0) {
+        listen(listen_socket, listen_backlog);
+    }
+    // Membership changes too; connections keep the old ring until done with it
+    peer_ring_publish(ring);
+    if (startup_changed(running, &next)) {
+        printf("Mode, loop, worker, listener, pinning, disk, snapshot, admin, eviction "
+               "and upstream group settings apply at the next restart\n");
+    }
+    config_free(args);
+    printf("Configuration reloaded from %s\n", running->config_path);
+}
+
+// Main server implementation
+int main(int argc, char* argv[]) {
+    startup_config startup;
+    startup_defaults(&startup);
+
+    // The first pass only finds the file. As on reload, the file is then
+    // read from the defaults and the command line parsed over it once, so
+    // repeatable options are not added twice. The file's vector stays
+    // allocated: startup's strings point into it
+    int parsed = config_parse(argc, argv, &startup);
+    const char* config_path = startup.config_path;
+    if (parsed >= 0 && config_path != NULL) {
+        startup_defaults(&startup);
+        if (config_load(config_path, &startup) == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        parsed = config_parse(argc, argv, &startup);  // The command line wins
+    }
+
+    if (parsed < 0 || parsed != argc - 1) {
+        printf("Usage: %s [-c config_file] [-m epoll|io_uring|threads] [-t event_loops]\n"
+               "       [--cache-size MB] [--max-object-size bytes] [--pool-max-idle n]\n"
+               "       [--pool-idle-timeout seconds] [--dns-ttl seconds]\n"
+               "       [--dns-negative-ttl seconds] [--keepalive-timeout seconds]\n"
+               "       [--keepalive-requests n] [--no-splice]\n"
+               "       [--stale-while-revalidate seconds] [--stale-if-error seconds]\n"
+               "       [--disk-cache file] [--disk-cache-size MB]\n"
+               "       [--snapshot file] [--drain-timeout seconds]\n"
+               "       [--backlog n] [--no-reuseport] [--pin-cpus] [--numa]\n"
+               "       [--workers n] [--admin-port port]\n"
+               "       [--eviction lru|s3fifo|tinylfu] [--upstream host:port ...]\n"
+               "       [--balance p2c|least-outstanding] [--health-check path]\n"
+               "       [--health-interval seconds] [--compress]\n"
+               "       [--peer host:port ...] [--peer-self host:port]\n"
+               "       [--slow-request-ms ms] [--miss-limit n]\n"
+               "       <port_number>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    config_check(&startup);
+    config_apply(&startup);
+
+    int port = atoi(argv[parsed]);
+    if (port <= 0 || port > 65535) {
+        printf("Invalid port number. Use 1-65535\n");
+        exit(EXIT_FAILURE);
+    }
+    if (startup.eviction != NULL && cache_set_policy(startup.eviction) < 0) {
+        printf("Unknown eviction policy '%s'. Use lru, s3fifo or tinylfu\n", startup.eviction);
+        exit(EXIT_FAILURE);
+    }
+    runtime_mode mode = startup.mode;
+    long num_loops = startup.num_loops;
+    long num_workers = startup.num_workers;
+    reuse_port = startup.reuse_port;
+    pin_cpus = startup.pin_cpus;
+    numa_preferred = startup.numa;
+    health_path = startup.health_path;
+    for (int i = 0; i < startup.upstream_count; i++) {
+        if (upstream_add(startup.upstreams[i]) < 0) {
+            printf("Invalid upstream '%s'. Use host:port\n", startup.upstreams[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    peer_ring* ring;
+    if (peer_ring_build(&startup, &ring) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    peer_ring_publish(ring);
+    if (num_loops < 1) {
+        num_loops = 1;
+    }
+    if (num_workers < 1) {
+        num_workers = 1;
+    }
+    if (mode == RUNTIME_THREADS) {
+        num_loops = num_workers;  // Each worker drives a private loop
+    }
+    uring_enabled = mode == RUNTIME_URING;
+
+    // Writes to a vanished peer should fail with EPIPE, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // Only main handles SIGHUP, so that it can interrupt the threads-mode
+    // accept(); every thread started from here on inherits the mask
+    sigset_t reload_mask;
+    sigemptyset(&reload_mask);
+    sigaddset(&reload_mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &reload_mask, NULL);
+
+    // Initialize synchronization primitives
+    log_start();
+    canned_init();
+    cache_init();
+    if (startup.disk_path != NULL && startup.disk_mb > 0) {
+        disk_init(startup.disk_path, (off_t)startup.disk_mb << 20);
+    }
+    dns_init();
+    limiter_init();
+    refresh_init();
+#ifdef HAVE_ZLIB
+    compress_init();
+#endif
+    health_start();
+    warm_start(startup.snapshot_path);
+    sem_init(&shutdown_sem, 0, 0);
+    atomic_init(&shutdown_requested, 0);
+    atomic_init(&reload_requested, 0);
+
+    if (mode == RUNTIME_THREADS) {
+        reuse_port = 0;
+    }
+    int server_socket = open_listener(port, reuse_port);
+
+    printf("Proxy server listening on port %d...\n", port);
+    if (startup.admin_port > 0 && startup.admin_port <= 65535) {
+        stats_start(open_listener(startup.admin_port, 0));
+        printf("Metrics at http://localhost:%d/metrics, slow requests at /slow\n", startup.admin_port);
+    }
+
+    // Loops pinned in turn to the CPUs this process may run on
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE];
+    int cpu_count = 0;
+    if (pin_cpus && sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                cpus[cpu_count++] = cpu;
+            }
+        }
+    }
+
+    // Event loops each accept from their own listener, or all share one;
+    // workers' loops have none
+    event_loop** loops = calloc(num_loops, sizeof(event_loop*));
+    for (long i = 0; i < num_loops; i++) {
+        int listen_fd = -1;
+        if (mode != RUNTIME_THREADS) {
+            listen_fd = i == 0 || !reuse_port ? server_socket : open_listener(port, 1);
+            set_nonblocking(listen_fd);
+        }
+        loops[i] = loop_create(listen_fd);
+        if (loops[i] == NULL) {
+            perror("Event loop creation failed");
+            exit(EXIT_FAILURE);
+        }
+        loops[i]->owns_listener = reuse_port;
+        if (cpu_count > 0) {
+            loops[i]->cpu = cpus[i % cpu_count];
+        }
+    }
+    running_loops = loops;
+    running_loop_count = num_loops;
+    if (mode == RUNTIME_THREADS) {
+        listen_socket = server_socket;
+        worker_init(loops, num_loops);
+    }
+
+    struct sigaction sa = {0};
+    sa.sa_handler = handle_shutdown;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = handle_reload;
+    sigaction(SIGHUP, &sa, NULL);
+
+    for (long i = 0; i < num_loops; i++) {
+        void* (*run)(void*) = loop_thread;
+        void* arg = loops[i];
+        if (mode == RUNTIME_THREADS) {
+            run = worker_thread;
+            arg = &workers[i];
+        }
+        if (pthread_create(&loops[i]->thread, NULL, run, arg) != 0) {
+            perror("Event loop creation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_UNBLOCK, &reload_mask, NULL);
+    while (mode != RUNTIME_THREADS && !atomic_load(&shutdown_requested)) {
+        if (sem_wait(&shutdown_sem) == 0 && atomic_exchange(&reload_requested, 0)) {
+            config_reload(&startup, argc, argv);
+        }
+    }
+
+    // Threads mode: accept here and queue each socket for a worker. SIGHUP
+    // fails the accept() with EINTR and is handled on the way round
+    while (mode == RUNTIME_THREADS && !atomic_load(&shutdown_requested)) {
+        if (atomic_exchange(&reload_requested, 0)) {
+            config_reload(&startup, argc, argv);
+            continue;
+        }
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        // Accept new connection
+        int client_socket = accept4(server_socket, (struct sockaddr*)&client_addr,
+                                    &client_len, SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (!atomic_load(&shutdown_requested) && errno != EINTR) {
+                log_error("Accept failed: %s\n", strerror(errno));
+            }
+            continue;
+        }
+
+        // Log connection
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+        log_info("New connection from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
+
+        worker_dispatch(client_socket);
+    }
+
+    // Drain: loops stop accepting and exit once their connections finish;
+    // workers also serve what is already queued. Whatever is still open at
+    // the deadline is cut off at exit
+    printf("Shutting down: draining connections for up to %d seconds\n", drain_timeout);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += drain_timeout;
+    for (long i = 0; i < num_loops; i++) {
+        if (pthread_timedjoin_np(loops[i]->thread, NULL, &deadline) == 0) {
+            loop_destroy(loops[i]);
+        }
+    }
+
+    if (startup.snapshot_path != NULL) {
+        snapshot_save(startup.snapshot_path);
+    }
+    if (!reuse_port) {
+        close(server_socket);  // Otherwise loop 0 owned it
+    }
+    log_flush();
+    return 0;
+}
+
+// Threads-mode worker pool. Each worker drives its own loop with one
+// connection at a time; sockets wait in per-worker queues, so no thread is
+// created on the accept path and a busy worker's backlog is stolen by
+// whichever worker goes idle first
+
+// Queue a socket on w; fails when its ring is full. Only the acceptor pushes
+static int worker_push(worker* w, int fd) {
+    size_t pos = atomic_load_explicit(&w->tail, memory_order_relaxed);
+    worker_slot* slot = &w->slots[pos & (WORKER_QUEUE - 1)];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos) {
+        return -1;
+    }
+    slot->fd = fd;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    atomic_store_explicit(&w->tail, pos + 1, memory_order_relaxed);
+    return 0;
+}
+
+// Take the oldest socket queued on w, racing its owner and other thieves;
+// returns -1 when it is empty
+static int worker_take(worker* w) {
+    size_t pos = atomic_load_explicit(&w->head, memory_order_relaxed);
+    while (1) {
+        worker_slot* slot = &w->slots[pos & (WORKER_QUEUE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)(seq - (pos + 1));
+        if (diff < 0) {
+            return -1;
+        }
+        if (diff > 0) {
+            pos = atomic_load_explicit(&w->head, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&w->head, &pos, pos + 1,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+            int fd = slot->fd;
+            atomic_store_explicit(&slot->seq, pos + WORKER_QUEUE, memory_order_release);
+            return fd;
+        }
+    }
+}
+
+// Own queue first, then steal, starting with the next worker along
+static int worker_next(worker* w) {
+    int fd = worker_take(w);
+    long self = w - workers;
+    for (long i = 1; fd < 0 && i < worker_count; i++) {
+        fd = worker_take(&workers[(self + i) % worker_count]);
+    }
+    return fd;
+}
+
+void* worker_thread(void* arg) {
+    worker* w = arg;
+    if (w->loop->cpu >= 0) {
+        loop_pin(w->loop);
+    }
+    while (1) {
+        int fd = worker_next(w);
+        if (fd < 0) {
+            if (atomic_load(&shutdown_requested)) {
+                break;
+            }
+            // Posts are counted, so one made before we sleep isn't lost
+            atomic_store(&w->sleeping, 1);
+            while (sem_wait(&w->wake) < 0 && errno == EINTR) {
+            }
+            atomic_store(&w->sleeping, 0);
+            continue;
+        }
+        if (set_nonblocking(fd) < 0 || conn_create(w->loop, fd) == NULL) {
+            close(fd);
+            continue;
+        }
+        loop_run(w->loop);
+    }
+    return NULL;
+}
+
+// Set up one worker per loop; threads are started by main
+void worker_init(event_loop** loops, long count) {
+    workers = calloc(count, sizeof(worker));
+    if (workers == NULL) {
+        perror("Worker pool allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (long i = 0; i < count; i++) {
+        worker* w = &workers[i];
+        for (size_t s = 0; s < WORKER_QUEUE; s++) {
+            atomic_init(&w->slots[s].seq, s);
+        }
+        atomic_init(&w->head, 0);
+        atomic_init(&w->tail, 0);
+        atomic_init(&w->sleeping, 0);
+        sem_init(&w->wake, 0, 0);
+        w->loop = loops[i];
+    }
+    worker_count = count;
+}
+
+// Hand an accepted socket to the pool: to a sleeping worker if there is
+// one, otherwise to the next queue with room, where the first worker to
+// come free picks it up. Refused with a 503 when every queue is full
+void worker_dispatch(int client_fd) {
+    static long next = 0;  // Acceptor thread only
+    for (int pass = 0; pass < 2; pass++) {
+        for (long i = 0; i < worker_count; i++) {
+            worker* w = &workers[(next + i) % worker_count];
+            if ((pass == 1 || atomic_load(&w->sleeping)) && worker_push(w, client_fd) == 0) {
+                next = (next + i + 1) % worker_count;
+                sem_post(&w->wake);
+                return;
+            }
+        }
+    }
+    log_error("Worker queues full, refusing connection\n");
+    const canned_response* busy = canned_for(503);
+    send(client_fd, busy->text, busy->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client_fd);
+}
+
+// io_uring engine for the event loops. A loop keeps one multishot accept
+// on its listener, one multishot receive per client into a ring of
+// provided buffers, and multishot edge-triggered polls where the epoll
+// loops register sockets. Responses still go out with plain sends; reading
+// requests and waiting for readiness cost the loop one io_uring_enter()
+// per wakeup
+
+static int uring_register(uring* r, unsigned opcode, const void* arg, unsigned count) {
+    return syscall(__NR_io_uring_register, r->fd, opcode, arg, count);
+}
+
+// Publish the SQEs handed out so far and reap completions, waiting for at
+// least wait of them unless ts passes first
+static int uring_enter(uring* r, unsigned wait, struct __kernel_timespec* ts) {
+    atomic_store_explicit(r->sq_tail, r->sq_local_tail, memory_order_release);
+    unsigned pending = r->sq_local_tail - atomic_load_explicit(r->sq_head, memory_order_acquire);
+    struct io_uring_getevents_arg arg = {0};
+    arg.ts = (uint64_t)(uintptr_t)ts;
+    return syscall(__NR_io_uring_enter, r->fd, pending, wait,
+                   IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+// Next SQE, zeroed; a full queue is flushed to the kernel first
+static struct io_uring_sqe* uring_sqe(uring* r) {
+    while (r->sq_local_tail - atomic_load_explicit(r->sq_head, memory_order_acquire) == r->sq_entries) {
+        if (uring_enter(r, 0, NULL) < 0 && errno != EINTR) {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe* sqe = &r->sqes[r->sq_local_tail++ & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Give a receive buffer back for the kernel to fill again
+static void uring_buf_return(uring* r, int bid) {
+    struct io_uring_buf* b = &r->buf_ring->bufs[r->buf_tail & (URING_BUFS - 1)];
+    b->addr = (uint64_t)(uintptr_t)(r->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    r->buf_tail++;
+    atomic_store_explicit((_Atomic unsigned short*)&r->buf_ring->tail, r->buf_tail,
+                          memory_order_release);
+}
+
+static void uring_slot_free(uring* r, int slot) {
+    int none = -1;
+    struct io_uring_files_update update = {0};
+    update.offset = slot;
+    update.fds = (uint64_t)(uintptr_t)&none;
+    uring_register(r, IORING_REGISTER_FILES_UPDATE, &update, 1);
+    r->free_slots[r->free_slot_count++] = slot;
+}
+
+// Readiness each kind of handle polls for; clients are read by receives
+static unsigned uring_poll_events(const io_handle* h) {
+    if (h->kind == HANDLE_WAKER) {
+        return EPOLLIN;
+    }
+    if (h->kind == HANDLE_CLIENT) {
+        return EPOLLOUT | EPOLLRDHUP;
+    }
+    return EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+}
+
+static int uring_arm(uring* r, io_handle* h, uring_op_kind kind) {
+    uring_op* op = malloc(sizeof(uring_op));
+    struct io_uring_sqe* sqe = op != NULL ? uring_sqe(r) : NULL;
+    if (sqe == NULL) {
+        free(op);
+        return -1;
+    }
+    op->handle = h;
+    op->kind = kind;
+    op->slot = -1;
+    sqe->user_data = (uint64_t)(uintptr_t)op;
+    sqe->fd = h->fd;
+    if (kind == URING_POLL) {
+        // Without IORING_POLL_ADD_LEVEL a multishot poll is edge-triggered
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = uring_poll_events(h);
+        h->poll = op;
+    } else if (kind == URING_RECV) {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        if (h->slot >= 0) {
+            sqe->fd = h->slot;
+            sqe->flags |= IOSQE_FIXED_FILE;
+        }
+        h->recv = op;
+    } else {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        h->poll = op;
+    }
+    return 0;
+}
+
+// Detach op from its handle and ask the kernel to end it; the completion
+// that ends it frees it
+static void uring_cancel(uring* r, uring_op* op) {
+    op->handle = NULL;
+    struct io_uring_sqe* sqe = uring_sqe(r);
+    if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uint64_t)(uintptr_t)op;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+    }
+}
+
+// Arm what h needs: accept on a listener, a poll elsewhere, and on a
+// client also a receive, made through a registered slot while one is free
+int uring_watch(uring* r, io_handle* h) {
+    h->slot = -1;
+    if (h->kind == HANDLE_LISTENER) {
+        return uring_arm(r, h, URING_ACCEPT);
+    }
+    if (h->kind == HANDLE_CLIENT && r->free_slot_count > 0) {
+        int slot = r->free_slots[r->free_slot_count - 1];
+        struct io_uring_files_update update = {0};
+        update.offset = slot;
+        update.fds = (uint64_t)(uintptr_t)&h->fd;
+        if (uring_register(r, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1) {
+            h->slot = slot;
+            r->free_slot_count--;
+        }
+    }
+    if ((h->kind == HANDLE_CLIENT && uring_arm(r, h, URING_RECV) < 0) ||
+            uring_arm(r, h, URING_POLL) < 0) {
+        uring_unwatch(r, h);
+        return -1;
+    }
+    return 0;
+}
+
+// Cancel h's operations and return a client's unread buffers. Its slot is
+// freed only once the receive has ended, so no queued receive can land on
+// a socket that reuses the slot
+void uring_unwatch(uring* r, io_handle* h) {
+    if (h->poll != NULL) {
+        uring_cancel(r, h->poll);
+        h->poll = NULL;
+    }
+    if (h->recv != NULL) {
+        h->recv->slot = h->slot;
+        uring_cancel(r, h->recv);
+        h->recv = NULL;
+    } else if (h->slot >= 0) {
+        uring_slot_free(r, h->slot);
+    }
+    h->slot = -1;
+    if (h->kind == HANDLE_CLIENT) {
+        connection* c = h->conn;
+        while (c->rx_head >= 0) {
+            int bid = c->rx_head;
+            c->rx_head = r->buf_next[bid];
+            uring_buf_return(r, bid);
+        }
+        c->rx_offset = 0;
+    }
+}
+
+// Client bytes the receive already delivered. Once it has stopped, having
+// run out of buffers, the socket is read directly and the receive rearmed
+// when it is drained
+ssize_t uring_recv(connection* c, char* buf, size_t len) {
+    uring* r = c->loop->ring;
+    size_t copied = 0;
+    while (c->rx_head >= 0 && copied < len) {
+        int bid = c->rx_head;
+        size_t take = r->buf_len[bid] - c->rx_offset;
+        if (take > len - copied) {
+            take = len - copied;
+        }
+        memcpy(buf + copied, r->bufs + (size_t)bid * URING_BUF_SIZE + c->rx_offset, take);
+        copied += take;
+        c->rx_offset += take;
+        if (c->rx_offset == r->buf_len[bid]) {
+            c->rx_head = r->buf_next[bid];
+            c->rx_offset = 0;
+            uring_buf_return(r, bid);
+        }
+    }
+    if (copied > 0) {
+        return copied;
+    }
+    if (c->rx_eof) {
+        return 0;
+    }
+    if (c->client.recv != NULL) {
+        errno = EAGAIN;
+        return -1;
+    }
+    ssize_t n = recv(c->client.fd, buf, len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && uring_arm(r, &c->client, URING_RECV) < 0) {
+        return -1;
+    }
+    return n;
+}
+
+// Route one completion the way loop_dispatch routes an epoll event
+static void uring_complete(event_loop* loop, const struct io_uring_cqe* cqe) {
+    uring* r = loop->ring;
+    uring_op* op = (uring_op*)(uintptr_t)cqe->user_data;
+    if (op == NULL) {
+        return;  // A cancel that found nothing left to cancel
+    }
+    io_handle* h = op->handle;
+    uring_op_kind kind = op->kind;
+    int more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    if (!more) {
+        if (h != NULL && kind == URING_RECV) {
+            h->recv = NULL;
+        } else if (h != NULL) {
+            h->poll = NULL;
+        }
+        if (op->slot >= 0) {
+            uring_slot_free(r, op->slot);
+        }
+        free(op);
+    }
+
+    if (kind == URING_ACCEPT) {
+        if (cqe->res >= 0) {
+            // Adopted even after a drain cancelled the accept: the kernel
+            // had already taken the connection off the queue
+            struct sockaddr_in addr = {0};
+            socklen_t addr_len = sizeof(addr);
+            getpeername(cqe->res, (struct sockaddr*)&addr, &addr_len);
+            loop_adopt(loop, cqe->res, &addr);
+        } else if (h != NULL && cqe->res != -ECANCELED) {
+            log_error("Accept failed: %s\n", strerror(-cqe->res));
+        }
+        if (!more && h != NULL && loop->listener.fd >= 0) {
+            uring_arm(r, h, URING_ACCEPT);
+        }
+        return;
+    }
+
+    if (kind == URING_RECV) {
+        if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+            int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (h == NULL) {
+                uring_buf_return(r, bid);
+                return;
+            }
+            connection* c = h->conn;
+            r->buf_len[bid] = cqe->res;
+            r->buf_next[bid] = -1;
+            if (c->rx_head < 0) {
+                c->rx_head = bid;
+            } else {
+                r->buf_next[c->rx_tail] = bid;
+            }
+            c->rx_tail = bid;
+        } else if (h == NULL) {
+            return;
+        } else if (cqe->res != -ENOBUFS) {
+            h->conn->rx_eof = 1;  // EOF or a receive error, seen by conn_recv
+        }
+        loop_dispatch(loop, h, EPOLLIN);
+        return;
+    }
+
+    if (h == NULL) {
+        return;
+    }
+    if (cqe->res < 0) {
+        loop_dispatch(loop, h, EPOLLERR);
+        return;
+    }
+    if (!more) {
+        uring_arm(r, h, URING_POLL);  // The kernel ended it, e.g. on CQ overflow
+    }
+    loop_dispatch(loop, h, cqe->res);
+}
+
+// Submit what the loop queued, wait up to timeout ms (-1: no limit) for
+// a completion and dispatch all that are ready. -1 if the ring failed
+int uring_wait(event_loop* loop, int timeout) {
+    uring* r = loop->ring;
+    if (!r->enabled) {
+        // Enabled from the loop thread, which becomes the only submitter
+        if (uring_register(r, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0) {
+            perror("Enabling io_uring failed");
+            return -1;
+        }
+        r->enabled = 1;
+    }
+    unsigned head = atomic_load_explicit(r->cq_head, memory_order_relaxed);
+    int ready = atomic_load_explicit(r->cq_tail, memory_order_acquire) != head;
+    struct __kernel_timespec ts = {timeout / 1000, (timeout % 1000) * 1000000LL};
+    if (uring_enter(r, ready ? 0 : 1, timeout >= 0 ? &ts : NULL) < 0 &&
+            errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY) {
+        perror("io_uring_enter failed");
+        return -1;
+    }
+
+    // Entries are copied out and released one at a time: handlers queue
+    // new SQEs and may flush them
+    unsigned tail = atomic_load_explicit(r->cq_tail, memory_order_acquire);
+    while (head != tail) {
+        struct io_uring_cqe cqe = r->cqes[head & r->cq_mask];
+        atomic_store_explicit(r->cq_head, ++head, memory_order_release);
+        uring_complete(loop, &cqe);
+    }
+    return 0;
+}
+
+// A ring for one loop, or NULL when the kernel lacks what the engine
+// needs. Multishot receive has no probe of its own, but it came with
+// single-issuer rings, so a kernel refusing IORING_SETUP_SINGLE_ISSUER is
+// taken to lack it; 5.19's multishot accept and buffer rings are not enough
+uring* uring_create(void) {
+    uring* r = calloc(1, sizeof(uring));
+    if (r == NULL) {
+        return NULL;
+    }
+    // Deferred task work (6.1) runs completions only when the loop reaps
+    unsigned flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_R_DISABLED |
+                     IORING_SETUP_SUBMIT_ALL | IORING_SETUP_CQSIZE;
+    unsigned attempts[2] = {flags | IORING_SETUP_DEFER_TASKRUN, flags | IORING_SETUP_COOP_TASKRUN};
+    struct io_uring_params p;
+    r->fd = -1;
+    for (int i = 0; i < 2 && r->fd < 0; i++) {
+        memset(&p, 0, sizeof(p));
+        p.flags = attempts[i];
+        p.cq_entries = URING_ENTRIES * 4;
+        r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (r->fd < 0 || !(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        uring_destroy(r);
+        return NULL;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->rings_size = sq_size > cq_size ? sq_size : cq_size;
+    r->sq_entries = p.sq_entries;
+    void* rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       r->fd, IORING_OFF_SQ_RING);
+    void* sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    r->rings = rings != MAP_FAILED ? rings : NULL;
+    r->sqes = sqes != MAP_FAILED ? sqes : NULL;
+    if (r->rings == NULL || r->sqes == NULL) {
+        uring_destroy(r);
+        return NULL;
+    }
+    char* base = r->rings;
+    r->sq_mask = *(unsigned*)(base + p.sq_off.ring_mask);
+    r->sq_head = (atomic_uint*)(base + p.sq_off.head);
+    r->sq_tail = (atomic_uint*)(base + p.sq_off.tail);
+    unsigned* array = (unsigned*)(base + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) {
+        array[i] = i;  // SQEs are used in ring order
+    }
+    r->cq_mask = *(unsigned*)(base + p.cq_off.ring_mask);
+    r->cq_head = (atomic_uint*)(base + p.cq_off.head);
+    r->cq_tail = (atomic_uint*)(base + p.cq_off.tail);
+    r->cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+
+    // Receive buffers, one picked by the kernel for each completion
+    void* buf_ring = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    r->buf_ring = buf_ring != MAP_FAILED ? buf_ring : NULL;
+    r->bufs = malloc((size_t)URING_BUFS * URING_BUF_SIZE);
+    struct io_uring_buf_reg reg = {0};
+    reg.ring_addr = (uint64_t)(uintptr_t)r->buf_ring;
+    reg.ring_entries = URING_BUFS;
+    if (r->buf_ring == NULL || r->bufs == NULL ||
+            uring_register(r, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_destroy(r);
+        return NULL;
+    }
+    for (int i = 0; i < URING_BUFS; i++) {
+        uring_buf_return(r, i);
+    }
+
+    // Sparse table of client slots, within RLIMIT_NOFILE; without one,
+    // clients are received on their plain descriptors
+    struct rlimit nofile;
+    int slots = URING_FILES;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur < (rlim_t)slots) {
+        slots = nofile.rlim_cur;
+    }
+    struct io_uring_rsrc_register files = {0};
+    files.nr = slots;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (slots > 0 && uring_register(r, IORING_REGISTER_FILES2, &files, sizeof(files)) == 0) {
+        for (int i = 0; i < slots; i++) {
+            r->free_slots[i] = slots - 1 - i;
+        }
+        r->free_slot_count = slots;
+    }
+    return r;
+}
+
+void uring_destroy(uring* r) {
+    if (r->sqes != NULL) {
+        munmap(r->sqes, r->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (r->rings != NULL) {
+        munmap(r->rings, r->rings_size);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    if (r->buf_ring != NULL) {
+        munmap(r->buf_ring, URING_BUFS * sizeof(struct io_uring_buf));
+    }
+    free(r->bufs);
+    free(r);
+}
+
+// I/O buffer pool: fixed-size refcounted buffers for relaying and
+// capturing responses. Each thread keeps a few free ones to itself and
+// trades with a shared list in batches, so most gets and releases take no
+// lock
+
+static __thread io_buf* tls_io_bufs = NULL;
+static __thread int tls_io_buf_count = 0;
+
+// Returns a buffer with one reference, empty and unchained, or NULL
+io_buf* io_buf_get(void) {
+    if (tls_io_bufs == NULL) {
+        pthread_mutex_lock(&io_buf_lock);
+        while (io_buf_pool != NULL && tls_io_buf_count < IO_BUF_THREAD_CACHE / 2) {
+            io_buf* b = io_buf_pool;
+            io_buf_pool = b->next;
+            io_buf_pool_count--;
+            b->next = tls_io_bufs;
+            tls_io_bufs = b;
+            tls_io_buf_count++;
+        }
+        pthread_mutex_unlock(&io_buf_lock);
+    }
+    io_buf* b = tls_io_bufs;
+    if (b != NULL) {
+        tls_io_bufs = b->next;
+        tls_io_buf_count--;
+    } else if ((b = malloc(sizeof(io_buf))) == NULL) {
+        return NULL;
+    }
+    atomic_init(&b->refs, 1);
+    b->len = 0;
+    b->next = NULL;
+    return b;
+}
+
+// Drop one reference; the last returns the buffer to the pool
+void io_buf_release(io_buf* b) {
+    if (atomic_fetch_sub(&b->refs, 1) != 1) {
+        return;
+    }
+    b->next = tls_io_bufs;
+    tls_io_bufs = b;
+    if (++tls_io_buf_count < IO_BUF_THREAD_CACHE) {
+        return;
+    }
+    // Hand half back, freeing what the shared list has no room for
+    pthread_mutex_lock(&io_buf_lock);
+    while (tls_io_buf_count > IO_BUF_THREAD_CACHE / 2) {
+        io_buf* spill = tls_io_bufs;
+        tls_io_bufs = spill->next;
+        tls_io_buf_count--;
+        if (io_buf_pool_count < IO_BUF_POOL_MAX) {
+            spill->next = io_buf_pool;
+            io_buf_pool = spill;
+            io_buf_pool_count++;
+        } else {
+            free(spill);
+        }
+    }
+    pthread_mutex_unlock(&io_buf_lock);
+}
+
+// Drop one reference on every buffer of a chain, which may be NULL
+void io_chain_release(io_buf* chain) {
+    while (chain != NULL) {
+        io_buf* next = chain->next;  // Read first: release may recycle it
+        io_buf_release(chain);
+        chain = next;
+    }
+}
+
+// Slab allocator for cache entries
+
+static __thread slab_magazine* tls_magazine = NULL;
+
+// Return a thread's stashed chunks to the shared size classes
+static void slab_magazine_flush(void* arg) {
+    slab_magazine* m = arg;
+    for (int i = 0; i < slab_class_count; i++) {
+        while (m->chunks[i] != NULL) {
+            slab_chunk* chunk = m->chunks[i];
+            m->chunks[i] = chunk->next;
+            pthread_mutex_lock(&slab_classes[i].lock);
+            chunk->next = slab_classes[i].free;
+            slab_classes[i].free = chunk;
+            pthread_mutex_unlock(&slab_classes[i].lock);
+        }
+    }
+    free(m);
+}
+
+// Size classes grow by 1.25x from SLAB_MIN_CHUNK up to the largest entry:
+// an element header, a full request key and a MAX_ELEMENT_LIMIT body, so
+// a reload can raise the RAM tier's object limit that far
+void slab_init(void) {
+    size_t largest = sizeof(cache_element) + MAX_BYTES + MAX_ELEMENT_LIMIT;
+    size_t size = SLAB_MIN_CHUNK;
+    while (slab_class_count < SLAB_MAX_CLASSES) {
+        if (size > largest || slab_class_count == SLAB_MAX_CLASSES - 1) {
+            size = largest;
+        }
+        size = (size + 15) & ~(size_t)15;
+        pthread_mutex_init(&slab_classes[slab_class_count].lock, NULL);
+        slab_classes[slab_class_count].size = size;
+        slab_class_count++;
+        if (size >= largest) {
+            break;
+        }
+        size = size * 5 / 4;
+    }
+    pthread_key_create(&slab_magazine_key, slab_magazine_flush);
+}
+
+static slab_magazine* slab_thread_magazine(void) {
+    if (tls_magazine == NULL) {
+        tls_magazine = calloc(1, sizeof(slab_magazine));
+        if (tls_magazine != NULL) {
+            pthread_setspecific(slab_magazine_key, tls_magazine);
+        }
+    }
+    return tls_magazine;
+}
+
+size_t slab_chunk_size(int slab_class) {
+    return slab_classes[slab_class].size;
+}
+
+// Move up to half a magazine of chunks from the shared class, carving a
+// new page if it is empty; returns one chunk
+static slab_chunk* slab_refill(int cls, slab_magazine* m) {
+    slab_class* sc = &slab_classes[cls];
+    pthread_mutex_lock(&sc->lock);
+    if (sc->free == NULL) {
+        char* page = malloc(SLAB_PAGE_SIZE);
+        if (page == NULL) {
+            pthread_mutex_unlock(&sc->lock);
+            return NULL;
+        }
+        size_t n = SLAB_PAGE_SIZE / sc->size;
+        for (size_t i = 0; i < n; i++) {
+            slab_chunk* chunk = (slab_chunk*)(page + i * sc->size);
+            chunk->next = sc->free;
+            sc->free = chunk;
+        }
+        sc->pages++;
+    }
+    slab_chunk* result = sc->free;
+    sc->free = result->next;
+    while (m != NULL && sc->free != NULL && m->count[cls] < SLAB_MAGAZINE / 2) {
+        slab_chunk* chunk = sc->free;
+        sc->free = chunk->next;
+        chunk->next = m->chunks[cls];
+        m->chunks[cls] = chunk;
+        m->count[cls]++;
+    }
+    pthread_mutex_unlock(&sc->lock);
+    return result;
+}
+
+// Allocate from the smallest class that fits; *slab_class receives the
+// class to pass back to slab_free()
+void* slab_alloc(size_t size, int* slab_class) {
+    int cls = 0;
+    while (cls < slab_class_count && slab_classes[cls].size < size) {
+        cls++;
+    }
+    if (cls == slab_class_count) {
+        return NULL;
+    }
+    *slab_class = cls;
+
+    slab_magazine* m = slab_thread_magazine();
+    if (m != NULL && m->chunks[cls] != NULL) {
+        slab_chunk* chunk = m->chunks[cls];
+        m->chunks[cls] = chunk->next;
+        m->count[cls]--;
+        return chunk;
+    }
+    return slab_refill(cls, m);
+}
+
+// Chunks go to the freeing thread's magazine; a full magazine spills half
+// of itself back to the shared class
+void slab_free(void* p, int cls) {
+    slab_chunk* chunk = p;
+    slab_magazine* m = slab_thread_magazine();
+    if (m == NULL) {
+        pthread_mutex_lock(&slab_classes[cls].lock);
+        chunk->next = slab_classes[cls].free;
+        slab_classes[cls].free = chunk;
+        pthread_mutex_unlock(&slab_classes[cls].lock);
+        return;
+    }
+
+    chunk->next = m->chunks[cls];
+    m->chunks[cls] = chunk;
+    if (++m->count[cls] <= SLAB_MAGAZINE) {
+        return;
+    }
+    slab_class* sc = &slab_classes[cls];
+    pthread_mutex_lock(&sc->lock);
+    while (m->count[cls] > SLAB_MAGAZINE / 2) {
+        chunk = m->chunks[cls];
+        m->chunks[cls] = chunk->next;
+        m->count[cls]--;
+        chunk->next = sc->free;
+        sc->free = chunk;
+    }
+    pthread_mutex_unlock(&sc->lock);
+}
+
+// Cache management functions
+
+// FNV-1a; cheap and well distributed for text keys
+uint64_t cache_hash(const char* key, int len) {
+    uint64_t h = 1469598103934665603ULL;
+    for (int i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// High bits pick the shard so they stay independent of the bucket bits
+static cache_shard* cache_shard_for(uint64_t hash) {
+    return &cache_shards[(hash >> 32) & (cache_shard_count - 1)];
+}
+
+// Size the shard array from the core count and split the byte budget
+void cache_init(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t wanted = (cpus > 0 ? (size_t)cpus : 1) * CACHE_SHARDS_PER_CPU;
+
+    cache_shard_count = 1;
+    while (cache_shard_count < wanted) {
+        cache_shard_count <<= 1;
+    }
+    slab_init();
+    if (cache_policy == NULL) {
+        cache_set_policy("lru");
+    }
+    cache_shards = calloc(cache_shard_count, sizeof(cache_shard));
+    if (cache_shards == NULL) {
+        perror("Cache allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < cache_shard_count; i++) {
+        pthread_mutex_init(&cache_shards[i].lock, NULL);
+        cache_shards[i].capacity = ((size_t)cache_size_mb << 20) / cache_shard_count;
+        cache_policy->init(&cache_shards[i]);
+    }
+}
+
+static void queue_unlink(cache_shard* shard, cache_element* e) {
+    cache_queue* q = &shard->queues[e->queue];
+    if (e->queue_prev) {
+        e->queue_prev->queue_next = e->queue_next;
+    } else {
+        q->head = e->queue_next;
+    }
+    if (e->queue_next) {
+        e->queue_next->queue_prev = e->queue_prev;
+    } else {
+        q->tail = e->queue_prev;
+    }
+    e->queue_prev = e->queue_next = NULL;
+    q->size -= e->charge;
+}
+
+static void queue_push(cache_shard* shard, int queue, cache_element* e) {
+    cache_queue* q = &shard->queues[queue];
+    e->queue = queue;
+    e->queue_prev = NULL;
+    e->queue_next = q->head;
+    if (q->head) {
+        q->head->queue_prev = e;
+    } else {
+        q->tail = e;
+    }
+    q->head = e;
+    q->size += e->charge;
+}
+
+// Move e to the head of queue, which may be the one it is in
+static void queue_move(cache_shard* shard, int queue, cache_element* e) {
+    queue_unlink(shard, e);
+    queue_push(shard, queue, e);
+}
+
+// Double the bucket array once the load factor reaches 1
+static void cache_grow(cache_shard* shard) {
+    size_t new_count = shard->bucket_count ? shard->bucket_count * 2 : CACHE_INITIAL_BUCKETS;
+    cache_element** new_buckets = calloc(new_count, sizeof(cache_element*));
+    if (new_buckets == NULL) {
+        return;  // Keep working with longer chains
+    }
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        cache_element* e = shard->buckets[i];
+        while (e) {
+            cache_element* next = e->hash_next;
+            size_t b = e->hash & (new_count - 1);
+            e->hash_next = new_buckets[b];
+            new_buckets[b] = e;
+            e = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = new_buckets;
+    shard->bucket_count = new_count;
+}
+
+// Drop a reference; memory goes once neither the shard nor a reader holds it
+void release_cache_element(cache_element* element) {
+    if (element == NULL || atomic_fetch_sub(&element->refcount, 1) != 1) {
+        return;
+    }
+    slab_free(element, element->slab_class);
+}
+
+// Unlink from the bucket chain and LRU list, then drop the shard's reference
+static void cache_delete(cache_shard* shard, cache_element* e) {
+    cache_element** link = &shard->buckets[e->hash & (shard->bucket_count - 1)];
+    while (*link != e) {
+        link = &(*link)->hash_next;
+    }
+    *link = e->hash_next;
+    queue_unlink(shard, e);
+    shard->element_count--;
+
+    shard->size -= e->charge;
+    release_cache_element(e);
+}
+
+static cache_element* cache_lookup(cache_shard* shard, const char* url, uint64_t hash) {
+    if (shard->bucket_count == 0) {
+        return NULL;
+    }
+    cache_element* e = shard->buckets[hash & (shard->bucket_count - 1)];
+    while (e != NULL && (e->hash != hash || strcmp(e->url, url) != 0)) {
+        e = e->hash_next;
+    }
+    return e;
+}
+
+// Returns a referenced element; the caller must release_cache_element() it.
+// hash is cache_hash() of key, computed once by the caller
+cache_element* find_in_cache(const char* key, uint64_t hash) {
+    cache_shard* shard = cache_shard_for(hash);
+
+    pthread_mutex_lock(&shard->lock);
+    cache_element* element = cache_lookup(shard, key, hash);
+    if (element != NULL) {
+        atomic_fetch_add(&element->refcount, 1);
+        cache_policy->hit(shard, element);
+    } else {
+        cache_policy->miss(shard, hash);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return element;
+}
+
+int add_to_cache(const char* data, int size, const char* url, uint64_t hash,
+                 int flags, const cache_freshness* fresh) {
+    if (size > ram_max_object) {
+        return 0;
+    }
+
+    // One slab chunk holds the element, then the key, then the data.
+    // Copy outside the lock; only the index update is serialized
+    size_t url_len = strlen(url);
+    int slab_class;
+    cache_element* element = slab_alloc(sizeof(cache_element) + url_len + 1 + size, &slab_class);
+    if (element == NULL) {
+        return 0;
+    }
+    element->url = (char*)(element + 1);
+    element->data = element->url + url_len + 1;
+    memcpy(element->url, url, url_len + 1);
+    memcpy(element->data, data, size);
+    element->len = size;
+    element->hash = hash;
+    element->is_vary = (flags & CACHE_VARY) != 0;
+    element->from_disk = (flags & CACHE_FROM_DISK) != 0;
+    // Decided once here rather than by rescanning the head on every hit
+    element->reusable = !element->is_vary && response_complete(data, size) &&
+                        response_keeps_alive(data, size);
+    atomic_init(&element->expires, fresh ? fresh->expires : 0);
+    atomic_init(&element->stale_revalidate, fresh ? fresh->stale_revalidate : 0);
+    atomic_init(&element->stale_error, fresh ? fresh->stale_error : 0);
+    atomic_init(&element->refreshing, 0);
+    element->slab_class = slab_class;
+    element->charge = slab_chunk_size(slab_class);
+    atomic_init(&element->refcount, 1);
+    element->freq = 0;
+    size_t charge = element->charge;
+
+    cache_shard* shard = cache_shard_for(element->hash);
+    pthread_mutex_lock(&shard->lock);
+
+    // A newer response replaces the stored one; a restored one never does
+    cache_element* existing = cache_lookup(shard, url, element->hash);
+    if (existing != NULL) {
+        if (flags & CACHE_IF_ABSENT) {
+            pthread_mutex_unlock(&shard->lock);
+            release_cache_element(element);
+            return 0;
+        }
+        cache_delete(shard, existing);
+    }
+
+    if (shard->element_count >= shard->bucket_count) {
+        cache_grow(shard);
+    }
+    if (shard->bucket_count == 0) {
+        pthread_mutex_unlock(&shard->lock);
+        release_cache_element(element);
+        return 0;
+    }
+
+    size_t b = element->hash & (shard->bucket_count - 1);
+    element->hash_next = shard->buckets[b];
+    shard->buckets[b] = element;
+    shard->element_count++;
+    shard->size += charge;
+    int kept = cache_policy->insert(shard, element, (flags & CACHE_IF_ABSENT) != 0);
+
+    pthread_mutex_unlock(&shard->lock);
+    return kept;
+}
+
+// A 304 for element arrived: extend its freshness, taking directives the
+// 304 leaves out from the stored response
+void renew_cache_element(cache_element* element, const char* head, int head_len) {
+    const char* stored_end = memmem(element->data, element->len, "\r\n\r\n", 4);
+    cache_freshness fresh;
+    if (response_freshness(head, head + head_len, element->data, stored_end,
+                           time(NULL), &fresh) < 0) {
+        return;
+    }
+    atomic_store(&element->expires, fresh.expires);
+    atomic_store(&element->stale_revalidate, fresh.stale_revalidate);
+    atomic_store(&element->stale_error, fresh.stale_error);
+}
+
+// Evict element, demoting it to the disk tier; caller holds shard->lock
+void remove_from_cache(cache_shard* shard, cache_element* element) {
+    if (disk_fd >= 0 && !element->from_disk) {
+        disk_demote(element);
+    }
+    stat_add(STAT_EVICTIONS, 1);
+    cache_delete(shard, element);
+}
+
+// Eviction policies. Each keeps its own queues in the shard and evicts in
+// its insert hook until the shard's bytes fit its capacity again, so that
+// one large entry has to push out as much as it costs
+
+// Entries a shard is expected to hold; sizes the sketch and the ghosts
+static size_t policy_slots(const cache_shard* shard) {
+    size_t slots = 64;
+    while (slots < shard->capacity / SKETCH_ENTRY_BYTES) {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+static void policy_no_init(cache_shard* shard) {
+    (void)shard;
+}
+
+static void policy_no_miss(cache_shard* shard, uint64_t hash) {
+    (void)shard;
+    (void)hash;
+}
+
+// Evict from the tails of queues, most expendable first, until the shard
+// fits. Returns 0 if keep was among the victims
+static int policy_trim(cache_shard* shard, cache_element* keep) {
+    int kept = 1;
+    while (shard->size > shard->capacity) {
+        cache_element* victim = NULL;
+        for (int q = CACHE_QUEUES - 1; q >= 0 && victim == NULL; q--) {
+            victim = shard->queues[q].tail;
+        }
+        if (victim == NULL) {
+            break;
+        }
+        kept &= victim != keep;
+        remove_from_cache(shard, victim);
+    }
+    return kept;
+}
+
+// Split a new RAM tier size over the shards; any now over its share
+// evicts down to it at once rather than on its next insert
+void cache_resize(size_t bytes) {
+    for (size_t i = 0; i < cache_shard_count; i++) {
+        cache_shard* shard = &cache_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        shard->capacity = bytes / cache_shard_count;
+        policy_trim(shard, NULL);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+// LRU: one queue in recency order
+
+static void lru_hit(cache_shard* shard, cache_element* e) {
+    if (e != shard->queues[LRU_QUEUE].head) {
+        queue_move(shard, LRU_QUEUE, e);
+    }
+}
+
+static int lru_insert(cache_shard* shard, cache_element* e, int restored) {
+    (void)restored;
+    queue_push(shard, LRU_QUEUE, e);
+    return policy_trim(shard, e);
+}
+
+// S3-FIFO: new entries wait in a small FIFO and move to the main FIFO only
+// if they are hit there; the rest leave early and are remembered in the
+// ghost table, which sends them straight to main if they come back. Main
+// gives entries hit since their last pass another lap
+
+static void s3fifo_init(cache_shard* shard) {
+    size_t slots = policy_slots(shard);
+    shard->ghost = calloc(slots, sizeof(uint64_t));
+    if (shard->ghost == NULL) {
+        perror("Cache ghost allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    shard->ghost_mask = slots - 1;
+}
+
+// The ghost is direct mapped and aged by insertions, so there is no list
+// to maintain: a slot counts only while fewer than a table's worth of
+// keys have been added since it was written
+static int ghost_take(cache_shard* shard, uint64_t hash) {
+    uint64_t* slot = &shard->ghost[hash & shard->ghost_mask];
+    uint32_t fingerprint = (uint32_t)(hash >> 32);
+    uint32_t stamp = (uint32_t)*slot;
+    if (*slot == 0 || (uint32_t)(*slot >> 32) != fingerprint ||
+            shard->ghost_clock - stamp > shard->ghost_mask) {
+        return 0;
+    }
+    *slot = 0;
+    return 1;
+}
+
+static void ghost_put(cache_shard* shard, uint64_t hash) {
+    shard->ghost_clock++;
+    shard->ghost[hash & shard->ghost_mask] = (hash >> 32 << 32) | shard->ghost_clock;
+}
+
+static void s3fifo_hit(cache_shard* shard, cache_element* e) {
+    (void)shard;
+    if (e->freq < CACHE_FREQ_MAX) {
+        e->freq++;
+    }
+}
+
+static int s3fifo_insert(cache_shard* shard, cache_element* e, int restored) {
+    int queue = restored || ghost_take(shard, e->hash) ? S3FIFO_MAIN : S3FIFO_SMALL;
+    queue_push(shard, queue, e);
+
+    size_t small_capacity = shard->capacity / 100 * S3FIFO_SMALL_PERCENT;
+    cache_queue* small = &shard->queues[S3FIFO_SMALL];
+    cache_queue* main = &shard->queues[S3FIFO_MAIN];
+    int kept = 1;
+    while (shard->size > shard->capacity) {
+        if (small->tail != NULL && (small->size > small_capacity || main->tail == NULL)) {
+            cache_element* t = small->tail;
+            if (t->freq > 0) {
+                queue_move(shard, S3FIFO_MAIN, t);
+            } else {
+                kept &= t != e;
+                ghost_put(shard, t->hash);
+                remove_from_cache(shard, t);
+            }
+        } else if (main->tail != NULL) {
+            cache_element* t = main->tail;
+            if (t->freq > 0) {
+                t->freq--;
+                queue_move(shard, S3FIFO_MAIN, t);
+            } else {
+                kept &= t != e;
+                remove_from_cache(shard, t);
+            }
+        } else {
+            break;
+        }
+    }
+    return kept;
+}
+
+// W-TinyLFU: new entries go through a small LRU window. Leaving it, an
+// entry enters the main area (a segmented LRU of probation and protected)
+// only if the sketch rates it above the combined popularity of everything
+// it would push out, so a crawl passes through the window without flushing
+// the hot set and a large entry has to outrank every small one it displaces
+
+static const uint64_t sketch_seeds[4] = {
+    0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+    0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+};
+
+static void tinylfu_init(cache_shard* shard) {
+    size_t words = policy_slots(shard);
+    shard->sketch.table = calloc(words, sizeof(uint64_t));
+    if (shard->sketch.table == NULL) {
+        perror("Cache sketch allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    shard->sketch.mask = words - 1;
+    shard->sketch.sample_limit = words * 10;
+}
+
+// Word index in the low bits, counter within the word in the top four
+static uint64_t sketch_slot(uint64_t hash, int row) {
+    uint64_t h = (hash + sketch_seeds[row]) * sketch_seeds[row];
+    return h ^ (h >> 29);
+}
+
+static int sketch_frequency(const frequency_sketch* s, uint64_t hash) {
+    int freq = 15;
+    for (int row = 0; row < 4; row++) {
+        uint64_t h = sketch_slot(hash, row);
+        int count = (s->table[h & s->mask] >> ((h >> 60) << 2)) & 15;
+        if (count < freq) {
+            freq = count;
+        }
+    }
+    return freq;
+}
+
+static void sketch_increment(frequency_sketch* s, uint64_t hash) {
+    int added = 0;
+    for (int row = 0; row < 4; row++) {
+        uint64_t h = sketch_slot(hash, row);
+        uint64_t* word = &s->table[h & s->mask];
+        int shift = (h >> 60) << 2;
+        if (((*word >> shift) & 15) < 15) {
+            *word += 1ULL << shift;
+            added = 1;
+        }
+    }
+    if (added && ++s->samples >= s->sample_limit) {
+        for (size_t i = 0; i <= s->mask; i++) {
+            s->table[i] = (s->table[i] >> 1) & 0x7777777777777777ULL;
+        }
+        s->samples /= 2;
+    }
+}
+
+static void tinylfu_miss(cache_shard* shard, uint64_t hash) {
+    sketch_increment(&shard->sketch, hash);
+}
+
+static void tinylfu_hit(cache_shard* shard, cache_element* e) {
+    sketch_increment(&shard->sketch, e->hash);
+    if (e->queue != TINYLFU_PROBATION) {
+        if (e != shard->queues[e->queue].head) {
+            queue_move(shard, e->queue, e);
+        }
+        return;
+    }
+    // A second use promotes; protected overflow goes back on probation
+    queue_move(shard, TINYLFU_PROTECTED, e);
+    size_t main_capacity = shard->capacity - shard->capacity / 100 * TINYLFU_WINDOW_PERCENT;
+    size_t protected_capacity = main_capacity / 100 * TINYLFU_PROTECTED_PERCENT;
+    cache_queue* protected = &shard->queues[TINYLFU_PROTECTED];
+    while (protected->size > protected_capacity && protected->tail != e) {
+        queue_move(shard, TINYLFU_PROBATION, protected->tail);
+    }
+}
+
+// Would candidate, leaving the window, earn the room it needs? The victims
+// are probation's tail then protected's; evicts them if it does
+static int tinylfu_admit(cache_shard* shard, cache_element* candidate) {
+    size_t excess = shard->size - shard->capacity;
+    int candidate_freq = sketch_frequency(&shard->sketch, candidate->hash);
+    int victims_freq = 0;
+    int victims = 0;
+    size_t freed = 0;
+    int queue = TINYLFU_PROBATION;
+    cache_element* v = shard->queues[queue].tail;
+    while (freed < excess) {
+        if (v == NULL) {
+            if (queue == TINYLFU_PROTECTED) {
+                return 0;  // The main area can't make room
+            }
+            queue = TINYLFU_PROTECTED;
+            v = shard->queues[queue].tail;
+            continue;
+        }
+        victims_freq += sketch_frequency(&shard->sketch, v->hash);
+        if (victims_freq >= candidate_freq) {
+            return 0;
+        }
+        freed += v->charge;
+        victims++;
+        v = v->queue_prev;
+    }
+    while (victims-- > 0) {
+        cache_element* victim = shard->queues[TINYLFU_PROBATION].tail;
+        if (victim == NULL) {
+            victim = shard->queues[TINYLFU_PROTECTED].tail;
+        }
+        remove_from_cache(shard, victim);
+    }
+    return 1;
+}
+
+static int tinylfu_insert(cache_shard* shard, cache_element* e, int restored) {
+    if (restored) {
+        queue_push(shard, TINYLFU_PROBATION, e);
+        return policy_trim(shard, e);
+    }
+    queue_push(shard, TINYLFU_WINDOW, e);
+
+    size_t window_capacity = shard->capacity / 100 * TINYLFU_WINDOW_PERCENT;
+    cache_queue* window = &shard->queues[TINYLFU_WINDOW];
+    int kept = 1;
+    while (window->size > window_capacity) {
+        cache_element* candidate = window->tail;
+        if (shard->size <= shard->capacity || tinylfu_admit(shard, candidate)) {
+            queue_move(shard, TINYLFU_PROBATION, candidate);
+        } else {
+            kept &= candidate != e;
+            remove_from_cache(shard, candidate);
+        }
+    }
+    return policy_trim(shard, e) && kept;
+}
+
+static const eviction_policy eviction_policies[] = {
+    {"lru", policy_no_init, lru_hit, policy_no_miss, lru_insert},
+    {"s3fifo", s3fifo_init, s3fifo_hit, policy_no_miss, s3fifo_insert},
+    {"tinylfu", tinylfu_init, tinylfu_hit, tinylfu_miss, tinylfu_insert},
+};
+
+// Choose the eviction policy by name, before cache_init(); -1 if unknown
+int cache_set_policy(const char* name) {
+    for (size_t i = 0; i < sizeof(eviction_policies) / sizeof(eviction_policies[0]); i++) {
+        if (strcmp(name, eviction_policies[i].name) == 0) {
+            cache_policy = &eviction_policies[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Disk tier: one preallocated file used as a ring of records. The writer
+// thread appends at disk_head and reclaims the oldest records ahead of it;
+// records still being sent are stepped over. The index lives in memory and
+// is rebuilt from the record headers at startup
+
+static uint64_t disk_record_check(const disk_record* rec) {
+    return cache_hash((const char*)rec, offsetof(disk_record, check));
+}
+
+static off_t disk_align(off_t n) {
+    return (n + DISK_BLOCK - 1) & ~(off_t)(DISK_BLOCK - 1);
+}
+
+// Take d out of the index so no new hit can pin it; caller holds disk_lock
+static void disk_unindex(disk_entry* d) {
+    if (!d->indexed) {
+        return;
+    }
+    disk_entry** link = &disk_buckets[d->hash % DISK_BUCKETS];
+    while (*link != d) {
+        link = &(*link)->hash_next;
+    }
+    *link = d->hash_next;
+    d->indexed = 0;
+}
+
+// Make d the record for its key unless a newer one is indexed; caller
+// holds disk_lock
+static void disk_index(disk_entry* d) {
+    disk_entry** link = &disk_buckets[d->hash % DISK_BUCKETS];
+    for (disk_entry* e = *link; e != NULL; e = e->hash_next) {
+        if (e->hash == d->hash && strcmp(e->key, d->key) == 0) {
+            if (e->seq > d->seq) {
+                return;
+            }
+            disk_unindex(e);
+            break;
+        }
+    }
+    d->hash_next = *link;
+    *link = d;
+    d->indexed = 1;
+}
+
+static void disk_fifo_push(disk_entry* d) {
+    d->fifo_next = NULL;
+    if (disk_fifo_tail != NULL) {
+        disk_fifo_tail->fifo_next = d;
+    } else {
+        disk_fifo_head = d;
+    }
+    disk_fifo_tail = d;
+}
+
+// Reclaim the oldest record. One still being sent survives: it moves to
+// the back of the ring order and 0 is returned; caller holds disk_lock
+static int disk_reclaim_oldest(void) {
+    disk_entry* d = disk_fifo_head;
+    disk_fifo_head = d->fifo_next;
+    if (disk_fifo_head == NULL) {
+        disk_fifo_tail = NULL;
+    }
+    disk_unindex(d);
+    if (atomic_load(&d->readers) > 0) {
+        disk_fifo_push(d);
+        return 0;
+    }
+    free(d->key);
+    free(d);
+    return 1;
+}
+
+// Room for len bytes at the ring head, or -1; caller holds disk_lock
+static off_t disk_place(off_t len) {
+    int wrapped = 0;
+    for (int steps = 0; steps < 4096; steps++) {
+        if (disk_head + len > disk_size) {
+            if (wrapped++) {
+                return -1;
+            }
+            // Records in the rest of the file are the oldest; they go too
+            int pending = 0;
+            for (disk_entry* d = disk_fifo_head; d != NULL; d = d->fifo_next) {
+                pending++;
+            }
+            while (pending-- > 0 && disk_fifo_head->offset >= disk_head) {
+                disk_reclaim_oldest();
+            }
+            disk_head = 0;
+            continue;
+        }
+        disk_entry* d = disk_fifo_head;
+        if (d == NULL || d->offset >= disk_head + len || d->offset + d->length <= disk_head) {
+            off_t at = disk_head;
+            disk_head += len;
+            return at;
+        }
+        if (!disk_reclaim_oldest()) {
+            disk_head = d->offset + d->length;  // Step over a record still being sent
+        }
+    }
+    return -1;
+}
+
+// Writer thread: append a record and index it once it is on disk
+static void disk_write_record(const disk_write* w) {
+    disk_record rec = {0};
+    size_t key_len = strlen(w->key);
+    off_t length = disk_align(sizeof(rec) + key_len + w->len);
+    if (length > disk_size) {
+        return;
+    }
+    rec.magic = DISK_MAGIC;
+    rec.key_len = key_len;
+    rec.data_len = w->len;
+    rec.flags = (w->is_vary ? DISK_RECORD_VARY : 0) | (w->reusable ? DISK_RECORD_REUSABLE : 0);
+    rec.expires = w->fresh.expires;
+    rec.stale_revalidate = w->fresh.stale_revalidate;
+    rec.stale_error = w->fresh.stale_error;
+
+    disk_entry* d = calloc(1, sizeof(disk_entry));
+    if (d == NULL || (d->key = strdup(w->key)) == NULL) {
+        free(d);
+        return;
+    }
+    pthread_mutex_lock(&disk_lock);
+    off_t at = disk_place(length);
+    if (at < 0) {
+        pthread_mutex_unlock(&disk_lock);
+        free(d->key);
+        free(d);
+        return;
+    }
+    rec.seq = disk_seq++;
+    d->hash = w->hash;
+    d->is_vary = w->is_vary;
+    d->reusable = (rec.flags & DISK_RECORD_REUSABLE) != 0;
+    d->offset = at;
+    d->length = length;
+    d->data_offset = at + sizeof(rec) + key_len;
+    d->data_len = w->len;
+    d->seq = rec.seq;
+    d->fresh = w->fresh;
+    atomic_init(&d->readers, 0);
+    disk_fifo_push(d);  // Owns the space now; indexed once written
+    pthread_mutex_unlock(&disk_lock);
+
+    rec.check = disk_record_check(&rec);
+    struct iovec iov[2 + DISK_MAX_OBJECT / IO_BUF_SIZE + 1] = {
+        {&rec, sizeof(rec)},
+        {(void*)w->key, key_len}
+    };
+    int count = 2;
+    if (w->chain == NULL) {
+        iov[count++] = (struct iovec){(void*)w->data, w->len};
+    }
+    for (io_buf* b = w->chain; b != NULL; b = b->next) {
+        iov[count++] = (struct iovec){b->data, b->len};
+    }
+    ssize_t n = pwritev(disk_fd, iov, count, at);
+
+    pthread_mutex_lock(&disk_lock);
+    if (n == (ssize_t)(sizeof(rec) + key_len + w->len)) {
+        disk_index(d);
+    }
+    pthread_mutex_unlock(&disk_lock);
+}
+
+static void* disk_writer(void* arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&disk_queue_lock);
+        while (disk_queue_head == NULL || !disk_ready) {
+            pthread_cond_wait(&disk_queue_cond, &disk_queue_lock);
+        }
+        disk_write* w = disk_queue_head;
+        disk_queue_head = w->next;
+        if (disk_queue_head == NULL) {
+            disk_queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&disk_queue_lock);
+
+        disk_write_record(w);
+
+        pthread_mutex_lock(&disk_queue_lock);
+        disk_queue_bytes -= w->len;
+        if (disk_queue_bytes == 0) {
+            pthread_cond_broadcast(&disk_idle_cond);
+        }
+        pthread_mutex_unlock(&disk_queue_lock);
+        release_cache_element(w->element);
+        io_chain_release(w->chain);
+        free(w);
+    }
+    return NULL;
+}
+
+static void disk_enqueue(disk_write* w) {
+    pthread_mutex_lock(&disk_queue_lock);
+    if (disk_queue_bytes + w->len > DISK_QUEUE_MAX) {
+        pthread_mutex_unlock(&disk_queue_lock);
+        release_cache_element(w->element);
+        io_chain_release(w->chain);
+        free(w);
+        return;  // The disk can't keep up; this one stays uncached
+    }
+    disk_queue_bytes += w->len;
+    w->next = NULL;
+    if (disk_queue_tail != NULL) {
+        disk_queue_tail->next = w;
+    } else {
+        disk_queue_head = w;
+    }
+    disk_queue_tail = w;
+    pthread_cond_signal(&disk_queue_cond);
+    pthread_mutex_unlock(&disk_queue_lock);
+}
+
+// Queue an element being evicted from RAM; its reference keeps it readable
+void disk_demote(cache_element* element) {
+    disk_write* w = malloc(sizeof(disk_write));
+    if (w == NULL) {
+        return;
+    }
+    atomic_fetch_add(&element->refcount, 1);
+    w->element = element;
+    w->key = element->url;
+    w->hash = element->hash;
+    w->is_vary = element->is_vary;
+    w->reusable = element->reusable;
+    w->data = element->data;
+    w->chain = NULL;
+    w->len = element->len;
+    w->fresh.expires = atomic_load(&element->expires);
+    w->fresh.stale_revalidate = atomic_load(&element->stale_revalidate);
+    w->fresh.stale_error = atomic_load(&element->stale_error);
+    disk_enqueue(w);
+}
+
+// Queue a captured response too large for RAM; the writer takes its own
+// references on the chain rather than a copy
+void disk_submit(io_buf* chain, int size, const char* key, uint64_t hash, int reusable,
+                 const cache_freshness* fresh) {
+    size_t key_len = strlen(key);
+    if (disk_fd < 0 || size > DISK_MAX_OBJECT) {
+        return;
+    }
+    disk_write* w = malloc(sizeof(disk_write) + key_len + 1);
+    if (w == NULL) {
+        return;
+    }
+    char* copy = (char*)(w + 1);
+    memcpy(copy, key, key_len + 1);
+    for (io_buf* b = chain; b != NULL; b = b->next) {
+        atomic_fetch_add(&b->refs, 1);
+    }
+    w->element = NULL;
+    w->key = copy;
+    w->hash = hash;
+    w->is_vary = 0;
+    w->reusable = reusable;
+    w->data = NULL;
+    w->chain = chain;
+    w->len = size;
+    w->fresh = *fresh;
+    disk_enqueue(w);
+}
+
+// Returns the record for key pinned against reuse, or NULL; the caller
+// must disk_release() it
+disk_entry* disk_lookup(const char* key, uint64_t hash) {
+    if (disk_fd < 0) {
+        return NULL;
+    }
+    pthread_mutex_lock(&disk_lock);
+    disk_entry* d = disk_buckets[hash % DISK_BUCKETS];
+    while (d != NULL && (d->hash != hash || strcmp(d->key, key) != 0)) {
+        d = d->hash_next;
+    }
+    if (d != NULL) {
+        atomic_fetch_add(&d->readers, 1);
+    }
+    pthread_mutex_unlock(&disk_lock);
+    return d;
+}
+
+void disk_release(disk_entry* d) {
+    if (d != NULL) {
+        atomic_fetch_sub(&d->readers, 1);
+    }
+}
+
+// Copy a small record back into RAM and return it referenced; releases d
+cache_element* disk_promote(disk_entry* d) {
+    cache_element* element = NULL;
+    char* buf = malloc(d->data_len);
+    if (buf != NULL && pread(disk_fd, buf, d->data_len, d->data_offset) == (ssize_t)d->data_len) {
+        add_to_cache(buf, d->data_len, d->key, d->hash,
+                     (d->is_vary ? CACHE_VARY : 0) | CACHE_FROM_DISK, &d->fresh);
+        element = find_in_cache(d->key, d->hash);
+    }
+    free(buf);
+    disk_release(d);
+    return element;
+}
+
+// Index entry for the record at offset at, whose header is rec
+static disk_entry* disk_entry_create(const disk_record* rec, off_t at, const char* key) {
+    disk_entry* d = calloc(1, sizeof(disk_entry));
+    if (d == NULL || (d->key = strndup(key, rec->key_len)) == NULL) {
+        free(d);
+        return NULL;
+    }
+    d->hash = cache_hash(d->key, rec->key_len);
+    d->is_vary = (rec->flags & DISK_RECORD_VARY) != 0;
+    d->reusable = (rec->flags & DISK_RECORD_REUSABLE) != 0;
+    d->offset = at;
+    d->length = disk_align(sizeof(*rec) + rec->key_len + rec->data_len);
+    d->data_offset = at + sizeof(*rec) + rec->key_len;
+    d->data_len = rec->data_len;
+    d->seq = rec->seq;
+    d->fresh.expires = rec->expires;
+    d->fresh.stale_revalidate = rec->stale_revalidate;
+    d->fresh.stale_error = rec->stale_error;
+    atomic_init(&d->readers, 0);
+    return d;
+}
+
+// Rebuild the index from the record headers left by a previous run. Runs
+// while clients are served; the writer waits until it is done
+static void disk_load(void) {
+    disk_record rec;
+    char key[MAX_BYTES];
+    uint64_t newest = 0;
+    off_t head = 0;
+    int loaded = 0;
+
+    off_t at = 0;
+    while (at + (off_t)sizeof(rec) <= disk_size) {
+        if (pread(disk_fd, &rec, sizeof(rec), at) != sizeof(rec) || rec.magic != DISK_MAGIC ||
+                rec.check != disk_record_check(&rec) || rec.key_len >= sizeof(key)) {
+            at += DISK_BLOCK;
+            continue;
+        }
+        off_t length = disk_align(sizeof(rec) + rec.key_len + rec.data_len);
+        disk_entry* d = NULL;
+        if (at + length > disk_size ||
+                pread(disk_fd, key, rec.key_len, at + sizeof(rec)) != (ssize_t)rec.key_len ||
+                (d = disk_entry_create(&rec, at, key)) == NULL) {
+            at += DISK_BLOCK;
+            continue;
+        }
+        pthread_mutex_lock(&disk_lock);
+        disk_fifo_push(d);
+        disk_index(d);
+        pthread_mutex_unlock(&disk_lock);
+        loaded++;
+        if (rec.seq > newest) {
+            newest = rec.seq;
+            head = at + length;
+        }
+        at += length;
+    }
+
+    pthread_mutex_lock(&disk_lock);
+    disk_head = head;
+    disk_seq = newest + 1;
+
+    // Ring order starts at the write head: rotate the offset-ordered list
+    disk_entry* before = NULL;
+    for (disk_entry* d = disk_fifo_head; d != NULL && d->offset < disk_head; d = d->fifo_next) {
+        before = d;
+    }
+    if (before != NULL && before->fifo_next != NULL) {
+        disk_entry* first = disk_fifo_head;
+        disk_fifo_head = before->fifo_next;
+        disk_fifo_tail->fifo_next = first;
+        before->fifo_next = NULL;
+        disk_fifo_tail = before;
+    }
+    pthread_mutex_unlock(&disk_lock);
+    printf("Disk cache: %d records loaded\n", loaded);
+}
+
+// Let the writer start on the ring once the index is complete
+static void disk_start_writes(void) {
+    pthread_mutex_lock(&disk_queue_lock);
+    disk_ready = 1;
+    pthread_cond_broadcast(&disk_queue_cond);
+    pthread_mutex_unlock(&disk_queue_lock);
+}
+
+// Wait for queued writes to land, then stop the writer so the index stays
+// true to the file; returns 0 if the index was never complete
+int disk_quiesce(void) {
+    if (disk_fd < 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&disk_queue_lock);
+    while (disk_ready && disk_queue_bytes > 0) {
+        pthread_cond_wait(&disk_idle_cond, &disk_queue_lock);
+    }
+    int ready = disk_ready;
+    disk_ready = 0;
+    pthread_mutex_unlock(&disk_queue_lock);
+    return ready && fdatasync(disk_fd) == 0;
+}
+
+// Open (or create) the disk tier file and start its writer, which idles
+// until the index is loaded
+void disk_init(const char* path, off_t size) {
+    disk_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (disk_fd < 0 || ftruncate(disk_fd, size) < 0) {
+        perror("Disk cache open failed");
+        exit(EXIT_FAILURE);
+    }
+    disk_size = size;
+    disk_buckets = calloc(DISK_BUCKETS, sizeof(disk_entry*));
+    if (disk_buckets == NULL) {
+        perror("Disk cache index allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    cache_max_object = DISK_MAX_OBJECT;  // The index is loaded by warm_start()
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, disk_writer, NULL) != 0) {
+        perror("Disk writer thread creation failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+
+// Warm restart: at shutdown the RAM tier's entries and the disk tier's
+// index go into one snapshot file. The next start reads it on a background
+// thread while the listener already accepts, so early requests just miss.
+// Disk entries are checked against their record headers, and any mismatch
+// falls back to scanning the file
+
+static int snapshot_write(FILE* f, uint32_t kind, uint32_t flags, const char* key,
+                          const char* data, uint32_t data_len, const cache_freshness* fresh,
+                          off_t offset, uint64_t seq) {
+    snapshot_record rec = {0};
+    rec.kind = kind;
+    rec.flags = flags;
+    rec.key_len = strlen(key);
+    rec.data_len = data_len;
+    rec.expires = fresh->expires;
+    rec.stale_revalidate = fresh->stale_revalidate;
+    rec.stale_error = fresh->stale_error;
+    rec.offset = offset;
+    rec.seq = seq;
+    if (fwrite(&rec, sizeof(rec), 1, f) != 1 || fwrite(key, 1, rec.key_len, f) != rec.key_len) {
+        return -1;
+    }
+    return data == NULL || fwrite(data, 1, data_len, f) == data_len ? 0 : -1;
+}
+
+// Save the cache to path, replacing it atomically; the server has drained
+void snapshot_save(const char* path) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "wb");
+    if (f == NULL) {
+        perror("Snapshot open failed");
+        return;
+    }
+
+    snapshot_header header = {0};
+    header.magic = SNAPSHOT_MAGIC;
+    int with_disk = disk_quiesce();
+    if (with_disk) {
+        header.disk_size = disk_size;
+        header.disk_head = disk_head;
+        header.disk_seq = disk_seq;
+    }
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    int saved = 0;
+    int indexed = 0;
+
+    for (size_t i = 0; ok && i < cache_shard_count; i++) {
+        cache_shard* shard = &cache_shards[i];
+        pthread_mutex_lock(&shard->lock);
+        // Least protected queue and oldest entry first, so reloading
+        // rebuilds much the same order
+        for (int q = CACHE_QUEUES - 1; ok && q >= 0; q--) {
+            for (cache_element* e = shard->queues[q].tail; ok && e != NULL; e = e->queue_prev) {
+                cache_freshness fresh = {
+                    atomic_load(&e->expires),
+                    atomic_load(&e->stale_revalidate),
+                    atomic_load(&e->stale_error)
+                };
+                uint32_t flags = (e->is_vary ? CACHE_VARY : 0) | (e->from_disk ? CACHE_FROM_DISK : 0);
+                ok = snapshot_write(f, SNAPSHOT_RAM, flags, e->url, e->data, e->len, &fresh, 0, 0) == 0;
+                saved++;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    if (with_disk) {
+        pthread_mutex_lock(&disk_lock);
+        for (disk_entry* d = disk_fifo_head; ok && d != NULL; d = d->fifo_next) {
+            if (!d->indexed) {
+                continue;  // Superseded; its space is reclaimed as the ring wraps
+            }
+            uint32_t flags = (d->is_vary ? DISK_RECORD_VARY : 0) |
+                             (d->reusable ? DISK_RECORD_REUSABLE : 0);
+            ok = snapshot_write(f, SNAPSHOT_DISK, flags, d->key, NULL, d->data_len,
+                                &d->fresh, d->offset, d->seq) == 0;
+            indexed++;
+        }
+        pthread_mutex_unlock(&disk_lock);
+    }
+
+    snapshot_record end = {0};
+    end.kind = SNAPSHOT_END;
+    ok = ok && fwrite(&end, sizeof(end), 1, f) == 1 && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    if (fclose(f) != 0 || !ok || rename(tmp, path) < 0) {
+        perror("Snapshot write failed");
+        unlink(tmp);
+        return;
+    }
+    printf("Snapshot: %d cached responses and %d disk records saved\n", saved, indexed);
+}
+
+// Index entry for a disk record a snapshot lists, or NULL if the file no
+// longer holds that record
+static disk_entry* disk_restore(const snapshot_record* rec, const char* key) {
+    disk_record header;
+    off_t length = disk_align(sizeof(header) + rec->key_len + rec->data_len);
+    if (rec->offset < 0 || rec->offset + length > disk_size ||
+            pread(disk_fd, &header, sizeof(header), rec->offset) != sizeof(header) ||
+            header.magic != DISK_MAGIC || header.check != disk_record_check(&header) ||
+            header.seq != rec->seq || header.key_len != rec->key_len ||
+            header.data_len != rec->data_len) {
+        return NULL;
+    }
+    return disk_entry_create(&header, rec->offset, key);
+}
+
+// Load a snapshot; returns 1 when it also restored the disk tier's index
+static int snapshot_load(const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        return 0;
+    }
+    unlink(path);  // Consumed: a crash later in this run must not reuse it
+
+    snapshot_header header;
+    snapshot_record rec;
+    char key[MAX_BYTES];
+    char* data = malloc(MAX_ELEMENT_LIMIT);
+    disk_entry* pending = NULL;
+    disk_entry** pending_tail = &pending;
+    int restored = 0;
+    int indexed = 0;
+    int complete = 0;
+
+    int trusted = 0;
+    if (data != NULL && fread(&header, sizeof(header), 1, f) == 1 &&
+            header.magic == SNAPSHOT_MAGIC) {
+        trusted = disk_fd >= 0 && header.disk_size == disk_size &&
+                  header.disk_head >= 0 && header.disk_head <= disk_size;
+        while (fread(&rec, sizeof(rec), 1, f) == 1) {
+            if (rec.kind == SNAPSHOT_END) {
+                complete = 1;
+                break;
+            }
+            if (rec.key_len >= sizeof(key) || fread(key, 1, rec.key_len, f) != rec.key_len) {
+                break;
+            }
+            key[rec.key_len] = '\0';
+            if (rec.kind == SNAPSHOT_RAM) {
+                if (rec.data_len > MAX_ELEMENT_LIMIT ||
+                        fread(data, 1, rec.data_len, f) != rec.data_len) {
+                    break;
+                }
+                cache_freshness fresh = {rec.expires, rec.stale_revalidate, rec.stale_error};
+                restored += add_to_cache(data, rec.data_len, key, cache_hash(key, rec.key_len),
+                                         (rec.flags & (CACHE_VARY | CACHE_FROM_DISK)) |
+                                         CACHE_IF_ABSENT, &fresh);
+            } else if (rec.kind == SNAPSHOT_DISK) {
+                disk_entry* d = trusted ? disk_restore(&rec, key) : NULL;
+                if (d == NULL) {
+                    trusted = 0;  // The file changed after the snapshot
+                    continue;
+                }
+                *pending_tail = d;
+                pending_tail = &d->fifo_next;
+            } else {
+                break;
+            }
+        }
+    }
+    fclose(f);
+    free(data);
+
+    trusted = trusted && complete;
+    if (trusted) {
+        pthread_mutex_lock(&disk_lock);
+        while (pending != NULL) {
+            disk_entry* d = pending;
+            pending = d->fifo_next;
+            disk_fifo_push(d);
+            disk_index(d);
+            indexed++;
+        }
+        disk_head = header.disk_head;
+        disk_seq = header.disk_seq;
+        pthread_mutex_unlock(&disk_lock);
+    }
+    while (pending != NULL) {
+        disk_entry* d = pending;
+        pending = d->fifo_next;
+        free(d->key);
+        free(d);
+    }
+    printf("Warm start: %d cached responses and %d disk records restored\n", restored, indexed);
+    return trusted;
+}
+
+static void* warm_start_thread(void* arg) {
+    const char* path = arg;
+    int restored = path != NULL && snapshot_load(path);
+    if (disk_fd >= 0) {
+        if (!restored) {
+            disk_load();
+        }
+        disk_start_writes();
+    }
+    return NULL;
+}
+
+// Fill the cache from a snapshot and the disk tier's file without holding
+// up startup; lookups simply miss until it is done
+void warm_start(const char* snapshot_path) {
+    if (snapshot_path == NULL && disk_fd < 0) {
+        return;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, warm_start_thread, (void*)snapshot_path) != 0) {
+        perror("Warm start thread creation failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+// Logging: each thread formats its lines into a ring of its own, which a
+// flusher thread drains every LOG_FLUSH_MS with one write per stream. The
+// thread appends at head and the flusher advances tail, so neither locks;
+// a line that finds its ring full is counted and dropped rather than wait
+
+static __thread log_ring* tls_log = NULL;
+
+static log_ring* log_thread_ring(void) {
+    if (tls_log == NULL) {
+        log_ring* r = aligned_alloc(64, sizeof(log_ring));
+        if (r == NULL) {
+            perror("Log ring allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        memset(r, 0, offsetof(log_ring, data));
+        pthread_mutex_lock(&log_lock);
+        r->next = log_head;
+        log_head = r;
+        pthread_mutex_unlock(&log_lock);
+        tls_log = r;
+    }
+    return tls_log;
+}
+
+static uint32_t log_record_size(int len) {
+    return (sizeof(log_record) + len + 3) & ~3u;
+}
+
+static void log_vwrite(int to_stderr, const char* format, va_list ap) {
+    char line[LOG_LINE_MAX];
+    int len = vsnprintf(line, sizeof(line), format, ap);
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';  // Cut short, but still a line
+    }
+    if (len <= 0) {
+        return;
+    }
+
+    // A record that would run past the end starts over at the beginning,
+    // the rest of the end marked as padding
+    log_ring* r = log_thread_ring();
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    uint32_t offset = head & (LOG_RING_BYTES - 1);
+    uint32_t need = log_record_size(len);
+    uint32_t pad = offset + need > LOG_RING_BYTES ? LOG_RING_BYTES - offset : 0;
+    if (LOG_RING_BYTES - (head - tail) < pad + need) {
+        atomic_store_explicit(&r->dropped, atomic_load_explicit(&r->dropped, memory_order_relaxed) + 1,
+                              memory_order_relaxed);
+        return;
+    }
+    if (pad > 0) {
+        ((log_record*)(r->data + offset))->len = LOG_PAD;
+        offset = 0;
+    }
+    log_record* rec = (log_record*)(r->data + offset);
+    rec->len = len;
+    rec->to_stderr = to_stderr;
+    memcpy(rec->text, line, len);
+    atomic_store_explicit(&r->head, head + pad + need, memory_order_release);
+}
+
+// printf() for threads serving requests: never blocks on the terminal
+void log_info(const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    log_vwrite(0, format, ap);
+    va_end(ap);
+}
+
+void log_error(const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    log_vwrite(1, format, ap);
+    va_end(ap);
+}
+
+// Write out everything queued so far. Lines keep their order within a
+// thread; lines from different threads interleave by ring
+void log_flush(void) {
+    pthread_mutex_lock(&log_lock);
+    for (log_ring* r = log_head; r != NULL; r = r->next) {
+        uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        while (tail != head) {
+            uint32_t offset = tail & (LOG_RING_BYTES - 1);
+            const log_record* rec = (const log_record*)(r->data + offset);
+            if (rec->len == LOG_PAD) {
+                tail += LOG_RING_BYTES - offset;
+                continue;
+            }
+            fwrite(rec->text, 1, rec->len, rec->to_stderr ? stderr : stdout);
+            tail += log_record_size(rec->len);
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+        uint64_t dropped = atomic_load_explicit(&r->dropped, memory_order_relaxed);
+        if (dropped != r->dropped_reported) {
+            fprintf(stderr, "Log ring full: %lu lines dropped\n", dropped - r->dropped_reported);
+            r->dropped_reported = dropped;
+        }
+    }
+    fflush(stdout);
+    fflush(stderr);
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void* log_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        usleep(LOG_FLUSH_MS * 1000);
+        log_flush();
+    }
+    return NULL;
+}
+
+void log_start(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, log_thread, NULL) != 0) {
+        perror("Log thread creation failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+// Keep a slow request's trace line among the last SLOW_SAMPLES
+void trace_sample(const char* line) {
+    pthread_mutex_lock(&slow_lock);
+    snprintf(slow_samples[slow_next % SLOW_SAMPLES], LOG_LINE_MAX, "%s", line);
+    slow_next++;
+    pthread_mutex_unlock(&slow_lock);
+}
+
+// The kept samples, newest first, for the admin listener's /slow
+char* trace_render(size_t* len) {
+    char* out = NULL;
+    FILE* f = open_memstream(&out, len);
+    if (f == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&slow_lock);
+    for (uint64_t i = 1; i <= SLOW_SAMPLES && i <= slow_next; i++) {
+        fputs(slow_samples[(slow_next - i) % SLOW_SAMPLES], f);
+    }
+    pthread_mutex_unlock(&slow_lock);
+    fclose(f);
+    return out;
+}
+
+
+// Metrics: every thread counts into its own thread_stats block, written
+// only by that thread, and a scrape of the admin listener's /metrics sums
+// the blocks into Prometheus text format. Blocks outlive their threads so
+// counters never go backwards
+
+static const int64_t latency_bounds_us[LATENCY_BUCKETS] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000
+};
+
+static const char* const stat_names[STAT_COUNTERS] = {
+    "hit", "disk_hit", "stale", "coalesced", "revalidate", "peer", "shed", "miss",
+    "evictions", "cache", "origin", "opened", "closed"
+};
+
+static const char* const histogram_names[HIST_COUNT][2] = {
+    {"proxy_upstream_connect_seconds", "Time to establish new origin connections."},
+    {"proxy_upstream_ttfb_seconds", "Time from sending a request upstream to its first response byte."},
+    {"proxy_request_duration_seconds", "Time from a complete request to the end of its response."}
+};
+
+static __thread thread_stats* tls_stats = NULL;
+
+static thread_stats* stats_thread_block(void) {
+    if (tls_stats == NULL) {
+        thread_stats* s = aligned_alloc(64, sizeof(thread_stats));
+        if (s == NULL) {
+            perror("Metrics allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        memset(s, 0, sizeof(*s));
+        pthread_mutex_lock(&stats_lock);
+        s->next = stats_head;
+        stats_head = s;
+        pthread_mutex_unlock(&stats_lock);
+        tls_stats = s;
+    }
+    return tls_stats;
+}
+
+// Only the owning thread writes, so a relaxed load and store is enough
+static void stat_bump(_Atomic uint64_t* v, uint64_t n) {
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+void stat_add(stat_counter counter, uint64_t n) {
+    stat_bump(&stats_thread_block()->counters[counter], n);
+}
+
+void stat_latency(stat_histogram histogram, int64_t us) {
+    latency_histogram* h = &stats_thread_block()->latency[histogram];
+    int b = 0;
+    while (b < LATENCY_BUCKETS && us > latency_bounds_us[b]) {
+        b++;
+    }
+    stat_bump(&h->buckets[b], 1);
+    stat_bump(&h->sum_us, us > 0 ? us : 0);
+}
+
+// Prometheus text exposition of every thread's counters, summed; the
+// caller frees it
+static char* stats_render(size_t* len) {
+    uint64_t counters[STAT_COUNTERS] = {0};
+    uint64_t buckets[HIST_COUNT][LATENCY_BUCKETS + 1] = {{0}};
+    uint64_t sums[HIST_COUNT] = {0};
+    pthread_mutex_lock(&stats_lock);
+    for (thread_stats* s = stats_head; s != NULL; s = s->next) {
+        for (int i = 0; i < STAT_COUNTERS; i++) {
+            counters[i] += atomic_load_explicit(&s->counters[i], memory_order_relaxed);
+        }
+        for (int h = 0; h < HIST_COUNT; h++) {
+            for (int b = 0; b <= LATENCY_BUCKETS; b++) {
+                buckets[h][b] += atomic_load_explicit(&s->latency[h].buckets[b], memory_order_relaxed);
+            }
+            sums[h] += atomic_load_explicit(&s->latency[h].sum_us, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+
+    size_t entries = 0;
+    size_t bytes = 0;
+    for (size_t i = 0; i < cache_shard_count; i++) {
+        pthread_mutex_lock(&cache_shards[i].lock);
+        entries += cache_shards[i].element_count;
+        bytes += cache_shards[i].size;
+        pthread_mutex_unlock(&cache_shards[i].lock);
+    }
+
+    char* out = NULL;
+    FILE* f = open_memstream(&out, len);
+    if (f == NULL) {
+        return NULL;
+    }
+    fprintf(f, "# HELP proxy_cache_requests_total Requests by how the cache answered them.\n"
+               "# TYPE proxy_cache_requests_total counter\n");
+    for (int i = STAT_HIT; i <= STAT_MISS; i++) {
+        fprintf(f, "proxy_cache_requests_total{result=\"%s\"} %lu\n", stat_names[i], counters[i]);
+    }
+    fprintf(f, "# HELP proxy_cache_evictions_total Entries evicted from the RAM tier.\n"
+               "# TYPE proxy_cache_evictions_total counter\n"
+               "proxy_cache_evictions_total %lu\n", counters[STAT_EVICTIONS]);
+    fprintf(f, "# HELP proxy_response_bytes_total Response bytes sent to clients by source.\n"
+               "# TYPE proxy_response_bytes_total counter\n");
+    for (int i = STAT_BYTES_CACHE; i <= STAT_BYTES_ORIGIN; i++) {
+        fprintf(f, "proxy_response_bytes_total{source=\"%s\"} %lu\n", stat_names[i], counters[i]);
+    }
+    fprintf(f, "# HELP proxy_connections_total Client connections accepted.\n"
+               "# TYPE proxy_connections_total counter\n"
+               "proxy_connections_total %lu\n"
+               "# HELP proxy_connections_active Client connections open now.\n"
+               "# TYPE proxy_connections_active gauge\n"
+               "proxy_connections_active %lu\n",
+            counters[STAT_CONN_OPENED], counters[STAT_CONN_OPENED] - counters[STAT_CONN_CLOSED]);
+    fprintf(f, "# HELP proxy_cache_entries Entries in the RAM tier.\n"
+               "# TYPE proxy_cache_entries gauge\n"
+               "proxy_cache_entries %zu\n"
+               "# HELP proxy_cache_bytes Bytes charged to the RAM tier.\n"
+               "# TYPE proxy_cache_bytes gauge\n"
+               "proxy_cache_bytes %zu\n", entries, bytes);
+    if (upstream_count > 0) {
+        fprintf(f, "# HELP proxy_upstream_outstanding Requests in progress on each backend.\n"
+                   "# TYPE proxy_upstream_outstanding gauge\n");
+        for (int i = 0; i < upstream_count; i++) {
+            fprintf(f, "proxy_upstream_outstanding{backend=\"%s:%d\"} %d\n", upstreams[i].host,
+                    upstreams[i].port, atomic_load(&upstreams[i].outstanding));
+        }
+        fprintf(f, "# HELP proxy_upstream_usable Whether each backend is taking traffic.\n"
+                   "# TYPE proxy_upstream_usable gauge\n");
+        int64_t now = now_ms();
+        for (int i = 0; i < upstream_count; i++) {
+            fprintf(f, "proxy_upstream_usable{backend=\"%s:%d\"} %d\n", upstreams[i].host,
+                    upstreams[i].port, upstream_usable(&upstreams[i], now));
+        }
+        fprintf(f, "# HELP proxy_upstream_ejections_total Passive outlier ejections of each backend.\n"
+                   "# TYPE proxy_upstream_ejections_total counter\n");
+        for (int i = 0; i < upstream_count; i++) {
+            fprintf(f, "proxy_upstream_ejections_total{backend=\"%s:%d\"} %lu\n", upstreams[i].host,
+                    upstreams[i].port, atomic_load(&upstreams[i].ejected_total));
+        }
+    }
+
+    for (int h = 0; h < HIST_COUNT; h++) {
+        const char* name = histogram_names[h][0];
+        fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_names[h][1], name);
+        uint64_t cumulative = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            cumulative += buckets[h][b];
+            fprintf(f, "%s_bucket{le=\"%g\"} %lu\n", name, latency_bounds_us[b] / 1e6, cumulative);
+        }
+        cumulative += buckets[h][LATENCY_BUCKETS];
+        fprintf(f, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.6f\n%s_count %lu\n",
+                name, cumulative, name, sums[h] / 1e6, name, cumulative);
+    }
+    if (fclose(f) != 0) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static void send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+// Admin listener: one blocking request per connection, off the event loops
+static void* stats_thread(void* arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            // EMFILE and the like persist: retrying at once would spin
+            if (errno != EINTR && errno != ECONNABORTED) {
+                usleep(ADMIN_ACCEPT_BACKOFF_MS * 1000);
+            }
+            continue;
+        }
+        struct timeval tv = {ADMIN_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        char req[MAX_BYTES];
+        int len = 0;
+        while (len < (int)sizeof(req) - 1) {
+            ssize_t n = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+            if (n <= 0) {
+                break;
+            }
+            len += n;
+            req[len] = '\0';
+            if (strstr(req, "\r\n\r\n") != NULL) {
+                break;
+            }
+        }
+        req[len] = '\0';
+
+        size_t body_len = 0;
+        char* body = NULL;
+        const char* type = "text/plain; version=0.0.4";
+        if (strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET /metrics?", 13) == 0) {
+            body = stats_render(&body_len);
+        } else if (strncmp(req, "GET /slow ", 10) == 0) {
+            body = trace_render(&body_len);
+            type = "text/plain";
+        }
+        char head[256];
+        int head_len;
+        if (body != NULL) {
+            head_len = snprintf(head, sizeof(head),
+                                "HTTP/1.1 200 OK\r\n"
+                                "Content-Type: %s\r\n"
+                                "Content-Length: %zu\r\n"
+                                "Connection: close\r\n\r\n", type, body_len);
+        } else {
+            head_len = snprintf(head, sizeof(head),
+                                "HTTP/1.1 404 Not Found\r\n"
+                                "Content-Length: 0\r\n"
+                                "Connection: close\r\n\r\n");
+        }
+        send_all(fd, head, head_len);
+        send_all(fd, body, body_len);
+        free(body);
+        close(fd);
+    }
+    return NULL;
+}
+
+// Serve /metrics and /slow on an already listening socket
+void stats_start(int listen_fd) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, stats_thread, (void*)(intptr_t)listen_fd) != 0) {
+        perror("Admin thread creation failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
 }